@@ -7,6 +7,7 @@
 #  you can use it under the MIT license.
 #
 
+import os
 import sys
 setup_kwds = {}
 if sys.version_info > (3,):
@@ -57,6 +58,12 @@ CLASSIFIERS = [
     "License :: OSI Approved :: MIT License"
 ]
 
+#  Set TNETSTRING_STATS=1 in the environment to build the C extension with
+#  counters for profiling, readable through _tnetstring.stats().
+DEFINE_MACROS = []
+if os.environ.get("TNETSTRING_STATS","0") not in ("","0"):
+    DEFINE_MACROS.append(("TNS_STATS","1"))
+
 setup(name=NAME,
       version=VERSION,
       author=AUTHOR,
@@ -68,7 +75,8 @@ setup(name=NAME,
       keywords=KEYWORDS,
       packages=["tnetstring","tnetstring.tests"],
       ext_modules = [
-          Extension(name="_tnetstring",sources=["tnetstring/_tnetstring.c"]),
+          Extension(name="_tnetstring",sources=["tnetstring/_tnetstring.c"],
+                    define_macros=DEFINE_MACROS),
       ],
       classifiers=CLASSIFIERS,
       **setup_kwds
@@ -30,6 +30,37 @@ Simple enough?  This module gives you the following functions:
     :loads:   load a tnetstring-encoded object from a string
     :pop:     pop a tnetstring-encoded object from the front of a string
 
+If you're decoding dicts with a known set of keys, the Schema class can
+check their types and build a tuple or object directly from the values::
+
+    >>> user = tnetstring.Schema([("name",str),("admin",bool),("email",str,False)])
+    >>> user.loads("28:4:name,3:bob,5:admin,4:true!}")
+    ('bob', True, None)
+
+For handlers behind the Mongrel2 webserver, parse_mongrel2_request() splits
+a request frame into its uuid, connection id, path, parsed headers and body.
+The body is returned as a buffer onto the request, so it isn't copied::
+
+    >>> req = "UUID 42 /path 11:4:PATH,1:/,}5:hello,"
+    >>> (uuid,id,path,headers,body) = tnetstring.parse_mongrel2_request(req)
+    >>> print headers, str(body)
+    {'PATH': '/'} hello
+
+Replies are built with build_mongrel2_response(), which can address many
+connection ids at once.  Large bodies are returned alongside the header
+rather than copied into it, ready for a gathering write::
+
+    >>> tnetstring.build_mongrel2_response("UUID",[1,2],"hello")
+    'UUID 3:1 2, hello'
+
+For multi-threaded servers, loads_async() does the parsing on a pool of
+background threads without holding the GIL.  It returns a Future, whose
+result() builds the python objects from the parsed data::
+
+    >>> future = tnetstring.loads_async("16:5:hello,5:world,]")
+    >>> future.result()
+    ['hello', 'world']
+
 Note that since parsing a tnetstring requires reading all the data into memory
 at once, there's no efficiency gain from using the file-based versions of these
 functions.  They're only here so you can use load() to read precisely one
@@ -55,6 +86,7 @@ __ver_sub__ = ""
 __version__ = "%d.%d.%d%s" % (__ver_major__,__ver_minor__,__ver_patch__,__ver_sub__)
 
 
+import sys
 from collections import deque
 
 
@@ -245,6 +277,35 @@ def loads(string,encoding=None):
     return pop(string,encoding)[0]
 
 
+def loads_async(string,encoding=None):
+    """loads_async(string,encoding=None) -> Future
+
+    This function parses a tnetstring in the background, returning an
+    object whose result() method gives the parsed value.  The pure-python
+    version can't do any better than parsing it straight away.
+    """
+    return _Future(loads,string,encoding)
+
+
+class _Future(object):
+    """The result of a call to loads_async()."""
+
+    def __init__(self,func,*args):
+        self._result = self._exc_info = None
+        try:
+            self._result = func(*args)
+        except Exception:
+            self._exc_info = sys.exc_info()
+
+    def done(self):
+        return True
+
+    def result(self):
+        if self._exc_info is not None:
+            raise self._exc_info[0], self._exc_info[1], self._exc_info[2]
+        return self._result
+
+
 def load(file,encoding=None):
     """load(file,encoding=None) -> object
 
@@ -378,6 +439,163 @@ def pop(string,encoding=None):
     raise ValueError("unknown type tag")
 
 
+def parse_mongrel2_request(msg,encoding=None):
+    """parse_mongrel2_request(msg,encoding=None) -> (uuid,id,path,headers,body)
+
+    This function splits a request frame from the Mongrel2 webserver, which
+    looks like "UUID ID PATH SIZE:HEADERS,SIZE:BODY,".  The headers are
+    parsed as a tnetstring, and the body is returned as a buffer referencing
+    the request data.
+    """
+    try:
+        (uuid,id,path,rest) = msg.split(" ",3)
+    except ValueError:
+        raise ValueError("not a mongrel2 request: missing envelope fields")
+    (headers,rest) = pop(rest,encoding)
+    #  Find the body by hand, so that we don't make a copy of it.
+    (blen,_,body) = rest.partition(":")
+    if not blen.isdigit() or (len(blen) > 1 and blen[0] == "0"):
+        raise ValueError("not a mongrel2 request: invalid body")
+    blen = int(blen)
+    if len(body) != blen + 1 or body[-1] != ",":
+        raise ValueError("not a mongrel2 request: invalid body")
+    body = buffer(msg,len(msg) - blen - 1,blen)
+    return (uuid,id,path,headers,body)
+
+
+def build_mongrel2_response(uuid,ids,body,max_copy=65536):
+    """build_mongrel2_response(uuid,ids,body,max_copy=65536) -> string
+
+    This function builds a reply to send to the Mongrel2 webserver, which
+    looks like "UUID SIZE:ID ID ID, BODY".  The ids may be a single id or a
+    list of them.  The body must be a bytestring or buffer; encode unicode
+    yourself.  If the body is longer than max_copy bytes, it returns a
+    tuple (header,body) rather than copying the body into a new string.
+    """
+    if isinstance(ids,(str,int,long)):
+        ids = (ids,)
+    ids = tuple(ids)
+    if not ids:
+        raise ValueError("must give at least one connection id")
+    for id in ids:
+        if not isinstance(id,(str,int,long)) or isinstance(id,bool):
+            raise TypeError("connection ids must be strings or integers")
+        if not isinstance(id,str) and id < 0:
+            raise ValueError("connection ids cannot be negative")
+    if isinstance(body,unicode):
+        raise TypeError("body must be a string or buffer, not unicode")
+    ids = " ".join(str(id) for id in ids)
+    header = "%s %d:%s, " % (uuid,len(ids),ids)
+    if len(body) > max_copy:
+        return (header,body)
+    return header + str(body)
+
+
+
+#  Expected type tag for each of the python types allowed in a Schema.
+#  The generic object type means that any value is accepted.
+_SCHEMA_TAGS = {
+    str: ",", unicode: ",", int: "#", long: "#", float: "^", bool: "!",
+    type(None): "~", None: "~", list: "]", dict: "}", object: None,
+}
+
+
+def _type_tag(value):
+    """Get the tnetstring type tag for a parsed python value."""
+    if value is None:
+        return "~"
+    if value is True or value is False:
+        return "!"
+    if isinstance(value,(int,long)):
+        return "#"
+    if isinstance(value,float):
+        return "^"
+    if isinstance(value,(str,unicode)):
+        return ","
+    if isinstance(value,list):
+        return "]"
+    return "}"
+
+
+class Schema(object):
+    """Schema(fields,factory=None,encoding=None)
+
+    Decoder for tnetstring dicts with a known set of keys.  The fields are
+    (name,type[,required]) tuples; values are checked against the type and
+    passed to the factory in order, or returned as a tuple if no factory is
+    given.  Missing optional fields are passed as None, and keys that aren't
+    in the schema are ignored.  A type may also be a nested Schema instance.
+    """
+
+    def __init__(self,fields,factory=None,encoding=None):
+        self._fields = []
+        self._index = {}
+        for field in fields:
+            if not isinstance(field,tuple) or not 2 <= len(field) <= 3:
+                raise TypeError("fields must be (name,type[,required]) tuples")
+            (name,type,required) = (field + (True,))[:3]
+            if not isinstance(name,str):
+                raise TypeError("schema field names must be strings")
+            if isinstance(type,Schema):
+                tag = "}"
+            else:
+                try:
+                    tag = _SCHEMA_TAGS[type]
+                except (KeyError,TypeError):
+                    raise TypeError("unsupported schema field type")
+            if name in self._index:
+                raise ValueError("duplicate schema field '%s'" % (name,))
+            self._index[name] = len(self._fields)
+            self._fields.append((name,tag,bool(required),type))
+        self.names = tuple(f[0] for f in self._fields)
+        if factory is tuple:
+            factory = None
+        self._factory = factory
+        self._encoding = encoding
+
+    def loads(self,string):
+        """loads(string) -> object
+
+        This function parses a tnetstring dict using the schema.
+        """
+        return self.pop(string)[0]
+
+    def pop(self,string):
+        """pop(string) -> (object, remain)
+
+        This function parses a tnetstring dict using the schema.
+        It returns a tuple giving the parsed object and a string
+        containing any unparsed data.
+        """
+        (value,remain) = pop(string,self._encoding)
+        if not isinstance(value,dict):
+            raise ValueError("Schema can only decode a dict.")
+        return (self._build(value),remain)
+
+    def _build(self,value):
+        vals = [None] * len(self._fields)
+        seen = [False] * len(self._fields)
+        for (key,item) in value.iteritems():
+            i = self._index.get(key)
+            if i is None:
+                continue
+            (name,tag,required,type) = self._fields[i]
+            itag = _type_tag(item)
+            if tag is not None and tag != itag:
+                if required or itag != "~":
+                    msg = "Schema field '%s' expects type '%s', got '%s'."
+                    raise ValueError(msg % (name,tag,itag))
+            if isinstance(type,Schema) and itag == "}":
+                item = type._build(item)
+            vals[i] = item
+            seen[i] = True
+        for (i,(name,tag,required,type)) in enumerate(self._fields):
+            if required and not seen[i]:
+                raise ValueError("Schema field '%s' is missing." % (name,))
+        if self._factory is None:
+            return tuple(vals)
+        return self._factory(*vals)
+
 
 #  Use the c-extension version if available
 try:
@@ -388,5 +606,9 @@ else:
     dumps = _tnetstring.dumps
     load = _tnetstring.load
     loads = _tnetstring.loads
+    loads_async = _tnetstring.loads_async
     pop = _tnetstring.pop
+    Schema = _tnetstring.Schema
+    parse_mongrel2_request = _tnetstring.parse_mongrel2_request
+    build_mongrel2_response = _tnetstring.build_mongrel2_response
 
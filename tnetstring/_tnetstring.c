@@ -8,29 +8,139 @@
 //    load:   parse tnetstring from a file-like object
 //    pop:    parse tnetstring into a python object,
 //            return it along with unparsed data.
+//    parse_mongrel2_request:  split a mongrel2 request frame into its
+//            envelope fields, parsed headers and body.
+//    build_mongrel2_response:  build a mongrel2 reply to some connections.
+//    stats:  get the counters kept by the core, if built with TNS_STATS.
+//    loads_async:  parse tnetstring on a background thread, returning
+//            a Future for the python object.
 
 #include <Python.h>
+#include <structmember.h>
+
+#if defined(WITH_THREAD) && (defined(__unix__) || defined(__APPLE__))
+  #include <pthread.h>
+  #include <signal.h>
+  #include <unistd.h>
+  #define TNS_HAVE_PTHREAD 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+  #include <emmintrin.h>
+  #define TNS_HAVE_SSE2 1
+#endif
+
+
+//  Thread-local storage, for state that each thread should keep to itself.
+#if defined(_MSC_VER)
+  #define TNS_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+  #define TNS_THREAD_LOCAL __thread
+#else
+  #define TNS_THREAD_LOCAL
+#endif
 
 
 #define TNS_MAX_LENGTH 999999999
 #include "tns_core.c"
+#include "tns_dom.c"
 
 
+//  The module keeps the state below, and nothing else.  Python 2 has no
+//  per-module state, and an extension is only initialized once however
+//  many subinterpreters import it, so it's all process-wide.  Each piece
+//  is either fixed once init_tnetstring has run, guarded by the GIL, kept
+//  per thread, or guarded by a lock of its own:
+//
+//    _tnetstring_ops_bytes, builtin unicode ops:  fixed after init.
+//    _tnetstring_encodings:  the GIL.  Entries are added but never replaced.
+//    _tnetstring_dumps_hint:  per thread, if the compiler supports it.
+//    TNS_STATS counters:  the GIL; the worker threads never update them.
+//    The loads_async pool:  its own mutex; see _tnetstring_pool.
+
 //  We have one static tns_ops struct for parsing bytestrings.
 static tns_ops _tnetstring_ops_bytes;
 
-//  Unicode parsing ops are created on demand.
-//  We allocate a struct containing all the function pointers along with
-//  the encoding string, as a primitive kind of closure.
-//  Eventually we should cache these.
+//  Unicode parsing ops are created on demand and cached by encoding name.
+//  Each is a struct containing all the function pointers along with
+//  the encoding and its resolved codec functions, as a primitive kind
+//  of closure.  The 'encode' function turns a unicode object into bytes.
+struct tns_ops_with_encoding_s;
+typedef struct tns_ops_with_encoding_s tns_ops_with_encoding;
+
 struct tns_ops_with_encoding_s {
   tns_ops ops;
-  char *encoding;
+  PyObject *encoding;
+  PyObject *decoder;
+  PyObject *encoder;
+  PyObject* (*encode)(const tns_ops_with_encoding *opswe, PyObject *val);
 };
-typedef struct tns_ops_with_encoding_s tns_ops_with_encoding;
+
+//  The common encodings get static ops structs that call straight into
+//  the matching PyUnicode codec, bypassing the codec registry entirely.
+static tns_ops_with_encoding _tnetstring_ops_utf8;
+static tns_ops_with_encoding _tnetstring_ops_ascii;
+static tns_ops_with_encoding _tnetstring_ops_latin1;
+
+//  Dict mapping encoding names to a PyCapsule wrapping their ops struct.
+//  It's keyed by whatever name the caller passed, so "utf8", "UTF-8" and
+//  "u8" each get an entry of their own.  Entries are never removed or
+//  replaced, so the returned ops are borrowed references; the flip side
+//  is that the cache is unbounded, growing by one entry for each distinct
+//  name of a known encoding that callers ever pass.  Unknown names fail
+//  the codec lookup and are not cached.
+static PyObject *_tnetstring_encodings = NULL;
 
 static tns_ops *_tnetstring_get_unicode_ops(PyObject *encoding);
 
+//  Estimate of recent output sizes from dumps(), for sizing its outbuf.
+//  Threads serving different kinds of message would drag a shared estimate
+//  back and forth, so each thread keeps its own.  Compilers without thread
+//  locals fall back to one shared hint, which is still safe under the GIL.
+static TNS_THREAD_LOCAL tns_outbuf_hint _tnetstring_dumps_hint;
+
+//  Copies of the core parse and render loops specialized to the bytestring
+//  ops, which call each callback directly rather than through the struct
+//  and so let the compiler inline them.  They're built from tns_core_tmpl.h
+//  further down, once the callbacks have been defined.
+static void* tns_bytes_parse(const tns_ops *ops, const char *data,
+                             size_t len, char **remain);
+static void* tns_bytes_parse_payload(const tns_ops *ops, tns_type_tag type,
+                                     const char *data, size_t len);
+static int tns_bytes_render_value(const tns_ops *ops, void *val,
+                                  tns_outbuf *outbuf);
+
+//  Use the specialized loops for the bytestring ops, and the generic
+//  ones for everything else.
+static INLINE void*
+_tnetstring_parse(const tns_ops *ops, const char *data, size_t len,
+                  char **remain)
+{
+  if(ops == &_tnetstring_ops_bytes) {
+      return tns_bytes_parse(ops, data, len, remain);
+  }
+  return tns_parse(ops, data, len, remain);
+}
+
+static INLINE void*
+_tnetstring_parse_payload(const tns_ops *ops, tns_type_tag type,
+                          const char *data, size_t len)
+{
+  if(ops == &_tnetstring_ops_bytes) {
+      return tns_bytes_parse_payload(ops, type, data, len);
+  }
+  return tns_parse_payload(ops, type, data, len);
+}
+
+static INLINE int
+_tnetstring_render_value(const tns_ops *ops, void *val, tns_outbuf *outbuf)
+{
+  if(ops == &_tnetstring_ops_bytes) {
+      return tns_bytes_render_value(ops, val, outbuf);
+  }
+  return tns_render_value(ops, val, outbuf);
+}
+
 
 //  _tnetstring_loads:  parse tnetstring-format value from a string.
 //
@@ -56,23 +166,19 @@ _tnetstring_loads(PyObject* self, PyObject *args)
   if(encoding == Py_None) {
       data = PyString_AS_STRING(string);
       len = PyString_GET_SIZE(string);
-      val = tns_parse(ops, data, len, NULL);
+      val = _tnetstring_parse(ops, data, len, NULL);
   } else {
       if(!PyString_Check(encoding)) {
           PyErr_SetString(PyExc_TypeError, "encoding must be a string");
           goto error;
       }
-      Py_INCREF(encoding);
       ops = _tnetstring_get_unicode_ops(encoding);
       if(ops == NULL) {
-          Py_DECREF(encoding);
           goto error;
       }
       data = PyString_AS_STRING(string);
       len = PyString_GET_SIZE(string);
-      val = tns_parse(ops, data, len, NULL);
-      free(ops);
-      Py_DECREF(encoding);
+      val = _tnetstring_parse(ops, data, len, NULL);
   }
 
   Py_DECREF(string);
@@ -113,7 +219,6 @@ _tnetstring_load(PyObject* self, PyObject *args)
           PyErr_SetString(PyExc_TypeError, "encoding must be a string");
           goto error;
       }
-      Py_INCREF(encoding);
       ops = _tnetstring_get_unicode_ops(encoding);
       if(ops == NULL) {
           goto error;
@@ -208,24 +313,15 @@ _tnetstring_load(PyObject* self, PyObject *args)
 
   //  Parse out the payload object
   data = PyString_AS_STRING(res);
-  val = tns_parse_payload(ops, data[datalen], data, datalen);
+  val = _tnetstring_parse_payload(ops, data[datalen], data, datalen);
   Py_DECREF(res); res = NULL;
 
-  if(ops != &_tnetstring_ops_bytes) {
-      free(ops);
-      Py_DECREF(encoding);
-  }
-
   return val;
 
 error:
   if(file != NULL) {
       Py_DECREF(file);
   }
-  if(ops != &_tnetstring_ops_bytes) {
-      free(ops);
-      Py_DECREF(encoding);
-  }
   if(methnm != NULL) {
       Py_DECREF(methnm);
   }
@@ -251,10 +347,1343 @@ _tnetstring_pop(PyObject* self, PyObject *args)
   PyObject *result = NULL;
   PyObject *encoding = Py_None;
   tns_ops *ops = &_tnetstring_ops_bytes;
-  char *data, *remain;
-  size_t len;
+  char *data, *remain;
+  size_t len;
+
+  if(!PyArg_UnpackTuple(args, "pop", 1, 2, &string, &encoding)) {
+      return NULL;
+  }
+  if(!PyString_Check(string)) {
+      PyErr_SetString(PyExc_TypeError, "arg must be a string");
+      return NULL;
+  }
+  if(encoding != Py_None) {
+      if(!PyString_Check(encoding)) {
+          PyErr_SetString(PyExc_TypeError, "encoding must be a string");
+          return NULL;
+      }
+      ops = _tnetstring_get_unicode_ops(encoding);
+      if(ops == NULL) {
+          return NULL;
+      }
+  }
+  Py_INCREF(string);
+
+  data = PyString_AS_STRING(string);
+  len = PyString_GET_SIZE(string);
+  val = _tnetstring_parse(ops, data, len, &remain);
+  Py_DECREF(string);
+  if(val == NULL) {
+      return NULL;
+  }
+
+  rest = PyString_FromStringAndSize(remain, len-(remain-data));
+  if(rest == NULL) {
+      result = NULL;
+  } else {
+      result = PyTuple_Pack(2, val, rest);
+      Py_DECREF(rest);
+  }
+  Py_DECREF(val);
+  return result;
+}
+
+
+static PyObject*
+_tnetstring_dumps(PyObject* self, PyObject *args)
+{
+  PyObject *object = NULL;
+  PyObject *string = NULL;
+  PyObject *encoding = Py_None;
+  tns_ops *ops = &_tnetstring_ops_bytes;
+  tns_outbuf outbuf;
+
+  if(!PyArg_UnpackTuple(args, "dumps", 1, 2, &object, &encoding)) {
+      return NULL;
+  }
+  if(encoding != Py_None) {
+      if(!PyString_Check(encoding)) {
+          PyErr_SetString(PyExc_TypeError, "encoding must be a string");
+          return NULL;
+      }
+      ops = _tnetstring_get_unicode_ops(encoding);
+      if(ops == NULL) {
+          return NULL;
+      }
+  }
+  Py_INCREF(object);
+
+  if(tns_outbuf_init_hint(&outbuf, &_tnetstring_dumps_hint) == -1) {
+      goto error;
+  }
+  if(_tnetstring_render_value(ops, object, &outbuf) == -1) {
+      goto error;
+  }
+  tns_outbuf_hint_update(&_tnetstring_dumps_hint, &outbuf);
+
+  Py_DECREF(object);
+  string = PyString_FromStringAndSize(NULL,tns_outbuf_size(&outbuf));
+  if(string == NULL) {
+      goto error;
+  }
+
+  tns_outbuf_memmove(&outbuf, PyString_AS_STRING(string));
+  free(outbuf.buffer);
+
+  return string;
+
+error:
+  Py_DECREF(object);
+  return NULL;
+}
+
+
+//  _tnetstring_parse_mongrel2_request:  split a request from Mongrel2.
+//
+//  The request frame looks like "UUID ID PATH SIZE:HEADERS,SIZE:BODY,"
+//  and we parse the whole thing in a single pass.  Headers are decoded
+//  like any other tnetstring, so the JSON-encoded headers sent by older
+//  versions of Mongrel2 come back as a plain string.  The body is returned
+//  as a read-only buffer onto the request string, to avoid copying it.
+//
+static PyObject*
+_tnetstring_parse_mongrel2_request(PyObject* self, PyObject *args)
+{
+  PyObject *string = NULL;
+  PyObject *encoding = Py_None;
+  PyObject *fields[3] = {NULL, NULL, NULL};
+  PyObject *headers = NULL;
+  PyObject *body = NULL;
+  PyObject *result = NULL;
+  tns_ops *ops = &_tnetstring_ops_bytes;
+  tns_type_tag type = tns_tag_null;
+  char *data, *pos, *eod, *end;
+  char *valstr = NULL;
+  size_t vallen = 0;
+  int i;
+
+  if(!PyArg_UnpackTuple(args, "parse_mongrel2_request", 1, 2,
+                        &string, &encoding)) {
+      return NULL;
+  }
+  if(!PyString_Check(string)) {
+      PyErr_SetString(PyExc_TypeError, "arg must be a string");
+      return NULL;
+  }
+  if(encoding != Py_None) {
+      if(!PyString_Check(encoding)) {
+          PyErr_SetString(PyExc_TypeError, "encoding must be a string");
+          return NULL;
+      }
+      ops = _tnetstring_get_unicode_ops(encoding);
+      if(ops == NULL) {
+          return NULL;
+      }
+  }
+  Py_INCREF(string);
+
+  data = PyString_AS_STRING(string);
+  pos = data;
+  eod = data + PyString_GET_SIZE(string);
+
+  //  The UUID, ID and PATH are each terminated by a single space.
+  for(i = 0; i < 3; i++) {
+      end = memchr(pos, ' ', eod - pos);
+      check(end != NULL, "Not a mongrel2 request: missing envelope fields.");
+      fields[i] = PyString_FromStringAndSize(pos, end - pos);
+      check_mem(fields[i]);
+      pos = end + 1;
+  }
+
+  check(tns_split_value(pos, eod - pos, &type, &valstr, &vallen, &pos) != -1,
+        "Not a mongrel2 request: invalid headers.");
+  headers = _tnetstring_parse_payload(ops, type, valstr, vallen);
+  check(headers != NULL, "Not a mongrel2 request: invalid headers.");
+
+  check(tns_split_value(pos, eod - pos, &type, &valstr, &vallen, &pos) != -1,
+        "Not a mongrel2 request: invalid body.");
+  check(type == tns_tag_string, "Not a mongrel2 request: invalid body.");
+  check(pos == eod, "Not a mongrel2 request: trailing data after body.");
+  body = PyBuffer_FromObject(string, valstr - data, vallen);
+  check_mem(body);
+
+  result = PyTuple_Pack(5, fields[0], fields[1], fields[2], headers, body);
+
+error:
+  for(i = 0; i < 3; i++) {
+      Py_XDECREF(fields[i]);
+  }
+  Py_XDECREF(headers);
+  Py_XDECREF(body);
+  Py_DECREF(string);
+  return result;
+}
+
+
+//  _tnetstring_build_mongrel2_response:  build a reply to send to Mongrel2.
+//
+//  The reply looks like "UUID SIZE:ID ID ID, BODY".  The envelope is
+//  rendered into an outbuf, back to front like a tnetstring, so the size
+//  prefix is written once the ids are.  Small bodies are copied in after
+//  it to give a single string.  Bodies bigger than max_copy are returned
+//  untouched alongside the envelope, so they can be handed to a gathering
+//  write without ever being copied, however many connections they go to.
+//
+#define TNS_MONGREL2_MAX_COPY 65536
+
+static PyObject*
+_tnetstring_build_mongrel2_response(PyObject* self, PyObject *args,
+                                    PyObject *kwds)
+{
+  static char *kwlist[] = {"uuid", "ids", "body", "max_copy", NULL};
+  PyObject *uuid = NULL;
+  PyObject *ids = NULL;
+  PyObject *body = NULL;
+  PyObject *seq = NULL;
+  PyObject *item = NULL;
+  PyObject *header = NULL;
+  PyObject *idstr = NULL;
+  PyObject *result = NULL;
+  Py_ssize_t max_copy = TNS_MONGREL2_MAX_COPY;
+  Py_ssize_t nids, i, id;
+  const void *bodydata = NULL;
+  Py_ssize_t bodylen = 0;
+  size_t orig_size, hdrlen;
+  tns_outbuf outbuf;
+
+  outbuf.buffer = NULL;
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "SOO|n:build_mongrel2_response",
+                                  kwlist, &uuid, &ids, &body, &max_copy)) {
+      return NULL;
+  }
+
+  //  A single id doesn't need to be wrapped in a list.  Bools are ints
+  //  too, but they're rejected below rather than sent as "1" or "True".
+  if(PyString_Check(ids) || PyInt_Check(ids) || PyLong_Check(ids)) {
+      seq = PyTuple_Pack(1, ids);
+  } else {
+      seq = PySequence_Fast(ids, "ids must be a sequence");
+  }
+  if(seq == NULL) {
+      return NULL;
+  }
+  nids = PySequence_Fast_GET_SIZE(seq);
+  check(nids > 0, "must give at least one connection id");
+
+  check(tns_outbuf_init(&outbuf) != -1, "Failed to initialize outbuf.");
+  check(tns_outbuf_puts(&outbuf, ", ", 2) != -1, "Failed to render ids.");
+  orig_size = tns_outbuf_size(&outbuf);
+  for(i = nids - 1; i >= 0; i--) {
+      item = PySequence_Fast_GET_ITEM(seq, i);
+      if(i < nids - 1) {
+          check(tns_outbuf_putc(&outbuf, ' ') != -1, "Failed to render ids.");
+      }
+      if(PyString_Check(item)) {
+          check(tns_outbuf_puts(&outbuf, PyString_AS_STRING(item),
+                                PyString_GET_SIZE(item)) != -1,
+                "Failed to render ids.");
+      } else if((PyInt_Check(item) || PyLong_Check(item)) &&
+                !PyBool_Check(item)) {
+          id = PyInt_AsSsize_t(item);
+          if(id == -1 && PyErr_Occurred()) {
+              //  Too big for a Py_ssize_t, but it's still a valid id as
+              //  far as the pure-python version is concerned.
+              check(PyErr_ExceptionMatches(PyExc_OverflowError),
+                    "invalid connection id");
+              PyErr_Clear();
+              check(_PyLong_Sign(item) >= 0,
+                    "connection ids cannot be negative");
+              idstr = PyObject_Str(item);
+              check_mem(idstr);
+              check(tns_outbuf_puts(&outbuf, PyString_AS_STRING(idstr),
+                                    PyString_GET_SIZE(idstr)) != -1,
+                    "Failed to render ids.");
+              Py_CLEAR(idstr);
+          } else {
+              check(id >= 0, "connection ids cannot be negative");
+              check(tns_outbuf_itoa(&outbuf, id) != -1,
+                    "Failed to render ids.");
+          }
+      } else {
+          PyErr_SetString(PyExc_TypeError,
+                          "connection ids must be strings or integers");
+          goto error;
+      }
+  }
+  check(tns_outbuf_clamp(&outbuf, orig_size) != -1, "Failed to render ids.");
+  check(tns_outbuf_putc(&outbuf, ' ') != -1, "Failed to render uuid.");
+  check(tns_outbuf_puts(&outbuf, PyString_AS_STRING(uuid),
+                        PyString_GET_SIZE(uuid)) != -1,
+        "Failed to render uuid.");
+  hdrlen = tns_outbuf_size(&outbuf);
+
+  //  Unicode objects have a read buffer too, but it's their internal
+  //  representation, which is no use to anyone at the other end.
+  if(PyUnicode_Check(body)) {
+      PyErr_SetString(PyExc_TypeError,
+                      "body must be a string or buffer, not unicode");
+      goto error;
+  }
+  if(PyObject_AsReadBuffer(body, &bodydata, &bodylen) == -1) {
+      goto error;
+  }
+  if(bodylen > max_copy) {
+      header = PyString_FromStringAndSize(NULL, hdrlen);
+      check_mem(header);
+      tns_outbuf_memmove(&outbuf, PyString_AS_STRING(header));
+      result = PyTuple_Pack(2, header, body);
+  } else {
+      result = PyString_FromStringAndSize(NULL, hdrlen + bodylen);
+      check_mem(result);
+      tns_outbuf_memmove(&outbuf, PyString_AS_STRING(result));
+      memcpy(PyString_AS_STRING(result) + hdrlen, bodydata, bodylen);
+  }
+
+error:
+  free(outbuf.buffer);
+  Py_XDECREF(header);
+  Py_XDECREF(idstr);
+  Py_DECREF(seq);
+  return result;
+}
+
+
+//  _tnetstring_stats:  get a dict of the counters kept by the core.
+//
+//  This always exists, so that code can check whether the stats are
+//  available; the "enabled" key says whether they were compiled in.
+//  Build with TNETSTRING_STATS=1 in the environment to enable them.
+//  The outbuf size hint used by dumps() is always reported, since it
+//  keeps its counters anyway.
+//
+#ifdef TNS_STATS
+
+#define TNS_STATS_FIELD(name) {#name, offsetof(tns_stats, name)}
+
+static const struct {
+  const char *name;
+  size_t offset;
+} _tnetstring_stats_fields[] = {
+    TNS_STATS_FIELD(outbuf_inits),
+    TNS_STATS_FIELD(outbuf_extends),
+    TNS_STATS_FIELD(outbuf_extend_bytes),
+    TNS_STATS_FIELD(outbuf_alloc_bytes),
+    TNS_STATS_FIELD(outbuf_final_bytes),
+    TNS_STATS_FIELD(parsed_string),
+    TNS_STATS_FIELD(parsed_integer),
+    TNS_STATS_FIELD(parsed_float),
+    TNS_STATS_FIELD(parsed_bool),
+    TNS_STATS_FIELD(parsed_null),
+    TNS_STATS_FIELD(parsed_dict),
+    TNS_STATS_FIELD(parsed_list),
+    TNS_STATS_FIELD(err_length_prefix),
+    TNS_STATS_FIELD(err_string),
+    TNS_STATS_FIELD(err_integer),
+    TNS_STATS_FIELD(err_float),
+    TNS_STATS_FIELD(err_bool),
+    TNS_STATS_FIELD(err_null),
+    TNS_STATS_FIELD(err_type_tag),
+    TNS_STATS_FIELD(err_unserializable),
+    TNS_STATS_FIELD(err_render),
+    TNS_STATS_FIELD(err_memory),
+    {NULL, 0}
+};
+
+#undef TNS_STATS_FIELD
+
+#endif
+
+static int
+_tnetstring_stats_set(PyObject *result, const char *name, size_t count)
+{
+  PyObject *value = PyLong_FromSize_t(count);
+  int res;
+
+  if(value == NULL) {
+      return -1;
+  }
+  res = PyDict_SetItemString(result, name, value);
+  Py_DECREF(value);
+  return res;
+}
+
+static PyObject*
+_tnetstring_stats(PyObject* self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"reset", NULL};
+  PyObject *result = NULL;
+  int reset = 0;
+#ifdef TNS_STATS
+  tns_stats stats;
+  size_t count;
+  int i;
+#endif
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "|i:stats", kwlist, &reset)) {
+      return NULL;
+  }
+  result = PyDict_New();
+  check_mem(result);
+
+  check(_tnetstring_stats_set(result, "dumps_renders",
+                              _tnetstring_dumps_hint.renders) != -1,
+        "Failed to build stats dict.");
+  check(_tnetstring_stats_set(result, "dumps_extends",
+                              _tnetstring_dumps_hint.extends) != -1,
+        "Failed to build stats dict.");
+  check(_tnetstring_stats_set(result, "dumps_size_hint",
+                              _tnetstring_dumps_hint.estimate) != -1,
+        "Failed to build stats dict.");
+  if(reset) {
+      _tnetstring_dumps_hint.renders = 0;
+      _tnetstring_dumps_hint.extends = 0;
+  }
+
+#ifdef TNS_STATS
+  check(PyDict_SetItemString(result, "enabled", Py_True) != -1,
+        "Failed to build stats dict.");
+  tns_stats_get(&stats, reset);
+  for(i = 0; _tnetstring_stats_fields[i].name != NULL; i++) {
+      count = *(size_t*)((char*)&stats + _tnetstring_stats_fields[i].offset);
+      check(_tnetstring_stats_set(result, _tnetstring_stats_fields[i].name,
+                                  count) != -1,
+            "Failed to build stats dict.");
+  }
+#else
+  check(PyDict_SetItemString(result, "enabled", Py_False) != -1,
+        "Failed to build stats dict.");
+#endif
+
+  return result;
+
+error:
+  Py_XDECREF(result);
+  return NULL;
+}
+
+
+//  Schema objects decode a dict with a known set of keys straight into a
+//  tuple, or into whatever object the factory builds from those values.
+//  Keys are matched against a per-schema hash table using their raw bytes,
+//  and each value's type tag is checked before it is parsed.  So there's
+//  no intermediate dict, and unknown keys are skipped without parsing.
+
+#define TNS_SCHEMA_TABLE_SIZE 64
+
+struct tns_schema_field_s {
+  const char *name;
+  size_t namelen;
+  char tag;
+  int required;
+  PyObject *schema;
+  Py_ssize_t next;
+};
+typedef struct tns_schema_field_s tns_schema_field;
+
+struct tns_schema_s {
+  PyObject_HEAD
+  tns_ops *ops;
+  PyObject *names;
+  PyObject *factory;
+  Py_ssize_t nfields;
+  tns_schema_field *fields;
+  Py_ssize_t table[TNS_SCHEMA_TABLE_SIZE];
+};
+typedef struct tns_schema_s tns_schema;
+
+static PyTypeObject tns_schema_type;
+
+
+static INLINE size_t
+tns_schema_hash(const char *name, size_t len)
+{
+  if(len == 0) {
+      return 0;
+  }
+  return (len * 31 + (unsigned char)name[0] * 7 +
+          (unsigned char)name[len - 1]) % TNS_SCHEMA_TABLE_SIZE;
+}
+
+
+static INLINE Py_ssize_t
+tns_schema_lookup(tns_schema *schema, const char *name, size_t len)
+{
+  Py_ssize_t i = schema->table[tns_schema_hash(name, len)];
+  tns_schema_field *field;
+
+  while(i != -1) {
+      field = &schema->fields[i];
+      if(field->namelen == len && memcmp(field->name, name, len) == 0) {
+          return i;
+      }
+      i = field->next;
+  }
+  return -1;
+}
+
+
+//  Find the type tag expected for values of the given python type.
+//  A tag of zero means that values of any type are accepted.
+static int
+tns_schema_get_tag(PyObject *type, char *tag)
+{
+  if(PyObject_TypeCheck(type, &tns_schema_type) ||
+     type == (PyObject*)&PyDict_Type) {
+      *tag = tns_tag_dict;
+  } else if(type == (PyObject*)&PyString_Type ||
+            type == (PyObject*)&PyUnicode_Type) {
+      *tag = tns_tag_string;
+  } else if(type == (PyObject*)&PyInt_Type ||
+            type == (PyObject*)&PyLong_Type) {
+      *tag = tns_tag_integer;
+  } else if(type == (PyObject*)&PyFloat_Type) {
+      *tag = tns_tag_float;
+  } else if(type == (PyObject*)&PyBool_Type) {
+      *tag = tns_tag_bool;
+  } else if(type == Py_None || type == (PyObject*)Py_TYPE(Py_None)) {
+      *tag = tns_tag_null;
+  } else if(type == (PyObject*)&PyList_Type) {
+      *tag = tns_tag_list;
+  } else if(type == (PyObject*)&PyBaseObject_Type) {
+      *tag = 0;
+  } else {
+      PyErr_SetString(PyExc_TypeError, "unsupported schema field type");
+      return -1;
+  }
+  return 0;
+}
+
+
+//  Lists and dicts can't be dict keys, as loads() finds out when it tries
+//  to add them.
+static INLINE int
+tns_schema_check_key(tns_type_tag type)
+{
+  if(type == tns_tag_list || type == tns_tag_dict) {
+      PyErr_Format(PyExc_TypeError, "unhashable type: '%s'",
+                   type == tns_tag_list ? "list" : "dict");
+      return -1;
+  }
+  return 0;
+}
+
+
+//  Check a value that the schema skips, by the rules tns_parse_payload
+//  applies, so that a Schema accepts just the inputs that loads() does.
+//  Nothing is built unless that's the only way to check it: very long
+//  integers go to python's parser as in tns_parse_integer, and strings
+//  are decoded if the schema has an encoding.
+static int
+tns_schema_check_payload(const tns_ops *ops, tns_type_tag type,
+                         const char *data, size_t len)
+{
+  const char *pos = data;
+  const char *eod = data + len;
+  tns_type_tag itype, keytype;
+  char *valstr, *remain;
+  size_t vallen;
+  PyObject *val = NULL;
+  char *dataend;
+
+  switch(type) {
+    case tns_tag_string:
+      if(ops != &_tnetstring_ops_bytes) {
+          val = ops->parse_string(ops, data, len);
+          check(val != NULL, "Not a tnetstring: invalid string literal.");
+          Py_DECREF(val);
+      }
+      return 0;
+    case tns_tag_integer:
+      if(len >= 19) {
+          val = ops->parse_integer(ops, data, len);
+          check(val != NULL, "Not a tnetstring: invalid integer literal.");
+          Py_DECREF(val);
+          return 0;
+      }
+      //  The type tag stands in for the first digit of an empty integer.
+      check(len > 0 && ((*pos >= '0' && *pos <= '9') ||
+                        *pos == '+' || *pos == '-'),
+            "invalid integer literal");
+      for(pos++; pos < eod; pos++) {
+          check(*pos >= '0' && *pos <= '9', "invalid integer literal");
+      }
+      return 0;
+    case tns_tag_float:
+      strtod(data, &dataend);
+      check(dataend == eod, "Not a tnetstring: invalid float literal.");
+      return 0;
+    case tns_tag_bool:
+      check((len == 4 && memcmp(data, "true", 4) == 0) ||
+            (len == 5 && memcmp(data, "false", 5) == 0),
+            "Not a tnetstring: invalid boolean literal.");
+      return 0;
+    case tns_tag_null:
+      check(len == 0, "Not a tnetstring: invalid null literal.");
+      return 0;
+    case tns_tag_list:
+      while(pos < eod) {
+          check(tns_split_value(pos, eod - pos, &itype, &valstr, &vallen,
+                                &remain) != -1,
+                "Not a tnetstring: invalid length prefix.");
+          check(tns_schema_check_payload(ops, itype, valstr, vallen) != -1,
+                "Not a tnetstring: broken list items.");
+          pos = remain;
+      }
+      return 0;
+    case tns_tag_dict:
+      while(pos < eod) {
+          check(tns_split_value(pos, eod - pos, &keytype, &valstr, &vallen,
+                                &remain) != -1,
+                "Not a tnetstring: invalid length prefix.");
+          check(tns_schema_check_payload(ops, keytype, valstr, vallen) != -1,
+                "Not a tnetstring: broken dict items.");
+          pos = remain;
+          check(tns_split_value(pos, eod - pos, &itype, &valstr, &vallen,
+                                &remain) != -1,
+                "Not a tnetstring: invalid length prefix.");
+          check(tns_schema_check_payload(ops, itype, valstr, vallen) != -1,
+                "Not a tnetstring: broken dict items.");
+          pos = remain;
+          check(tns_schema_check_key(keytype) != -1, "unhashable key");
+      }
+      return 0;
+    default:
+      sentinel("Not a tnetstring: invalid type tag.");
+  }
+
+error:
+  return -1;
+}
+
+
+static PyObject*
+tns_schema_parse_payload(tns_schema *schema, const char *data, size_t len)
+{
+  PyObject *stackvals[16];
+  PyObject **vals = stackvals;
+  PyObject *val = NULL;
+  PyObject *res = NULL;
+  tns_schema_field *field;
+  tns_type_tag type, keytype;
+  char *valstr, *remain, *keystr;
+  size_t vallen, keylen;
+  Py_ssize_t i;
+
+  if(schema->nfields > 16) {
+      vals = PyMem_Malloc(schema->nfields * sizeof(PyObject*));
+      check_mem(vals);
+  }
+  for(i = 0; i < schema->nfields; i++) {
+      vals[i] = NULL;
+  }
+
+  while(len > 0) {
+      //  Match the key without building a string object for it.
+      check(tns_split_value(data, len, &type, &valstr, &vallen, &remain) != -1,
+            "Failed to parse dict key from tnetstring.");
+      i = -1;
+      if(type == tns_tag_string) {
+          i = tns_schema_lookup(schema, valstr, vallen);
+      }
+      keytype = type;
+      keystr = valstr;
+      keylen = vallen;
+      len = len - (remain - data);
+      data = remain;
+
+      check(tns_split_value(data, len, &type, &valstr, &vallen, &remain) != -1,
+            "Failed to parse dict item from tnetstring.");
+      len = len - (remain - data);
+      data = remain;
+
+      //  Unknown keys are skipped over without building their values,
+      //  but they still have to be valid.
+      if(i == -1) {
+          check(tns_schema_check_payload(schema->ops, keytype, keystr,
+                                         keylen) != -1,
+                "Failed to parse dict key from tnetstring.");
+          check(tns_schema_check_payload(schema->ops, type, valstr,
+                                         vallen) != -1,
+                "Failed to parse dict item from tnetstring.");
+          check(tns_schema_check_key(keytype) != -1, "unhashable key");
+          continue;
+      }
+      field = &schema->fields[i];
+      if(field->tag != 0 && field->tag != type &&
+         (field->required || type != tns_tag_null)) {
+          sentinel("Schema field '%s' expects type '%c', got '%c'.",
+                   field->name, field->tag, type);
+      }
+      if(field->schema != NULL && type == tns_tag_dict) {
+          val = tns_schema_parse_payload((tns_schema*)field->schema,
+                                         valstr, vallen);
+      } else {
+          val = _tnetstring_parse_payload(schema->ops, type, valstr, vallen);
+      }
+      check(val != NULL, "Failed to parse dict item from tnetstring.");
+      Py_XDECREF(vals[i]);
+      vals[i] = val;
+      val = NULL;
+  }
+
+  //  Check for required fields, and default the optional ones to None.
+  for(i = 0; i < schema->nfields; i++) {
+      if(vals[i] == NULL) {
+          field = &schema->fields[i];
+          check(!field->required, "Schema field '%s' is missing.",
+                field->name);
+          Py_INCREF(Py_None);
+          vals[i] = Py_None;
+      }
+  }
+
+  //  The tuple steals the references to all the values.
+  res = PyTuple_New(schema->nfields);
+  check_mem(res);
+  for(i = 0; i < schema->nfields; i++) {
+      PyTuple_SET_ITEM(res, i, vals[i]);
+      vals[i] = NULL;
+  }
+  if(vals != stackvals) {
+      PyMem_Free(vals);
+  }
+
+  if(schema->factory != NULL) {
+      val = PyObject_Call(schema->factory, res, NULL);
+      Py_DECREF(res);
+      return val;
+  }
+  return res;
+
+error:
+  if(vals != NULL) {
+      for(i = 0; i < schema->nfields; i++) {
+          Py_XDECREF(vals[i]);
+      }
+      if(vals != stackvals) {
+          PyMem_Free(vals);
+      }
+  }
+  return NULL;
+}
+
+
+static PyObject*
+tns_schema_parse(tns_schema *schema, const char *data, size_t len, char **remain)
+{
+  tns_type_tag type;
+  char *valstr, *rest;
+  size_t vallen;
+
+  check(tns_split_value(data, len, &type, &valstr, &vallen, &rest) != -1,
+        "Not a tnetstring: invalid length prefix.");
+  check(type == tns_tag_dict, "Schema can only decode a dict.");
+  if(remain != NULL) {
+      *remain = rest;
+  }
+
+  return tns_schema_parse_payload(schema, valstr, vallen);
+
+error:
+  return NULL;
+}
+
+
+static int
+tns_schema_init(tns_schema *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"fields", "factory", "encoding", NULL};
+  PyObject *fields = NULL;
+  PyObject *factory = Py_None;
+  PyObject *encoding = Py_None;
+  PyObject *seq = NULL;
+  PyObject *name, *type;
+  tns_schema_field *field;
+  Py_ssize_t i, h;
+  int required;
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO:Schema", kwlist,
+                                  &fields, &factory, &encoding)) {
+      return -1;
+  }
+  if(self->names != NULL) {
+      PyErr_SetString(PyExc_TypeError, "Schema is already initialized");
+      return -1;
+  }
+
+  if(encoding == Py_None) {
+      self->ops = &_tnetstring_ops_bytes;
+  } else {
+      if(!PyString_Check(encoding)) {
+          PyErr_SetString(PyExc_TypeError, "encoding must be a string");
+          return -1;
+      }
+      self->ops = _tnetstring_get_unicode_ops(encoding);
+      if(self->ops == NULL) {
+          return -1;
+      }
+  }
+  if(factory != Py_None && factory != (PyObject*)&PyTuple_Type) {
+      Py_INCREF(factory);
+      self->factory = factory;
+  }
+
+  seq = PySequence_Fast(fields, "fields must be a sequence");
+  if(seq == NULL) {
+      return -1;
+  }
+  self->nfields = PySequence_Fast_GET_SIZE(seq);
+  self->names = PyTuple_New(self->nfields);
+  self->fields = PyMem_Malloc((self->nfields + 1) * sizeof(tns_schema_field));
+  if(self->names == NULL || self->fields == NULL) {
+      PyErr_NoMemory();
+      goto error;
+  }
+  for(h = 0; h < TNS_SCHEMA_TABLE_SIZE; h++) {
+      self->table[h] = -1;
+  }
+  for(i = 0; i < self->nfields; i++) {
+      self->fields[i].schema = NULL;
+  }
+
+  for(i = 0; i < self->nfields; i++) {
+      field = &self->fields[i];
+      required = 1;
+      if(!PyTuple_Check(PySequence_Fast_GET_ITEM(seq, i))) {
+          PyErr_SetString(PyExc_TypeError,
+                          "fields must be (name,type[,required]) tuples");
+          goto error;
+      }
+      if(!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i),
+                           "SO|i:Schema", &name, &type, &required)) {
+          goto error;
+      }
+      Py_INCREF(name);
+      PyTuple_SET_ITEM(self->names, i, name);
+      field->name = PyString_AS_STRING(name);
+      field->namelen = PyString_GET_SIZE(name);
+      field->required = required;
+      if(tns_schema_get_tag(type, &field->tag) == -1) {
+          goto error;
+      }
+      if(PyObject_TypeCheck(type, &tns_schema_type)) {
+          Py_INCREF(type);
+          field->schema = type;
+      }
+      if(tns_schema_lookup(self, field->name, field->namelen) != -1) {
+          PyErr_Format(PyExc_ValueError, "duplicate schema field '%s'",
+                       field->name);
+          goto error;
+      }
+      h = tns_schema_hash(field->name, field->namelen);
+      field->next = self->table[h];
+      self->table[h] = i;
+  }
+
+  Py_DECREF(seq);
+  return 0;
+
+error:
+  Py_DECREF(seq);
+  return -1;
+}
+
+
+static void
+tns_schema_dealloc(tns_schema *self)
+{
+  Py_ssize_t i;
+
+  if(self->fields != NULL) {
+      for(i = 0; i < self->nfields; i++) {
+          Py_XDECREF(self->fields[i].schema);
+      }
+      PyMem_Free(self->fields);
+  }
+  Py_XDECREF(self->names);
+  Py_XDECREF(self->factory);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+static PyObject*
+tns_schema_loads(tns_schema *self, PyObject *string)
+{
+  PyObject *val = NULL;
+
+  if(self->names == NULL) {
+      PyErr_SetString(PyExc_TypeError, "Schema is not initialized");
+      return NULL;
+  }
+  if(!PyString_Check(string)) {
+      PyErr_SetString(PyExc_TypeError, "arg must be a string");
+      return NULL;
+  }
+  Py_INCREF(string);
+  val = tns_schema_parse(self, PyString_AS_STRING(string),
+                         PyString_GET_SIZE(string), NULL);
+  Py_DECREF(string);
+  return val;
+}
+
+
+static PyObject*
+tns_schema_pop(tns_schema *self, PyObject *string)
+{
+  PyObject *val = NULL;
+  PyObject *rest = NULL;
+  PyObject *result = NULL;
+  char *data, *remain;
+  size_t len;
+
+  if(self->names == NULL) {
+      PyErr_SetString(PyExc_TypeError, "Schema is not initialized");
+      return NULL;
+  }
+  if(!PyString_Check(string)) {
+      PyErr_SetString(PyExc_TypeError, "arg must be a string");
+      return NULL;
+  }
+  Py_INCREF(string);
+  data = PyString_AS_STRING(string);
+  len = PyString_GET_SIZE(string);
+  val = tns_schema_parse(self, data, len, &remain);
+  if(val != NULL) {
+      rest = PyString_FromStringAndSize(remain, len-(remain-data));
+      if(rest != NULL) {
+          result = PyTuple_Pack(2, val, rest);
+          Py_DECREF(rest);
+      }
+      Py_DECREF(val);
+  }
+  Py_DECREF(string);
+  return result;
+}
+
+
+static PyMethodDef tns_schema_methods[] = {
+    {"loads",
+     (PyCFunction)tns_schema_loads,
+     METH_O,
+     PyDoc_STR("loads(string) -> object\n"
+               "This function parses a tnetstring dict using the schema.")},
+
+    {"pop",
+     (PyCFunction)tns_schema_pop,
+     METH_O,
+     PyDoc_STR("pop(string) -> (object, remain)\n"
+               "This function parses a tnetstring dict using the schema.\n"
+               "It returns a tuple giving the parsed object and a string\n"
+               "containing any unparsed data.")},
+
+    {NULL, NULL}
+};
+
+
+static PyMemberDef tns_schema_members[] = {
+    {"names", T_OBJECT, offsetof(tns_schema, names), READONLY,
+     PyDoc_STR("tuple of field names, in order")},
+    {NULL}
+};
+
+
+static PyTypeObject tns_schema_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_tnetstring.Schema",               /* tp_name */
+    sizeof(tns_schema),                 /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)tns_schema_dealloc,     /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_compare */
+    0,                                  /* tp_repr */
+    0,                                  /* tp_as_number */
+    0,                                  /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    0,                                  /* tp_hash */
+    0,                                  /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    0,                                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                 /* tp_flags */
+    PyDoc_STR("Schema(fields,factory=None,encoding=None)\n"
+              "Decoder for tnetstring dicts with a known set of keys.\n"
+              "The fields are (name,type[,required]) tuples; values are\n"
+              "checked against the type and passed to the factory in\n"
+              "order, or returned as a tuple if no factory is given."),
+    0,                                  /* tp_traverse */
+    0,                                  /* tp_clear */
+    0,                                  /* tp_richcompare */
+    0,                                  /* tp_weaklistoffset */
+    0,                                  /* tp_iter */
+    0,                                  /* tp_iternext */
+    tns_schema_methods,                 /* tp_methods */
+    tns_schema_members,                 /* tp_members */
+    0,                                  /* tp_getset */
+    0,                                  /* tp_base */
+    0,                                  /* tp_dict */
+    0,                                  /* tp_descr_get */
+    0,                                  /* tp_descr_set */
+    0,                                  /* tp_dictoffset */
+    (initproc)tns_schema_init,          /* tp_init */
+    0,                                  /* tp_alloc */
+    0,                                  /* tp_new */
+};
+
+
+//  loads_async() parses on a pool of native threads that never take the
+//  GIL.  Checking a tnetstring and finding all of its values doesn't need
+//  any python objects, so the workers parse into the node arrays from
+//  tns_dom.h, and the python objects are built from the nodes when the
+//  caller asks the Future for its result.  Only that last step holds the
+//  GIL, and it's a tight loop over values that are already split and
+//  checked.  Nodes are converted by the same ops as loads() uses, and if
+//  the parse fails then loads() is run on the data to raise its error.
+//
+//  The pool is started on first use with a thread per core, and again in
+//  the child after a fork.  Without pthreads, jobs are parsed on the spot.
+//  So are small strings, since handing them to another thread would cost
+//  more than parsing them.
+
+#define TNS_ASYNC_MAX_THREADS 64
+#define TNS_ASYNC_MIN_LENGTH 8192
+
+#define TNS_JOB_QUEUED 0
+#define TNS_JOB_RUNNING 1
+#define TNS_JOB_DONE 2
+
+struct tns_async_job_s;
+typedef struct tns_async_job_s tns_async_job;
+
+struct tns_async_job_s {
+  tns_async_job *next;
+  const char *data;
+  size_t len;
+  tns_arena arena;
+  tns_dom dom;
+  int state;
+};
+
+struct tns_future_s {
+  PyObject_HEAD
+  const tns_ops *ops;
+  PyObject *string;
+  PyObject *result;
+  PyObject *exc_type;
+  PyObject *exc_value;
+  PyObject *exc_tb;
+  int converting;
+  tns_async_job job;
+};
+typedef struct tns_future_s tns_future;
+
+static PyTypeObject tns_future_type;
+
+
+//  Parse the data of a job into nodes.  This doesn't touch any python
+//  objects, so it's safe to call without the GIL.
+static void
+_tnetstring_job_run(tns_async_job *job)
+{
+  if(tns_dom_parse(&job->dom, &job->arena, job->data, job->len, NULL) == -1) {
+      tns_arena_free(&job->arena);
+  }
+}
+
+
+#ifdef TNS_HAVE_PTHREAD
+
+//  Queued jobs wait on a linked list.  The workers note what they're
+//  running, so that it can be queued again in the child after a fork.
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  tns_async_job *head;
+  tns_async_job *tail;
+  tns_async_job *running[TNS_ASYNC_MAX_THREADS];
+  int nthreads;
+  int atfork;
+} _tnetstring_pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, NULL, NULL, {NULL}, 0, 0
+};
+
+
+static void*
+_tnetstring_pool_main(void *arg)
+{
+  int slot = (int)(intptr_t)arg;
+  tns_async_job *job = NULL;
+
+  pthread_mutex_lock(&_tnetstring_pool.lock);
+  for(;;) {
+      while(_tnetstring_pool.head == NULL) {
+          pthread_cond_wait(&_tnetstring_pool.work, &_tnetstring_pool.lock);
+      }
+      job = _tnetstring_pool.head;
+      _tnetstring_pool.head = job->next;
+      if(_tnetstring_pool.head == NULL) {
+          _tnetstring_pool.tail = NULL;
+      }
+      job->state = TNS_JOB_RUNNING;
+      _tnetstring_pool.running[slot] = job;
+      pthread_mutex_unlock(&_tnetstring_pool.lock);
+
+      _tnetstring_job_run(job);
+
+      pthread_mutex_lock(&_tnetstring_pool.lock);
+      _tnetstring_pool.running[slot] = NULL;
+      job->state = TNS_JOB_DONE;
+      pthread_cond_broadcast(&_tnetstring_pool.done);
+  }
+  return NULL;
+}
+
+
+//  Hold the lock over a fork, so the child gets the pool in a known state.
+//  None of the workers survive into the child, so it requeues whatever
+//  they were running and starts a new pool when it's next needed.
+static void
+_tnetstring_pool_prefork(void)
+{
+  pthread_mutex_lock(&_tnetstring_pool.lock);
+}
+
+
+static void
+_tnetstring_pool_postfork_parent(void)
+{
+  pthread_mutex_unlock(&_tnetstring_pool.lock);
+}
+
+
+static void
+_tnetstring_pool_postfork_child(void)
+{
+  tns_async_job *job = NULL;
+  int i;
+
+  for(i = 0; i < _tnetstring_pool.nthreads; i++) {
+      job = _tnetstring_pool.running[i];
+      if(job != NULL) {
+          tns_arena_free(&job->arena);
+          job->state = TNS_JOB_QUEUED;
+          job->next = _tnetstring_pool.head;
+          _tnetstring_pool.head = job;
+          if(_tnetstring_pool.tail == NULL) {
+              _tnetstring_pool.tail = job;
+          }
+          _tnetstring_pool.running[i] = NULL;
+      }
+  }
+  _tnetstring_pool.nthreads = 0;
+  pthread_mutex_unlock(&_tnetstring_pool.lock);
+}
+
+
+//  Start the worker threads if they're not running.  Call with the lock
+//  held.  If no thread can be started, nthreads is left at zero.
+static void
+_tnetstring_pool_start(void)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+  long ncpus = 4;
+  int i;
+
+  if(_tnetstring_pool.nthreads > 0) {
+      return;
+  }
+  if(!_tnetstring_pool.atfork) {
+      if(pthread_atfork(_tnetstring_pool_prefork,
+                        _tnetstring_pool_postfork_parent,
+                        _tnetstring_pool_postfork_child) != 0) {
+          return;
+      }
+      _tnetstring_pool.atfork = 1;
+  }
+#ifdef _SC_NPROCESSORS_ONLN
+  ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if(ncpus < 1) {
+      ncpus = 1;
+  }
+  if(ncpus > TNS_ASYNC_MAX_THREADS) {
+      ncpus = TNS_ASYNC_MAX_THREADS;
+  }
+
+  //  The workers never run python code, so keep signals away from them.
+  if(pthread_attr_init(&attr) != 0) {
+      return;
+  }
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for(i = 0; i < ncpus; i++) {
+      if(pthread_create(&thread, &attr, _tnetstring_pool_main,
+                        (void*)(intptr_t)i) != 0) {
+          break;
+      }
+      _tnetstring_pool.nthreads++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+}
+
+
+//  Take a job off the queue, if it's still waiting.  Call with the lock held.
+static int
+_tnetstring_pool_unqueue(tns_async_job *job)
+{
+  tns_async_job **pos = &_tnetstring_pool.head;
+  tns_async_job *prev = NULL;
+
+  if(job->state != TNS_JOB_QUEUED) {
+      return -1;
+  }
+  while(*pos != job) {
+      prev = *pos;
+      pos = &prev->next;
+  }
+  *pos = job->next;
+  if(_tnetstring_pool.tail == job) {
+      _tnetstring_pool.tail = prev;
+  }
+  return 0;
+}
+
+#endif
+
+
+//  Hand a job to the pool, or parse it straight away if there isn't one.
+//  Call without the GIL.
+static void
+_tnetstring_job_submit(tns_async_job *job)
+{
+#ifdef TNS_HAVE_PTHREAD
+  pthread_mutex_lock(&_tnetstring_pool.lock);
+  _tnetstring_pool_start();
+  if(_tnetstring_pool.nthreads > 0) {
+      job->state = TNS_JOB_QUEUED;
+      job->next = NULL;
+      if(_tnetstring_pool.tail == NULL) {
+          _tnetstring_pool.head = job;
+      } else {
+          _tnetstring_pool.tail->next = job;
+      }
+      _tnetstring_pool.tail = job;
+      pthread_cond_signal(&_tnetstring_pool.work);
+      pthread_mutex_unlock(&_tnetstring_pool.lock);
+      return;
+  }
+  pthread_mutex_unlock(&_tnetstring_pool.lock);
+#endif
+  _tnetstring_job_run(job);
+  job->state = TNS_JOB_DONE;
+}
+
+
+//  Wait for a job to finish.  If 'cancel' is true and the job hasn't been
+//  started, it's dropped instead.  Call without the GIL.
+static void
+_tnetstring_job_wait(tns_async_job *job, int cancel)
+{
+#ifdef TNS_HAVE_PTHREAD
+  int unqueued = 0;
+
+  pthread_mutex_lock(&_tnetstring_pool.lock);
+  if(job->state == TNS_JOB_QUEUED) {
+      //  After a fork there may be no workers; start them, or run it here.
+      _tnetstring_pool_start();
+      if(cancel || _tnetstring_pool.nthreads == 0) {
+          unqueued = _tnetstring_pool_unqueue(job) == 0;
+      }
+  }
+  while(!unqueued && job->state != TNS_JOB_DONE) {
+      pthread_cond_wait(&_tnetstring_pool.done, &_tnetstring_pool.lock);
+  }
+  pthread_mutex_unlock(&_tnetstring_pool.lock);
+  if(unqueued) {
+      if(!cancel) {
+          _tnetstring_job_run(job);
+      }
+      job->state = TNS_JOB_DONE;
+  }
+#endif
+}
+
+
+//  Build the python object for a node and all of its children.
+static PyObject*
+_tnetstring_from_node(const tns_ops *ops, const tns_node *node)
+{
+  const tns_node *item = node + 1;
+  const tns_node *end = node + node->size;
+  void *val = NULL;
+  void *key = NULL;
+  void *elem = NULL;
+  int res;
+
+  switch(node->type) {
+    case tns_tag_list:
+        val = ops->new_list_sized(ops, node->count);
+        check(val != NULL, "Could not create list.");
+        for(; item < end; item += item->size) {
+            elem = _tnetstring_from_node(ops, item);
+            check(elem != NULL, "Failed to parse list.");
+            //  The item belongs to the list now, even if adding failed.
+            res = ops->add_to_list(ops, val, elem);
+            elem = NULL;
+            check(res != -1, "Failed to add item to list.");
+        }
+        TNS_STAT_INC(parsed_list);
+        break;
+    case tns_tag_dict:
+        val = ops->new_dict_sized(ops, node->count / 2);
+        check(val != NULL, "Could not create dict.");
+        while(item < end) {
+            key = _tnetstring_from_node(ops, item);
+            check(key != NULL, "Failed to parse dict key from tnetstring.");
+            item += item->size;
+            elem = _tnetstring_from_node(ops, item);
+            check(elem != NULL, "Failed to parse dict item from tnetstring.");
+            item += item->size;
+            //  Likewise the key and item belong to the dict now.
+            res = ops->add_to_dict(ops, val, key, elem);
+            key = NULL;
+            elem = NULL;
+            check(res != -1, "Failed to add element to dict.");
+        }
+        TNS_STAT_INC(parsed_dict);
+        break;
+    default:
+        val = _tnetstring_parse_payload(ops, node->type, node->data,
+                                        node->len);
+        break;
+  }
+  return val;
+
+error:
+  Py_XDECREF(key);
+  Py_XDECREF(elem);
+  Py_XDECREF(val);
+  return NULL;
+}
+
+
+static PyObject*
+_tnetstring_loads_async(PyObject* self, PyObject *args)
+{
+  PyObject *string = NULL;
+  PyObject *encoding = Py_None;
+  tns_ops *ops = &_tnetstring_ops_bytes;
+  tns_future *future = NULL;
 
-  if(!PyArg_UnpackTuple(args, "pop", 1, 2, &string, &encoding)) {
+  if(!PyArg_UnpackTuple(args, "loads_async", 1, 2, &string, &encoding)) {
       return NULL;
   }
   if(!PyString_Check(string)) {
@@ -266,96 +1695,178 @@ _tnetstring_pop(PyObject* self, PyObject *args)
           PyErr_SetString(PyExc_TypeError, "encoding must be a string");
           return NULL;
       }
-      Py_INCREF(encoding);
       ops = _tnetstring_get_unicode_ops(encoding);
       if(ops == NULL) {
-          Py_DECREF(encoding);
           return NULL;
       }
   }
-  Py_INCREF(string);
 
-  data = PyString_AS_STRING(string);
-  len = PyString_GET_SIZE(string);
-  val = tns_parse(ops, data, len, &remain);
-  Py_DECREF(string);
-  if(ops != &_tnetstring_ops_bytes) {
-      free(ops);
-      Py_DECREF(encoding);
-  }
-  if(val == NULL) {
+  future = PyObject_New(tns_future, &tns_future_type);
+  if(future == NULL) {
       return NULL;
   }
+  Py_INCREF(string);
+  future->ops = ops;
+  future->string = string;
+  future->result = NULL;
+  future->exc_type = NULL;
+  future->exc_value = NULL;
+  future->exc_tb = NULL;
+  future->converting = 0;
+  memset(&future->job, 0, sizeof(tns_async_job));
+  future->job.data = PyString_AS_STRING(string);
+  future->job.len = PyString_GET_SIZE(string);
+
+  if(future->job.len < TNS_ASYNC_MIN_LENGTH) {
+      future->result = _tnetstring_parse(ops, future->job.data,
+                                         future->job.len, NULL);
+      if(future->result == NULL) {
+          PyErr_Fetch(&future->exc_type, &future->exc_value,
+                      &future->exc_tb);
+      }
+      future->job.state = TNS_JOB_DONE;
+      Py_CLEAR(future->string);
+      return (PyObject*)future;
+  }
 
-  rest = PyString_FromStringAndSize(remain, len-(remain-data));
-  if(rest == NULL) {
-      result = NULL;
-  } else {
-      result = PyTuple_Pack(2, val, rest);
-      Py_DECREF(rest);
+  Py_BEGIN_ALLOW_THREADS
+  _tnetstring_job_submit(&future->job);
+  Py_END_ALLOW_THREADS
+
+  return (PyObject*)future;
+}
+
+
+static void
+tns_future_dealloc(tns_future *self)
+{
+  //  A worker might still be reading the string, so wait for it.
+  if(self->string != NULL) {
+      Py_BEGIN_ALLOW_THREADS
+      _tnetstring_job_wait(&self->job, 1);
+      Py_END_ALLOW_THREADS
+      tns_arena_free(&self->job.arena);
   }
-  Py_DECREF(val);
-  return result;
+  Py_XDECREF(self->string);
+  Py_XDECREF(self->result);
+  Py_XDECREF(self->exc_type);
+  Py_XDECREF(self->exc_value);
+  Py_XDECREF(self->exc_tb);
+  PyObject_Del(self);
 }
 
 
 static PyObject*
-_tnetstring_dumps(PyObject* self, PyObject *args)
+tns_future_result(tns_future *self)
 {
-  PyObject *object = NULL;
-  PyObject *string = NULL;
-  PyObject *encoding = Py_None;
-  tns_ops *ops = &_tnetstring_ops_bytes;
-  tns_outbuf outbuf;
+  PyObject *val = NULL;
+  tns_async_job *job = &self->job;
 
-  if(!PyArg_UnpackTuple(args, "dumps", 1, 2, &object, &encoding)) {
-      return NULL;
-  }
-  if(encoding != Py_None) {
-      if(!PyString_Check(encoding)) {
-          PyErr_SetString(PyExc_TypeError, "encoding must be a string");
+  if(self->string != NULL) {
+      if(self->converting) {
+          PyErr_SetString(PyExc_RuntimeError,
+                          "result is being built by another thread");
           return NULL;
       }
-      Py_INCREF(encoding);
-      ops = _tnetstring_get_unicode_ops(encoding);
-      if(ops == NULL) {
-          Py_DECREF(encoding);
-          return NULL;
+      Py_BEGIN_ALLOW_THREADS
+      _tnetstring_job_wait(job, 0);
+      Py_END_ALLOW_THREADS
+
+      //  Converting may run python code, e.g. in a codec, which could
+      //  let another thread in to call result() too.
+      self->converting = 1;
+      if(job->dom.error == NULL) {
+          val = _tnetstring_from_node(self->ops, job->dom.nodes);
+      } else {
+          val = _tnetstring_parse(self->ops, job->data, job->len, NULL);
       }
+      self->converting = 0;
+      tns_arena_free(&job->arena);
+      job->dom.nodes = NULL;
+      Py_CLEAR(self->string);
+      if(val == NULL) {
+          PyErr_Fetch(&self->exc_type, &self->exc_value, &self->exc_tb);
+      }
+      self->result = val;
   }
-  Py_INCREF(object);
 
-  if(tns_outbuf_init(&outbuf) == -1) {
-      goto error;
-  }
-  if(tns_render_value(ops, object, &outbuf) == -1) {
-      goto error;
+  if(self->result == NULL) {
+      Py_XINCREF(self->exc_type);
+      Py_XINCREF(self->exc_value);
+      Py_XINCREF(self->exc_tb);
+      PyErr_Restore(self->exc_type, self->exc_value, self->exc_tb);
+      return NULL;
   }
+  Py_INCREF(self->result);
+  return self->result;
+}
 
-  Py_DECREF(object);
-  string = PyString_FromStringAndSize(NULL,tns_outbuf_size(&outbuf));
-  if(string == NULL) {
-      goto error;
-  }
 
-  tns_outbuf_memmove(&outbuf, PyString_AS_STRING(string));
-  free(outbuf.buffer);
+static PyObject*
+tns_future_done(tns_future *self)
+{
+  int done = 1;
 
-  if(ops != &_tnetstring_ops_bytes) {
-      free(ops);
-      Py_DECREF(encoding);
+#ifdef TNS_HAVE_PTHREAD
+  if(self->string != NULL) {
+      pthread_mutex_lock(&_tnetstring_pool.lock);
+      done = self->job.state == TNS_JOB_DONE;
+      pthread_mutex_unlock(&_tnetstring_pool.lock);
   }
+#endif
+  return PyBool_FromLong(done);
+}
 
-  return string;
 
-error:
-  if(ops != &_tnetstring_ops_bytes) {
-      free(ops);
-      Py_DECREF(encoding);
-  }
-  Py_DECREF(object);
-  return NULL;
-}
+static PyMethodDef tns_future_methods[] = {
+    {"result",
+     (PyCFunction)tns_future_result,
+     METH_NOARGS,
+     PyDoc_STR("result() -> object\n"
+               "This function waits for the parse to finish, and returns\n"
+               "the python object or raises the error that loads() would.")},
+
+    {"done",
+     (PyCFunction)tns_future_done,
+     METH_NOARGS,
+     PyDoc_STR("done() -> bool\n"
+               "This function checks whether result() will return without\n"
+               "waiting for the parse.")},
+
+    {NULL, NULL}
+};
+
+
+static PyTypeObject tns_future_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_tnetstring.Future",               /* tp_name */
+    sizeof(tns_future),                 /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)tns_future_dealloc,     /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_compare */
+    0,                                  /* tp_repr */
+    0,                                  /* tp_as_number */
+    0,                                  /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    0,                                  /* tp_hash */
+    0,                                  /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    0,                                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                 /* tp_flags */
+    PyDoc_STR("The result of a call to loads_async()."),
+    0,                                  /* tp_traverse */
+    0,                                  /* tp_clear */
+    0,                                  /* tp_richcompare */
+    0,                                  /* tp_weaklistoffset */
+    0,                                  /* tp_iter */
+    0,                                  /* tp_iternext */
+    tns_future_methods,                 /* tp_methods */
+};
 
 
 static PyMethodDef _tnetstring_methods[] = {
@@ -386,6 +1897,41 @@ static PyMethodDef _tnetstring_methods[] = {
      PyDoc_STR("dumps(object,encoding=None) -> string\n"
                "This function dumps a python object as a tnetstring.")},
 
+    {"parse_mongrel2_request",
+     (PyCFunction)_tnetstring_parse_mongrel2_request,
+     METH_VARARGS,
+     PyDoc_STR("parse_mongrel2_request(msg,encoding=None) -> "
+               "(uuid,id,path,headers,body)\n"
+               "This function splits a request frame from mongrel2.\n"
+               "The headers are parsed as a tnetstring, and the body is\n"
+               "returned as a buffer referencing the request data.")},
+
+    {"build_mongrel2_response",
+     (PyCFunction)_tnetstring_build_mongrel2_response,
+     METH_VARARGS | METH_KEYWORDS,
+     PyDoc_STR("build_mongrel2_response(uuid,ids,body,max_copy=65536) -> "
+               "string or (header,body)\n"
+               "This function builds a reply to send to mongrel2.\n"
+               "If the body is longer than max_copy bytes, it returns the\n"
+               "header and the original body instead of joining them.")},
+
+    {"loads_async",
+     (PyCFunction)_tnetstring_loads_async,
+     METH_VARARGS,
+     PyDoc_STR("loads_async(string,encoding=None) -> Future\n"
+               "This function parses a tnetstring on a background thread.\n"
+               "Call result() on the returned Future to get the object.")},
+
+    {"stats",
+     (PyCFunction)_tnetstring_stats,
+     METH_VARARGS | METH_KEYWORDS,
+     PyDoc_STR("stats(reset=False) -> dict\n"
+               "This function gets the counters kept by the parser core.\n"
+               "The 'enabled' key says whether they were compiled in,\n"
+               "though the dumps_* counters are always available.\n"
+               "Those are kept separately for each thread.\n"
+               "If 'reset' is true, they are zeroed after being read.")},
+
     {NULL, NULL}
 };
 
@@ -402,8 +1948,125 @@ tns_parse_string(const tns_ops *ops, const char *data, size_t len)
 static void*
 tns_parse_unicode(const tns_ops *ops, const char *data, size_t len)
 {
-  char* encoding = ((tns_ops_with_encoding*)ops)->encoding;
-  return PyUnicode_Decode(data, len, encoding, NULL);
+  PyObject *decoder = ((tns_ops_with_encoding*)ops)->decoder;
+  PyObject *buffer = NULL;
+  PyObject *res = NULL;
+  PyObject *val = NULL;
+
+  //  This is what PyUnicode_Decode does, minus the codec lookup.
+  buffer = PyBuffer_FromMemory((void*)data, len);
+  if(buffer == NULL) {
+      return NULL;
+  }
+  res = PyObject_CallFunctionObjArgs(decoder, buffer, NULL);
+  Py_DECREF(buffer);
+  if(res == NULL) {
+      return NULL;
+  }
+  if(!PyTuple_Check(res) || PyTuple_GET_SIZE(res) != 2) {
+      PyErr_SetString(PyExc_TypeError,
+                      "decoder must return a tuple (object,integer)");
+      Py_DECREF(res);
+      return NULL;
+  }
+  val = PyTuple_GET_ITEM(res, 0);
+  if(!PyUnicode_Check(val)) {
+      PyErr_Format(PyExc_TypeError,
+                   "decoder did not return an unicode object (type=%.400s)",
+                   Py_TYPE(val)->tp_name);
+      Py_DECREF(res);
+      return NULL;
+  }
+  Py_INCREF(val);
+  Py_DECREF(res);
+  return val;
+}
+
+
+//  Find the length of the run of ASCII characters at the start of a string.
+//  This checks sixteen bytes at a time where SSE2 is available, and a
+//  machine word at a time otherwise.
+static INLINE size_t
+tns_ascii_prefix(const char *data, size_t len)
+{
+  const char *pos = data;
+  const char *eod = data + len;
+#ifdef TNS_HAVE_SSE2
+  __m128i chunk;
+
+  while(eod - pos >= 16) {
+      chunk = _mm_loadu_si128((const __m128i*)pos);
+      if(_mm_movemask_epi8(chunk) != 0) {
+          break;
+      }
+      pos += 16;
+  }
+#else
+  size_t word;
+  const size_t high_bits = ((size_t)-1 / 0xFF) * 0x80;
+
+  while((size_t)(eod - pos) >= sizeof(size_t)) {
+      memcpy(&word, pos, sizeof(size_t));
+      if(word & high_bits) {
+          break;
+      }
+      pos += sizeof(size_t);
+  }
+#endif
+  while(pos < eod && !(*pos & 0x80)) {
+      pos++;
+  }
+  return pos - data;
+}
+
+
+//  Build a unicode object from a string known to be pure ASCII.
+//  Every codec we fast-path agrees on ASCII, so this is just a widening
+//  copy into the Py_UNICODE buffer with no validation or decoding.
+static PyObject*
+tns_widen_ascii(const char *data, size_t len)
+{
+  PyObject *val = NULL;
+  Py_UNICODE *u;
+  size_t i;
+
+  val = PyUnicode_FromUnicode(NULL, len);
+  if(val == NULL) {
+      return NULL;
+  }
+  u = PyUnicode_AS_UNICODE(val);
+  for(i = 0; i < len; i++) {
+      u[i] = (unsigned char)data[i];
+  }
+  return val;
+}
+
+
+static void*
+tns_parse_utf8(const tns_ops *ops, const char *data, size_t len)
+{
+  if(tns_ascii_prefix(data, len) == len) {
+      return tns_widen_ascii(data, len);
+  }
+  return PyUnicode_DecodeUTF8(data, len, NULL);
+}
+
+
+static void*
+tns_parse_ascii(const tns_ops *ops, const char *data, size_t len)
+{
+  if(tns_ascii_prefix(data, len) == len) {
+      return tns_widen_ascii(data, len);
+  }
+  //  Let the codec produce the appropriate error.
+  return PyUnicode_DecodeASCII(data, len, NULL);
+}
+
+
+static void*
+tns_parse_latin1(const tns_ops *ops, const char *data, size_t len)
+{
+  return PyUnicode_DecodeLatin1(data, len, NULL);
 }
 
 
@@ -584,6 +2247,28 @@ tns_new_list(const tns_ops *ops)
 }
 
 
+static void*
+tns_new_dict_sized(const tns_ops *ops, size_t size)
+{
+  return _PyDict_NewPresized(size);
+}
+
+
+static void*
+tns_new_list_sized(const tns_ops *ops, size_t size)
+{
+  PyObject *list = NULL;
+
+  //  Allocate the item array at full size but mark the list as empty.
+  //  Items are then filled in by tns_add_to_list without reallocating.
+  list = PyList_New(size);
+  if(list != NULL) {
+      Py_SIZE(list) = 0;
+  }
+  return list;
+}
+
+
 static void
 tns_free_value(const tns_ops *ops, void *value)
 {
@@ -608,7 +2293,15 @@ tns_add_to_dict(const tns_ops *ops, void *dict, void *key, void *item)
 static int
 tns_add_to_list(const tns_ops *ops, void *list, void *item)
 {
+  PyListObject *l = (PyListObject*)list;
   int res;
+
+  //  If the list was presized there's room to steal the reference.
+  if(Py_SIZE(l) < l->allocated) {
+      l->ob_item[Py_SIZE(l)] = item;
+      Py_SIZE(l)++;
+      return 0;
+  }
   res = PyList_Append(list, item);
   Py_DECREF(item);
   if(res == -1) {
@@ -626,24 +2319,76 @@ tns_render_string(const tns_ops *ops, void *val, tns_outbuf *outbuf)
 }
 
 
+static PyObject*
+tns_encode_unicode(const tns_ops_with_encoding *opswe, PyObject *val)
+{
+  PyObject *res = NULL;
+  PyObject *bytes = NULL;
+
+  //  This is what PyUnicode_Encode does, minus the codec lookup.
+  res = PyObject_CallFunctionObjArgs(opswe->encoder, val, NULL);
+  if(res == NULL) {
+      return NULL;
+  }
+  if(!PyTuple_Check(res) || PyTuple_GET_SIZE(res) != 2) {
+      PyErr_SetString(PyExc_TypeError,
+                      "encoder must return a tuple (object,integer)");
+      Py_DECREF(res);
+      return NULL;
+  }
+  bytes = PyTuple_GET_ITEM(res, 0);
+  if(!PyString_Check(bytes)) {
+      PyErr_Format(PyExc_TypeError,
+                   "encoder did not return a string object (type=%.400s)",
+                   Py_TYPE(bytes)->tp_name);
+      Py_DECREF(res);
+      return NULL;
+  }
+  Py_INCREF(bytes);
+  Py_DECREF(res);
+  return bytes;
+}
+
+
+static PyObject*
+tns_encode_utf8(const tns_ops_with_encoding *opswe, PyObject *val)
+{
+  return PyUnicode_EncodeUTF8(PyUnicode_AS_UNICODE(val),
+                              PyUnicode_GET_SIZE(val), NULL);
+}
+
+
+static PyObject*
+tns_encode_ascii(const tns_ops_with_encoding *opswe, PyObject *val)
+{
+  return PyUnicode_EncodeASCII(PyUnicode_AS_UNICODE(val),
+                               PyUnicode_GET_SIZE(val), NULL);
+}
+
+
+static PyObject*
+tns_encode_latin1(const tns_ops_with_encoding *opswe, PyObject *val)
+{
+  return PyUnicode_EncodeLatin1(PyUnicode_AS_UNICODE(val),
+                                PyUnicode_GET_SIZE(val), NULL);
+}
+
+
 static int
 tns_render_unicode(const tns_ops *ops, void *val, tns_outbuf *outbuf)
 {
   PyObject *bytes;
-  char* encoding = ((tns_ops_with_encoding*)ops)->encoding;
+  const tns_ops_with_encoding *opswe = (const tns_ops_with_encoding*)ops;
+  int res = 0;
 
   if(PyUnicode_Check(val)) {
-      bytes = PyUnicode_Encode(PyUnicode_AS_UNICODE(val),
-                                PyUnicode_GET_SIZE(val),
-                                encoding, NULL);
+      bytes = opswe->encode(opswe, val);
       if(bytes == NULL) {
           return -1;
       }
-      if(tns_render_string(ops, bytes, outbuf) == -1) {
-          return -1;
-      }
+      res = tns_render_string(ops, bytes, outbuf);
       Py_DECREF(bytes);
-      return 0;
+      return res;
   }
 
   if(PyString_Check(val)) {
@@ -706,10 +2451,10 @@ tns_render_dict(const tns_ops *ops, void *val, tns_outbuf *outbuf)
   Py_ssize_t pos = 0;
 
   while(PyDict_Next(val, &pos, &key, &item)) {
-      if(tns_render_value(ops, item, outbuf) == -1) {
+      if(_tnetstring_render_value(ops, item, outbuf) == -1) {
           return -1;
       }
-      if(tns_render_value(ops, key, outbuf) == -1) {
+      if(_tnetstring_render_value(ops, key, outbuf) == -1) {
           return -1;
       }
   }
@@ -728,7 +2473,7 @@ tns_render_list(const tns_ops *ops, void *val, tns_outbuf *outbuf)
   idx = PyList_GET_SIZE(val) - 1;
   while(idx >= 0) {
       item = PyList_GET_ITEM(val, idx);
-      if(tns_render_value(ops, item, outbuf) == -1) {
+      if(_tnetstring_render_value(ops, item, outbuf) == -1) {
           return -1;
       }
       idx--;
@@ -781,31 +2526,30 @@ tns_type_tag tns_get_type_unicode(const tns_ops *ops, void *val)
 }
 
 
-static tns_ops *_tnetstring_get_unicode_ops(PyObject *encoding)
-{
-  tns_ops_with_encoding *opswe = NULL;
-  tns_ops *ops = NULL;
-
-  opswe = malloc(sizeof(tns_ops_with_encoding));
-  if(opswe == NULL) {
-      PyErr_SetString(PyExc_MemoryError, "could not allocate ops struct");
-      return NULL;
-  }
-  ops = (tns_ops*)opswe;
+//  Build the loops specialized to the bytestring ops.  The callbacks are
+//  all named after the op they implement, so they can be bound by name.
+#define TNS_FUNC(name) tns_bytes_##name
+#define TNS_OP(ops, name) tns_##name
+#define TNS_HAS_OP(ops, name) 1
+#define TNS_SCOPE static
+#include "tns_core_tmpl.h"
 
-  opswe->encoding = PyString_AS_STRING(encoding);
 
-  ops->get_type = &tns_get_type_unicode;
+//  Fill in an ops struct with the functions for parsing bytestrings.
+//  The unicode ops override the string-handling functions afterwards.
+static void _tnetstring_init_ops(tns_ops *ops)
+{
+  ops->get_type = &tns_get_type;
   ops->free_value = &tns_free_value;
 
-  ops->parse_string = tns_parse_unicode;
+  ops->parse_string = tns_parse_string;
   ops->parse_integer = tns_parse_integer;
   ops->parse_float = tns_parse_float;
   ops->get_null = tns_get_null;
   ops->get_true = tns_get_true;
   ops->get_false = tns_get_false;
 
-  ops->render_string = tns_render_unicode;
+  ops->render_string = tns_render_string;
   ops->render_integer = tns_render_integer;
   ops->render_float = tns_render_float;
   ops->render_bool = tns_render_bool;
@@ -818,7 +2562,134 @@ static tns_ops *_tnetstring_get_unicode_ops(PyObject *encoding)
   ops->add_to_list = tns_add_to_list;
   ops->render_list = tns_render_list;
 
-  return ops;
+  ops->new_dict_sized = tns_new_dict_sized;
+  ops->new_list_sized = tns_new_list_sized;
+}
+
+
+static void _tnetstring_init_unicode_ops(tns_ops_with_encoding *opswe,
+                void* (*parse_string)(const tns_ops*, const char*, size_t),
+                PyObject* (*encode)(const tns_ops_with_encoding*, PyObject*))
+{
+  tns_ops *ops = (tns_ops*)opswe;
+
+  _tnetstring_init_ops(ops);
+  ops->get_type = &tns_get_type_unicode;
+  ops->parse_string = parse_string;
+  ops->render_string = tns_render_unicode;
+
+  opswe->encoding = NULL;
+  opswe->decoder = NULL;
+  opswe->encoder = NULL;
+  opswe->encode = encode;
+}
+
+
+//  Find the builtin ops for an encoding, if it has any.
+//  Names are normalized the same way as by the encodings package, so
+//  e.g. "UTF-8", "utf8" and "utf_8" all map to the same ops.
+static tns_ops_with_encoding *_tnetstring_get_builtin_ops(const char *encoding)
+{
+  char name[16];
+  size_t i = 0;
+  char c;
+
+  for(i = 0; (c = encoding[i]) != '\0'; i++) {
+      if(i == sizeof(name) - 1) {
+          return NULL;
+      }
+      name[i] = isalnum((unsigned char)c) ? tolower((unsigned char)c) : '_';
+  }
+  name[i] = '\0';
+
+  if(strcmp(name, "utf_8") == 0 || strcmp(name, "utf8") == 0 ||
+     strcmp(name, "u8") == 0) {
+      return &_tnetstring_ops_utf8;
+  }
+  if(strcmp(name, "ascii") == 0 || strcmp(name, "us_ascii") == 0) {
+      return &_tnetstring_ops_ascii;
+  }
+  if(strcmp(name, "latin_1") == 0 || strcmp(name, "latin1") == 0 ||
+     strcmp(name, "iso8859_1") == 0 || strcmp(name, "iso_8859_1") == 0 ||
+     strcmp(name, "l1") == 0) {
+      return &_tnetstring_ops_latin1;
+  }
+  return NULL;
+}
+
+
+static void _tnetstring_free_unicode_ops(PyObject *capsule)
+{
+  tns_ops_with_encoding *opswe = PyCapsule_GetPointer(capsule, NULL);
+
+  Py_XDECREF(opswe->encoding);
+  Py_XDECREF(opswe->decoder);
+  Py_XDECREF(opswe->encoder);
+  free(opswe);
+}
+
+
+static tns_ops *_tnetstring_get_unicode_ops(PyObject *encoding)
+{
+  tns_ops_with_encoding *opswe = NULL;
+  PyObject *capsule = NULL;
+
+  capsule = PyDict_GetItem(_tnetstring_encodings, encoding);
+  if(capsule != NULL) {
+      return PyCapsule_GetPointer(capsule, NULL);
+  }
+
+  opswe = _tnetstring_get_builtin_ops(PyString_AS_STRING(encoding));
+  if(opswe != NULL) {
+      capsule = PyCapsule_New(opswe, NULL, NULL);
+  } else {
+      //  Resolve the codec functions now so we don't look them up
+      //  on every call.  Unknown encodings fail here and aren't cached.
+      opswe = malloc(sizeof(tns_ops_with_encoding));
+      if(opswe == NULL) {
+          PyErr_SetString(PyExc_MemoryError, "could not allocate ops struct");
+          return NULL;
+      }
+      _tnetstring_init_unicode_ops(opswe, tns_parse_unicode,
+                                   tns_encode_unicode);
+      Py_INCREF(encoding);
+      opswe->encoding = encoding;
+      opswe->decoder = PyCodec_Decoder(PyString_AS_STRING(encoding));
+      opswe->encoder = PyCodec_Encoder(PyString_AS_STRING(encoding));
+      if(opswe->decoder == NULL || opswe->encoder == NULL) {
+          Py_DECREF(encoding);
+          Py_XDECREF(opswe->decoder);
+          Py_XDECREF(opswe->encoder);
+          free(opswe);
+          return NULL;
+      }
+      capsule = PyCapsule_New(opswe, NULL, _tnetstring_free_unicode_ops);
+      if(capsule == NULL) {
+          Py_DECREF(encoding);
+          Py_DECREF(opswe->decoder);
+          Py_DECREF(opswe->encoder);
+          free(opswe);
+          return NULL;
+      }
+  }
+  if(capsule == NULL) {
+      return NULL;
+  }
+
+  //  Looking up the codec can run python code and so release the GIL.
+  //  If another thread cached this encoding meanwhile, use its ops, since
+  //  replacing them would free them while that thread is still using them.
+  if(PyDict_GetItem(_tnetstring_encodings, encoding) != NULL) {
+      Py_DECREF(capsule);
+      return _tnetstring_get_unicode_ops(encoding);
+  }
+  if(PyDict_SetItem(_tnetstring_encodings, encoding, capsule) == -1) {
+      Py_DECREF(capsule);
+      return NULL;
+  }
+  Py_DECREF(capsule);
+
+  return (tns_ops*)opswe;
 }
 
 
@@ -830,30 +2701,38 @@ PyDoc_STRVAR(module_doc,
 PyMODINIT_FUNC
 init_tnetstring(void)
 {
-  Py_InitModule3("_tnetstring", _tnetstring_methods, module_doc);
+  PyObject *m;
 
-  //  Initialize function pointers for parsing bytes.
-  _tnetstring_ops_bytes.get_type = &tns_get_type;
-  _tnetstring_ops_bytes.free_value = &tns_free_value;
-
-  _tnetstring_ops_bytes.parse_string = tns_parse_string;
-  _tnetstring_ops_bytes.parse_integer = tns_parse_integer;
-  _tnetstring_ops_bytes.parse_float = tns_parse_float;
-  _tnetstring_ops_bytes.get_null = tns_get_null;
-  _tnetstring_ops_bytes.get_true = tns_get_true;
-  _tnetstring_ops_bytes.get_false = tns_get_false;
+  tns_schema_type.tp_new = PyType_GenericNew;
+  if(PyType_Ready(&tns_schema_type) < 0) {
+      return;
+  }
+  if(PyType_Ready(&tns_future_type) < 0) {
+      return;
+  }
 
-  _tnetstring_ops_bytes.render_string = tns_render_string;
-  _tnetstring_ops_bytes.render_integer = tns_render_integer;
-  _tnetstring_ops_bytes.render_float = tns_render_float;
-  _tnetstring_ops_bytes.render_bool = tns_render_bool;
+  //  Create the encodings cache before the module, so that the module is
+  //  never importable without it.
+  _tnetstring_encodings = PyDict_New();
+  if(_tnetstring_encodings == NULL) {
+      return;
+  }
 
-  _tnetstring_ops_bytes.new_dict = tns_new_dict;
-  _tnetstring_ops_bytes.add_to_dict = tns_add_to_dict;
-  _tnetstring_ops_bytes.render_dict = tns_render_dict;
+  m = Py_InitModule3("_tnetstring", _tnetstring_methods, module_doc);
+  if(m == NULL) {
+      return;
+  }
+  Py_INCREF(&tns_schema_type);
+  PyModule_AddObject(m, "Schema", (PyObject*)&tns_schema_type);
 
-  _tnetstring_ops_bytes.new_list = tns_new_list;
-  _tnetstring_ops_bytes.add_to_list = tns_add_to_list;
-  _tnetstring_ops_bytes.render_list = tns_render_list;
+  //  Initialize function pointers for parsing bytes.
+  _tnetstring_init_ops(&_tnetstring_ops_bytes);
+
+  //  Initialize function pointers for the builtin encodings.
+  _tnetstring_init_unicode_ops(&_tnetstring_ops_utf8,
+                               tns_parse_utf8, tns_encode_utf8);
+  _tnetstring_init_unicode_ops(&_tnetstring_ops_ascii,
+                               tns_parse_ascii, tns_encode_ascii);
+  _tnetstring_init_unicode_ops(&_tnetstring_ops_latin1,
+                               tns_parse_latin1, tns_encode_latin1);
 }
-
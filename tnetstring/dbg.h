@@ -9,10 +9,33 @@
 #ifndef __dbg_h__
 #define __dbg_h__
 
+//  When built into the python extension, errors are raised as exceptions.
+//  Anywhere else they just abort the operation, and are only printed to
+//  stderr if TNS_DEBUG is defined.
+
+#ifdef Py_PYTHON_H
+
 #define check(A, M, ...) if(!(A)) { if(PyErr_Occurred() == NULL) { PyErr_Format(PyExc_ValueError, M, ##__VA_ARGS__); }; goto error; }
 
 #define sentinel(M, ...)  check(0, M, ##__VA_ARGS__)
 
 #define check_mem(A) if(A==NULL) { if(PyErr_Occurred() == NULL) { PyErr_SetString(PyExc_MemoryError, "Out of memory."); }; goto error; }
 
+#else
+
+#ifdef TNS_DEBUG
+#include <stdio.h>
+#define log_err(M, ...) fprintf(stderr, "[ERROR] (%s:%d) " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+#else
+#define log_err(M, ...)
+#endif
+
+#define check(A, M, ...) if(!(A)) { log_err(M, ##__VA_ARGS__); goto error; }
+
+#define sentinel(M, ...)  check(0, M, ##__VA_ARGS__)
+
+#define check_mem(A) check((A) != NULL, "Out of memory.")
+
+#endif
+
 #endif
@@ -1,4 +1,5 @@
 
+import gc
 import sys
 import unittest
 import random
@@ -92,12 +93,95 @@ class Test_Format(unittest.TestCase):
         self.assertEquals(tnetstring.dumps(ALPHA,"utf16"),"12:"+ALPHA.encode("utf16")+",")
         self.assertEquals(tnetstring.loads("12:\xff\xfe\x91\x03l\x00p\x00h\x00a\x00,","utf16"),ALPHA)
 
+    def test_unicode_encoding_names(self):
+        ALPHA = u"\N{GREEK CAPITAL LETTER ALPHA}lpha"
+        for encoding in ("utf8","UTF-8","utf_8","utf16","latin-1","ascii"):
+            for _ in xrange(2):
+                v = {u"key": [u"hello", u"world"]}
+                s = tnetstring.dumps(v,encoding)
+                self.assertEquals(v,tnetstring.loads(s,encoding))
+        self.assertEquals(tnetstring.loads("6:"+ALPHA.encode("utf8")+",","UTF-8"),ALPHA)
+        self.assertRaises(UnicodeEncodeError,tnetstring.dumps,ALPHA,"ascii")
+        self.assertRaises(UnicodeDecodeError,tnetstring.loads,"1:\xff,","ascii")
+        self.assertRaises(LookupError,tnetstring.loads,"5:hello,","no-such-codec")
+
+    def test_unicode_ascii_prefix(self):
+        #  Non-ascii chars at every offset around the vectorized chunk size.
+        for n in xrange(40):
+            v = u"x" * n + u"\N{GREEK CAPITAL LETTER ALPHA}" + u"y" * (n % 7)
+            self.assertEquals(v,tnetstring.loads(tnetstring.dumps(v,"utf8"),"utf8"))
+            s = tnetstring.dumps(v.encode("utf8"))
+            self.assertRaises(UnicodeDecodeError,tnetstring.loads,s,"ascii")
+            self.assertEquals(u"x" * n,tnetstring.loads(tnetstring.dumps("x" * n),"ascii"))
+
     def test_roundtrip_format_unicode(self):
         for _ in xrange(500):
             v = get_random_object(unicode=True)
             self.assertEqual(v,tnetstring.loads(tnetstring.dumps(v,"utf8"),"utf8"))
             self.assertEqual((v,""),tnetstring.pop(tnetstring.dumps(v,"utf16"),"utf16"))
 
+    def test_loads_async(self):
+        futures = []
+        for data, expect in FORMAT_EXAMPLES.items():
+            futures.append((tnetstring.loads_async(data),expect))
+        for _ in xrange(200):
+            v = get_random_object(unicode=True)
+            data = tnetstring.dumps(v,"utf8")
+            futures.append((tnetstring.loads_async(data,"utf8"),v))
+        data = tnetstring.dumps(range(20000))
+        futures.append((tnetstring.loads_async(data + "trailing"),range(20000)))
+        for (future,expect) in futures:
+            self.assertEqual(expect,future.result())
+            self.assertTrue(future.done())
+            self.assertTrue(future.result() is future.result())
+        #  Errors are raised by result(), each time it's called.
+        for bad in ("8:1:1#2:xx]","9:1:a,1:b,}","1:x#","4:trux!","x:","0:?"):
+            future = tnetstring.loads_async(bad)
+            self.assertRaises(ValueError,future.result)
+            self.assertRaises(ValueError,future.result)
+        future = tnetstring.loads_async("1:\xff,","ascii")
+        self.assertRaises(UnicodeDecodeError,future.result)
+        #  Likewise for inputs big enough to go to the worker threads, with
+        #  the bad item nested deep inside.
+        def big(item):
+            inner = "1:a," + item
+            payload = tnetstring.dumps("x" * 10000) + \
+                      "%d:%s]" % (len(inner),inner)
+            return "%d:%s]" % (len(payload),payload)
+        for (item,encoding,error) in (("3x:abc,",None,ValueError),
+                                      ("3:abc#",None,ValueError),
+                                      ("7:0:]1:b,}",None,TypeError),
+                                      ("1:\xff,","ascii",UnicodeDecodeError)):
+            future = tnetstring.loads_async(big(item),encoding)
+            self.assertRaises(error,future.result)
+            self.assertRaises(error,future.result)
+        self.assertEqual(tnetstring.loads_async(big("1:b,")).result(),
+                         ["x" * 10000,["a","b"]])
+        #  A failed add mustn't release the key and item twice; one-byte
+        #  strings are shared, so that would show up in their refcount.
+        b = tnetstring.loads("1:b,")
+        sys.exc_clear()
+        gc.collect()
+        refs = sys.getrefcount(b)
+        for data in ("7:0:]1:b,}",big("7:0:]1:b,}")):
+            self.assertRaises(TypeError,tnetstring.loads_async(data).result)
+            self.assertRaises(TypeError,tnetstring.loads,data)
+        sys.exc_clear()
+        gc.collect()
+        self.assertEqual(sys.getrefcount(b),refs)
+        #  Dropping unfinished futures must be safe.
+        for _ in xrange(100):
+            tnetstring.loads_async(data)
+
+    def test_roundtrip_large_containers(self):
+        l = range(20000)
+        self.assertEquals(l,tnetstring.loads(tnetstring.dumps(l)))
+        d = dict((str(i),[i]) for i in xrange(20000))
+        self.assertEquals(d,tnetstring.loads(tnetstring.dumps(d)))
+        #  Broken items must still fail after the size pre-scan.
+        for bad in ("8:1:1#2:xx]","8:1:1#9:xx]","9:1:a,1:b,}","6:1:1#xx]"):
+            self.assertRaises(ValueError,tnetstring.loads,bad)
+
     def test_roundtrip_big_integer(self):
         i1 = math.factorial(30000)
         s = tnetstring.dumps(i1)
@@ -2,6 +2,7 @@
 import os
 import os.path
 import difflib
+import threading
 import unittest
 import doctest
 
@@ -30,3 +31,93 @@ class Test_Misc(unittest.TestCase):
                 f.write(tnetstring.__doc__.encode())
                 f.close()
 
+
+    def test_stats(self):
+        try:
+            import _tnetstring
+        except ImportError:
+            return
+        stats = _tnetstring.stats()
+        if not stats["enabled"]:
+            self.assertEquals(sorted(stats),["dumps_extends","dumps_renders",
+                                             "dumps_size_hint","enabled"])
+            return
+        _tnetstring.stats(reset=True)
+        self.assertEquals(_tnetstring.stats()["parsed_string"],0)
+        tnetstring.loads(tnetstring.dumps({"a":[1,2.5,None,True,"b" * 100]}))
+        for bad in ("1:x#","4:trux!","1:x^","1:x~","0:?","x:"):
+            self.assertRaises(ValueError,tnetstring.loads,bad)
+        self.assertRaises(ValueError,tnetstring.dumps,object())
+        stats = _tnetstring.stats(reset=True)
+        self.assertEquals((stats["parsed_dict"],stats["parsed_list"]),(1,1))
+        self.assertEquals(stats["parsed_string"],2)
+        self.assertEquals(stats["parsed_integer"],1)
+        self.assertEquals((stats["parsed_float"],stats["parsed_null"]),(1,1))
+        self.assertEquals(stats["parsed_bool"],1)
+        self.assertEquals(stats["outbuf_inits"],2)
+        self.assertTrue(stats["outbuf_final_bytes"] > 100)
+        self.assertTrue(stats["outbuf_alloc_bytes"] >= 64 * 2)
+        for key in ("err_integer","err_bool","err_float","err_null",
+                    "err_type_tag","err_length_prefix","err_unserializable"):
+            self.assertEquals(stats[key],1)
+        self.assertEquals(_tnetstring.stats()["parsed_dict"],0)
+
+    def test_dumps_size_hint(self):
+        try:
+            import _tnetstring
+        except ImportError:
+            return
+        value = ["x" * 100] * 20
+        size = len(tnetstring.dumps(value))
+        _tnetstring.stats(reset=True)
+        for _ in xrange(10):
+            tnetstring.dumps(value)
+        stats = _tnetstring.stats(reset=True)
+        self.assertEquals(stats["dumps_renders"],10)
+        self.assertTrue(stats["dumps_extends"] <= 1)
+        self.assertEquals(stats["dumps_size_hint"],size)
+        for i in xrange(10):
+            tnetstring.dumps(i)
+        stats = _tnetstring.stats()
+        self.assertEquals((stats["dumps_renders"],stats["dumps_extends"]),(10,0))
+        self.assertTrue(100 < stats["dumps_size_hint"] < size)
+
+    def test_dumps_size_hint_per_thread(self):
+        try:
+            import _tnetstring
+        except ImportError:
+            return
+        for i in xrange(10):
+            tnetstring.dumps(i)
+        keys = ("dumps_renders","dumps_extends","dumps_size_hint")
+        before = [_tnetstring.stats()[k] for k in keys]
+        results = []
+        def target():
+            for _ in xrange(10):
+                tnetstring.dumps(["x" * 1000] * 20)
+            results.append(_tnetstring.stats())
+        t = threading.Thread(target=target)
+        t.start()
+        t.join()
+        self.assertEquals(results[0]["dumps_renders"],10)
+        self.assertTrue(results[0]["dumps_size_hint"] > 20000)
+        self.assertEquals([_tnetstring.stats()[k] for k in keys],before)
+
+    def test_encoding_cache_threads(self):
+        #  Threads racing to look up a new codec must all get working ops.
+        ALPHA = u"\N{GREEK CAPITAL LETTER ALPHA}lpha"
+        for encoding in ("UTF-16-LE","utf_32","cp1253"):
+            data = tnetstring.dumps([ALPHA] * 10,encoding)
+            start = threading.Event()
+            results = []
+            def target():
+                start.wait()
+                for _ in xrange(50):
+                    results.append(tnetstring.loads(data,encoding))
+            threads = [threading.Thread(target=target) for _ in xrange(4)]
+            for t in threads:
+                t.start()
+            start.set()
+            for t in threads:
+                t.join()
+            self.assertEquals(results,[[ALPHA] * 10] * 200)
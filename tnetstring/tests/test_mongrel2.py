@@ -0,0 +1,87 @@
+
+import unittest
+
+import tnetstring
+from tnetstring.tests.test_schema import load_python_version
+
+
+HEADERS = {"PATH":"/chat/","METHOD":"POST","x-forwarded-for":"127.0.0.1"}
+
+
+def make_request(uuid,id,path,headers,body):
+    if not isinstance(headers,str):
+        headers = tnetstring.dumps(headers)
+    return "%s %s %s %s%d:%s," % (uuid,id,path,headers,len(body),body)
+
+
+class Test_Mongrel2Request(unittest.TestCase):
+
+    def test_parse_request(self):
+        req = make_request("54c6755b","32","/chat/",HEADERS,"hello world")
+        (uuid,id,path,headers,body) = tnetstring.parse_mongrel2_request(req)
+        self.assertEquals((uuid,id,path),("54c6755b","32","/chat/"))
+        self.assertEquals(headers,HEADERS)
+        self.assertEquals(str(body),"hello world")
+        self.assertEquals(len(body),11)
+        req = make_request("54c6755b","32","@*",'21:{"type":"disconnect"},',"")
+        (_,_,path,headers,body) = tnetstring.parse_mongrel2_request(req)
+        self.assertEquals((path,headers,str(body)),
+                          ("@*",'{"type":"disconnect"}',""))
+
+    def test_parse_request_encoding(self):
+        ALPHA = u"\N{GREEK CAPITAL LETTER ALPHA}lpha"
+        req = make_request("u","1","/",tnetstring.dumps({ALPHA:ALPHA},"utf8"),
+                           ALPHA.encode("utf8"))
+        (_,_,_,headers,body) = tnetstring.parse_mongrel2_request(req,"utf8")
+        self.assertEquals(headers,{ALPHA:ALPHA})
+        self.assertEquals(str(body).decode("utf8"),ALPHA)
+
+    def test_parse_request_errors(self):
+        good = make_request("u","1","/",HEADERS,"body")
+        for bad in ("u 1 /", "u 1", good[:-1], good + "x", good[:-2] + "]",
+                    "u 1 / 0:}05:hello,", "u 1 / 3:abc}0:,"):
+            self.assertRaises(ValueError,tnetstring.parse_mongrel2_request,bad)
+
+
+class Test_Mongrel2Response(unittest.TestCase):
+
+    def test_build_response(self):
+        build = tnetstring.build_mongrel2_response
+        self.assertEquals(build("54c6755b","32","hi"),"54c6755b 2:32, hi")
+        self.assertEquals(build("54c6755b",32,"hi"),"54c6755b 2:32, hi")
+        self.assertEquals(build("u",[1,"22",333L],""),"u 8:1 22 333, ")
+        ids = range(100)
+        reply = build("u",ids,buffer("hello"))
+        self.assertEquals(reply.split(" ",1)[0],"u")
+        (idlist,rest) = tnetstring.pop(reply[2:])
+        self.assertEquals((map(int,idlist.split()),rest),(ids," hello"))
+
+    def test_build_response_large_body(self):
+        build = tnetstring.build_mongrel2_response
+        body = "x" * 100000
+        (header,rbody) = build("u",[1,2],body)
+        self.assertEquals(header,"u 3:1 2, ")
+        self.assertTrue(rbody is body)
+        self.assertEquals(build("u",1,"hello",max_copy=4),("u 1:1, ","hello"))
+        self.assertEquals(build("u",1,"hello",max_copy=5),"u 1:1, hello")
+
+    def test_build_response_errors(self):
+        build = tnetstring.build_mongrel2_response
+        self.assertRaises(ValueError,build,"u",[],"body")
+        self.assertRaises(ValueError,build,"u",[1,-1],"body")
+        self.assertRaises(TypeError,build,"u",[1.5],"body")
+        self.assertRaises(TypeError,build,"u",None,"body")
+        self.assertRaises(TypeError,build,"u",1,u"body")
+        self.assertRaises(TypeError,build,"u",1,u"x" * 100000)
+
+    def test_build_response_ids(self):
+        #  The C and python versions must agree on which ids are valid.
+        big = 2 ** 70
+        for impl in (tnetstring,load_python_version()):
+            build = impl.build_mongrel2_response
+            self.assertEquals(build("u",[big,0L],""),"u 24:%d 0, " % (big,))
+            self.assertEquals(build("u",big,""),"u 22:%d, " % (big,))
+            for bad in (True,False,[1,True],[False]):
+                self.assertRaises(TypeError,build,"u",bad,"body")
+            for bad in (-big,[1,-big],-1L):
+                self.assertRaises(ValueError,build,"u",bad,"body")
@@ -0,0 +1,124 @@
+
+import os
+import imp
+import sys
+import unittest
+from collections import namedtuple
+
+import tnetstring
+
+
+USER_FIELDS = [("name",str),("admin",bool),("age",int,False),("tags",list,False)]
+
+User = namedtuple("User","name admin age tags")
+
+
+class Point(object):
+    __slots__ = ("x","y")
+    def __init__(self,x,y):
+        self.x = x
+        self.y = y
+
+
+def load_python_version():
+    """Load a separate copy of tnetstring that doesn't use the C extension."""
+    saved = sys.modules.get("_tnetstring")
+    sys.modules["_tnetstring"] = None
+    try:
+        path = os.path.splitext(tnetstring.__file__)[0] + ".py"
+        return imp.load_source("_tnetstring_python",path)
+    finally:
+        if saved is None:
+            del sys.modules["_tnetstring"]
+        else:
+            sys.modules["_tnetstring"] = saved
+
+
+def dict_payload(*items):
+    """Join pre-rendered items into a tnetstring dict."""
+    payload = "".join(items)
+    return "%d:%s}" % (len(payload),payload)
+
+
+class Test_Schema(unittest.TestCase):
+
+    def test_decode_to_tuple(self):
+        s = tnetstring.Schema(USER_FIELDS)
+        self.assertEquals(s.names,("name","admin","age","tags"))
+        data = tnetstring.dumps({"name":"bob","admin":False,"age":42})
+        self.assertEquals(s.loads(data),("bob",False,42,None))
+        data = tnetstring.dumps({"tags":["a"],"name":"bob","admin":True})
+        self.assertEquals(s.loads(data),("bob",True,None,["a"]))
+
+    def test_decode_with_factory(self):
+        s = tnetstring.Schema(USER_FIELDS,User)
+        data = tnetstring.dumps({"name":"bob","admin":False,"age":None})
+        self.assertEquals(s.loads(data),User("bob",False,None,None))
+        s = tnetstring.Schema([("x",float),("y",float)],Point)
+        p = s.loads(tnetstring.dumps({"x":1.5,"y":-2.0}))
+        self.assertEquals((p.x,p.y),(1.5,-2.0))
+
+    def test_unknown_keys_are_ignored(self):
+        s = tnetstring.Schema(USER_FIELDS)
+        data = tnetstring.dumps({"name":"bob","admin":True,
+                                 "extra":{"deeply":[{"nested":None}]},
+                                 1:"non-string key"})
+        self.assertEquals(s.loads(data),("bob",True,None,None))
+
+    def test_unknown_keys_are_checked(self):
+        #  Values under unknown keys aren't used, but must still be valid.
+        for impl in (tnetstring,load_python_version()):
+            s = impl.Schema([("a",int)])
+            self.assertEquals(s.loads("18:1:a,1:1#1:b,3:123#}"),(1,))
+            for bad in ("3:abc#","0:#","3:1.x^","4:True!","1:x~",
+                        "7:4:trux!]","10:1:k,3:abc#}","6:1:a,1:","3:abc?"):
+                data = dict_payload("1:a,","1:1#","1:b,",bad)
+                self.assertRaises(ValueError,s.loads,data)
+                data = dict_payload("1:a,","1:1#",bad,"1:b,")
+                self.assertRaises(ValueError,s.loads,data)
+            data = dict_payload("1:a,","1:1#","1:1#","3:abc#")
+            self.assertRaises(ValueError,s.loads,data)
+            data = dict_payload("1:a,","1:1#","0:]","1:1#")
+            self.assertRaises(TypeError,s.loads,data)
+            data = dict_payload("1:a,","1:1#","1:b,","7:0:}1:1#}")
+            self.assertRaises(TypeError,s.loads,data)
+            s = impl.Schema([("a",int)],encoding="utf8")
+            data = dict_payload("1:a,","1:1#","1:b,","1:\xff,")
+            self.assertRaises(ValueError,s.loads,data)
+
+    def test_type_errors(self):
+        s = tnetstring.Schema(USER_FIELDS)
+        for bad in ({"name":"bob"},
+                    {"name":"bob","admin":1},
+                    {"name":None,"admin":True},
+                    {"name":"bob","admin":True,"age":"42"}):
+            self.assertRaises(ValueError,s.loads,tnetstring.dumps(bad))
+        self.assertRaises(ValueError,s.loads,tnetstring.dumps(["bob",True]))
+        self.assertRaises(ValueError,s.loads,"20:4:name,3:bob,5:admin,}")
+        self.assertRaises(TypeError,tnetstring.Schema,[("x",set)])
+        self.assertRaises(TypeError,tnetstring.Schema,["x"])
+        self.assertRaises(ValueError,tnetstring.Schema,[("x",int),("x",str)])
+
+    def test_any_type_and_nesting(self):
+        inner = tnetstring.Schema([("x",int),("y",int)])
+        outer = tnetstring.Schema([("id",object),("pos",inner),
+                                   ("next",inner,False)])
+        data = tnetstring.dumps({"id":[1,"two"],"pos":{"x":1,"y":2,"z":3}})
+        self.assertEquals(outer.loads(data),([1,"two"],(1,2),None))
+        data = tnetstring.dumps({"id":None,"pos":{"x":1,"y":2},
+                                 "next":{"x":3,"y":4}})
+        self.assertEquals(outer.loads(data),(None,(1,2),(3,4)))
+        data = tnetstring.dumps({"id":None,"pos":{"x":1}})
+        self.assertRaises(ValueError,outer.loads,data)
+
+    def test_many_fields(self):
+        names = ["field%d" % (i,) for i in xrange(100)]
+        s = tnetstring.Schema([(n,int) for n in names])
+        value = dict((n,i) for (i,n) in enumerate(names))
+        self.assertEquals(s.loads(tnetstring.dumps(value)),tuple(range(100)))
+
+    def test_unicode_and_pop(self):
+        s = tnetstring.Schema([("name",unicode)],encoding="utf8")
+        ALPHA = u"\N{GREEK CAPITAL LETTER ALPHA}lpha"
+        data = tnetstring.dumps({"name":ALPHA},"utf8")
+        self.assertEquals(s.pop(data + "OK"),((ALPHA,),"OK"))
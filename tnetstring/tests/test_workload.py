@@ -0,0 +1,95 @@
+
+import doctest
+import unittest
+
+import tnetstring
+from tnetstring import workload
+
+
+class Test_Workload(unittest.TestCase):
+
+    def test_docstring(self):
+        (failed,_) = doctest.testmod(workload)
+        self.assertEquals(failed,0)
+
+    def test_shape(self):
+        profiler = workload.Profiler()
+        value = {"a":[1,2,3],"bb":{"c":"x" * 100},"d":None}
+        data = profiler.dumps(value)
+        self.assertEquals(profiler.loads(data),value)
+        self.assertEquals(profiler.messages,{"loads":1,"dumps":1})
+        self.assertEquals(profiler.sampled,2)
+        self.assertEquals(profiler.size,{workload._bucket(len(data)):2})
+        self.assertEquals(profiler.depth,{2:2})
+        self.assertEquals(profiler.fanout,{1:2,2:4})
+        self.assertEquals(profiler.string_length,{1:6,2:2,64:2})
+        self.assertEquals(profiler.tags,{",":10,"#":6,"~":2,"]":2,"}":4})
+        self.assertEquals(profiler.record("1:5#extra"),4)
+        self.assertEquals(profiler.depth,{0:1,2:2})
+        self.assertRaises(ValueError,profiler.record,"5:1:a,]")
+
+    def test_sampling(self):
+        profiler = workload.Profiler(rate=0.25,seed=7)
+        for i in xrange(400):
+            profiler.loads(tnetstring.dumps(i))
+        self.assertEquals(profiler.messages["loads"],400)
+        self.assertTrue(50 < profiler.sampled < 150)
+        self.assertEquals(sum(profiler.size.itervalues()),profiler.sampled)
+        self.assertRaises(ValueError,workload.Profiler,1.5)
+
+    def test_install(self):
+        profiler = workload.Profiler()
+        (loads,dumps) = (tnetstring.loads,tnetstring.dumps)
+        profiler.install()
+        try:
+            self.assertRaises(RuntimeError,profiler.install)
+            tnetstring.loads(tnetstring.dumps([1,"two"]))
+        finally:
+            profiler.uninstall()
+        self.assertTrue(tnetstring.loads is loads)
+        self.assertTrue(tnetstring.dumps is dumps)
+        self.assertEquals(profiler.messages,{"loads":1,"dumps":1})
+        self.assertEquals(profiler.tags,{"#":2,",":2,"]":2})
+
+    def test_export(self):
+        profiler = workload.Profiler()
+        profiler.dumps({"key":[1.5,True,"value"]})
+        data = tnetstring.loads(tnetstring.dumps(profiler.export()))
+        other = workload.Profiler()
+        other.merge(data)
+        other.merge(data)
+        self.assertEquals(other.sampled,2)
+        self.assertEquals(other.tags,{",":4,"^":2,"!":2,"]":2,"}":2})
+        self.assertEquals(other.depth,{2:2})
+        lines = other.format().splitlines()
+        self.assertEquals(lines[1].split("\t"),
+                          ["histogram","bucket","count","percent"])
+        self.assertTrue("depth\t2\t2\t100.00" in lines)
+
+    def test_deep_nesting(self):
+        profiler = workload.Profiler()
+        data = "0:~"
+        for i in xrange(3000):
+            data = "%d:%s]" % (len(data),data)
+        self.assertEquals(profiler.record(data),len(data))
+        self.assertEquals(profiler.depth,{3000:1})
+        self.assertEquals(profiler.fanout,{1:3000})
+        self.assertEquals(profiler.tags,{"]":3000,"~":1})
+
+    def test_broken_messages(self):
+        profiler = workload.Profiler()
+        for data in ("5:1:a,]","+3:abc,","03:abc,"," 3:abc,","9:1:a,1:b,}",
+                     "11:1:a,3:xyz,]","7:1:a,1:b]"):
+            self.assertRaises(ValueError,profiler.record,data)
+        self.assertEquals(profiler.sampled,0)
+        self.assertEquals(profiler.tags,{})
+        self.assertEquals(profiler.fanout,{})
+        self.assertEquals(profiler.string_length,{})
+        #  A message that loads but can't be scanned is counted, not raised.
+        loads = lambda string,encoding: string
+        self.assertEquals(profiler.loads("4:1:a,]",None,loads),"4:1:a,]")
+        self.assertEquals(profiler.loads(" 3:abc,",None,loads)," 3:abc,")
+        self.assertEquals(profiler.messages["loads"],2)
+        self.assertEquals((profiler.sampled,profiler.errors),(1,1))
+        self.assertEquals(profiler.tags,{",":1,"]":1})
+        self.assertTrue(" errors=1 " in profiler.format())
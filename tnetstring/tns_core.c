@@ -6,6 +6,9 @@
 //  think of it like a JSON library that uses a simpler wire format.
 //
 
+#include <assert.h>
+#include <string.h>
+
 #include "dbg.h"
 #include "tns_core.h"
 
@@ -17,18 +20,19 @@
 //  the allocated buffer.  When finished we simply memmove it to the front.
 //  Here *buffer points to the allocated buffer, while *head points to the
 //  last characer written to the buffer (and thus decreases as we write).
+//  We also remember the initial allocation, to tell if it had to grow.
 struct tns_outbuf_s {
   char *buffer;
   char *head;
   size_t alloc_size;
+  size_t init_size;
 };
 
 
-//  Helper function for parsing a dict; basically parses items in a loop.
-static int tns_parse_dict(const tns_ops *ops, void *dict, const char *data, size_t len);
-
-//  Helper function for parsing a list; basically parses items in a loop.
-static int tns_parse_list(const tns_ops *ops, void *list, const char *data, size_t len);
+//  Helper function to count the items in a list or dict payload, by
+//  hopping over their length prefixes.  This doesn't validate anything
+//  beyond what it needs to hop safely, so it's only good as a size hint.
+static size_t tns_count_items(const char *data, size_t len);
 
 //  Helper function for writing the length prefix onto a rendered value.
 static int tns_outbuf_clamp(tns_outbuf *outbuf, size_t orig_size);
@@ -46,251 +50,142 @@ static void tns_outbuf_free(tns_outbuf *outbuf);
 static size_t tns_strtosz(const char *data, size_t len, size_t *sz, char **end);
 
 
-void* tns_parse(const tns_ops *ops, const char *data, size_t len, char **remain)
-{
-  char *valstr = NULL;
-  tns_type_tag type = tns_tag_null;
-  size_t vallen = 0;
-
-  //  Read the length of the value, and verify that it ends in a colon.
-  check(tns_strtosz(data, len, &vallen, &valstr) != -1,
-        "Not a tnetstring: invalid length prefix.");
-  check(*valstr == ':',
-        "Not a tnetstring: invalid length prefix.");
-  valstr++;
-  check((valstr+vallen) < (data+len),
-        "Not a tnetstring: invalid length prefix.");
+#ifdef TNS_STATS
 
-  //  Grab the type tag from the end of the value.
-  type = valstr[vallen];
+tns_stats tns_global_stats;
 
-  //  Output the remainder of the string if necessary.
-  if(remain != NULL) {
-      *remain = valstr + vallen + 1;
+void tns_stats_get(tns_stats *stats, int reset)
+{
+  *stats = tns_global_stats;
+  if(reset) {
+      memset(&tns_global_stats, 0, sizeof(tns_stats));
   }
-
-  //  Now dispatch type parsing based on the type tag.
-  return tns_parse_payload(ops, type, valstr, vallen);
-
-error:
-  return NULL;
 }
 
-
-//  This appears to be faster than using strncmp to compare
-//  against a small string constant.  Ugly but fast.
-#define STR_EQ_TRUE(s) (s[0]=='t' && s[1]=='r' && s[2]=='u' && s[3]=='e')
-#define STR_EQ_FALSE(s) (s[0]=='f' && s[1]=='a' && s[2]=='l' \
-                                   && s[3]=='s' && s[4] == 'e')
-
-void* tns_parse_payload(const tns_ops *ops,tns_type_tag type, const char *data, size_t len)
+//  Count the root cause of a failure to parse a value of the given type.
+//  Broken containers aren't counted, since their items already were.
+static void tns_stats_parse_error(tns_type_tag type)
 {
-  void *val = NULL;
-
-  assert(ops != NULL && "ops struct cannot be NULL");
-
   switch(type) {
-    //  Primitive type: a string blob.
     case tns_tag_string:
-        val = ops->parse_string(ops, data, len);
-        check(val != NULL, "Not a tnetstring: invalid string literal.");
+        TNS_STAT_INC(err_string);
         break;
-    //  Primitive type: an integer.
     case tns_tag_integer:
-        val = ops->parse_integer(ops, data, len);
-        check(val != NULL, "Not a tnetstring: invalid integer literal.");
+        TNS_STAT_INC(err_integer);
         break;
-    //  Primitive type: a float.
     case tns_tag_float:
-        val = ops->parse_float(ops, data, len);
-        check(val != NULL, "Not a tnetstring: invalid float literal.");
+        TNS_STAT_INC(err_float);
         break;
-    //  Primitive type: a boolean.
-    //  The only acceptable values are "true" and "false".
     case tns_tag_bool:
-        if(len == 4 && STR_EQ_TRUE(data)) {
-            val = ops->get_true(ops);
-        } else if(len == 5 && STR_EQ_FALSE(data)) {
-            val = ops->get_false(ops);
-        } else {
-            sentinel("Not a tnetstring: invalid boolean literal.");
-            val = NULL;
-        }
+        TNS_STAT_INC(err_bool);
         break;
-    //  Primitive type: a null.
-    //  This must be a zero-length string.
     case tns_tag_null:
-        check(len == 0, "Not a tnetstring: invalid null literal.");
-        val = ops->get_null(ops);
+        TNS_STAT_INC(err_null);
         break;
-    //  Compound type: a dict.
-    //  The data is written <key><value><key><value>
     case tns_tag_dict:
-        val = ops->new_dict(ops);
-        check(val != NULL, "Could not create dict.");
-        check(tns_parse_dict(ops, val, data, len) != -1,
-              "Not a tnetstring: broken dict items.");
-        break;
-    //  Compound type: a list.
-    //  The data is written <item><item><item>
     case tns_tag_list:
-        val = ops->new_list(ops);
-        check(val != NULL, "Could not create list.");
-        check(tns_parse_list(ops, val, data, len) != -1,
-              "Not a tnetstring: broken list items.");
         break;
-    //  Whoops, that ain't a tnetstring.
     default:
-        sentinel("Not a tnetstring: invalid type tag.");
+        TNS_STAT_INC(err_type_tag);
   }
-
-  return val;
-
-error:
-  if(val != NULL) {
-      ops->free_value(ops, val);
-  }
-  return NULL;
 }
 
-#undef STR_EQ_TRUE
-#undef STR_EQ_FALSE
+#define TNS_STAT_PARSE_ERROR(type) tns_stats_parse_error(type)
 
+#else
 
-char* tns_render(const tns_ops *ops, void *val, size_t *len)
-{
-  tns_outbuf outbuf;
-
-  check(tns_outbuf_init(&outbuf) != -1, "Failed to initialize outbuf.");
-  check(tns_render_value(ops, val, &outbuf) != -1, "Failed to render value.");
+#define TNS_STAT_PARSE_ERROR(type)
 
-  return tns_outbuf_finalize(&outbuf, len);
-  
-error:
-  tns_outbuf_free(&outbuf);
-  return NULL;
-}
+#endif
 
 
-int tns_render_value(const tns_ops *ops, void *val, tns_outbuf *outbuf)
-{
-  tns_type_tag type = tns_tag_null;
-  int res = -1;
-  size_t orig_size = 0;
+//  The parse and render loops live in tns_core_tmpl.h, so they can also be
+//  built specialized to a fixed set of ops.  This is the generic instance,
+//  which calls through the function pointers in the ops struct.
+#define TNS_FUNC(name) tns_##name
+#define TNS_OP(ops, name) ((ops)->name)
+#define TNS_HAS_OP(ops, name) ((ops)->name != NULL)
+#define TNS_SCOPE
+#include "tns_core_tmpl.h"
 
-  assert(ops != NULL && "ops struct cannot be NULL");
 
-  //  Find out the type tag for the given value.
-  type = ops->get_type(ops, val);
-  check(type != 0, "type not serializable.");
-
-  tns_outbuf_putc(outbuf, type);
-  orig_size = tns_outbuf_size(outbuf);
+int tns_split_value(const char *data, size_t len, tns_type_tag *type,
+                    char **payload, size_t *paylen, char **remain)
+{
+  char *valstr = NULL;
+  size_t vallen = 0;
 
-  //  Render it into the output buffer using callbacks.
-  switch(type) {
-    case tns_tag_string:
-      res = ops->render_string(ops, val, outbuf);
-      break;
-    case tns_tag_integer:
-      res = ops->render_integer(ops, val, outbuf);
-      break;
-    case tns_tag_float:
-      res = ops->render_float(ops, val, outbuf);
-      break;
-    case tns_tag_bool:
-      res = ops->render_bool(ops, val, outbuf);
-      break;
-    case tns_tag_null:
-      res = 0;
-      break;
-    case tns_tag_dict:
-      res = ops->render_dict(ops, val, outbuf);
-      break;
-    case tns_tag_list:
-      res = ops->render_list(ops, val, outbuf);
-      break;
-    default:
-      sentinel("unknown type tag: '%c'.", type);
-  }
+  //  Read the length of the value, and verify that it ends in a colon.
+  check(len > 0, "Not a tnetstring: invalid length prefix.");
+  check(tns_strtosz(data, len, &vallen, &valstr) != -1,
+        "Not a tnetstring: invalid length prefix.");
+  check(*valstr == ':',
+        "Not a tnetstring: invalid length prefix.");
+  valstr++;
+  check((valstr+vallen) < (data+len),
+        "Not a tnetstring: invalid length prefix.");
 
-  check(res == 0, "Failed to render value of type '%c'.", type);
-  return tns_outbuf_clamp(outbuf, orig_size);
+  //  Grab the type tag from the end of the value.
+  *type = valstr[vallen];
+  *payload = valstr;
+  *paylen = vallen;
+  *remain = valstr + vallen + 1;
+  return 0;
 
 error:
+  TNS_STAT_INC(err_length_prefix);
   return -1;
 }
 
 
-static int tns_parse_list(const tns_ops *ops, void *val, const char *data, size_t len)
+char* tns_render(const tns_ops *ops, void *val, size_t *len)
 {
-  void *item = NULL;
-  char *remain = NULL;
-
-  assert(val != NULL && "value cannot be NULL");
-  assert(data != NULL && "data cannot be NULL");
-
-  while(len > 0) {
-      item = tns_parse(ops, data, len, &remain);
-      check(item != NULL, "Failed to parse list.");
-      len = len - (remain - data);
-      data = remain;
-      check(ops->add_to_list(ops, val, item) != -1,
-            "Failed to add item to list.");
-      item = NULL;
-  }
-
-  return 0;
-
-error:
-  if(item) {
-      ops->free_value(ops, item);
-  }
-  return -1;
+  return tns_render_hint(ops, val, len, NULL);
 }
 
 
-static int tns_parse_dict(const tns_ops *ops, void *val, const char *data, size_t len)
+char* tns_render_hint(const tns_ops *ops, void *val, size_t *len,
+                      tns_outbuf_hint *hint)
 {
-  void *key = NULL;
-  void *item = NULL;
-  char *remain = NULL;
+  tns_outbuf outbuf;
 
-  assert(val != NULL && "value cannot be NULL");
-  assert(data != NULL && "data cannot be NULL");
+  check(tns_outbuf_init_hint(&outbuf, hint) != -1,
+        "Failed to initialize outbuf.");
+  check(tns_render_value(ops, val, &outbuf) != -1, "Failed to render value.");
+  if(hint != NULL) {
+      tns_outbuf_hint_update(hint, &outbuf);
+  }
 
-  while(len > 0) {
-      key = tns_parse(ops, data, len, &remain);
-      check(key != NULL, "Failed to parse dict key from tnetstring.");
-      len = len - (remain - data);
-      data = remain;
+  return tns_outbuf_finalize(&outbuf, len);
+  
+error:
+  tns_outbuf_free(&outbuf);
+  return NULL;
+}
 
-      item = tns_parse(ops, data, len, &remain);
-      check(item != NULL, "Failed to parse dict item from tnetstring.");
-      len = len - (remain - data);
-      data = remain;
 
-      check(ops->add_to_dict(ops, val, key, item) != -1,
-            "Failed to add element to dict.");
+static size_t tns_count_items(const char *data, size_t len)
+{
+  const char *eod = data + len;
+  char *valstr = NULL;
+  size_t vallen = 0;
+  size_t count = 0;
 
-      key = NULL;
-      item = NULL;
+  while(data < eod) {
+      if(tns_strtosz(data, eod - data, &vallen, &valstr) == -1) {
+          break;
+      }
+      if(*valstr != ':' || vallen >= (size_t)(eod - valstr - 1)) {
+          break;
+      }
+      data = valstr + 1 + vallen + 1;
+      count++;
   }
 
-  return 0;
-
-error:
-  if(key) {
-      ops->free_value(ops, key);
-  }
-  if(item) {
-      ops->free_value(ops, item);
-  }
-  return -1;
+  return count;
 }
 
 
-
 static INLINE size_t
 tns_strtosz(const char *data, size_t len, size_t *sz, char **end)
 {
@@ -368,20 +263,61 @@ error:
 
 int tns_outbuf_init(tns_outbuf *outbuf)
 {
-  outbuf->buffer = malloc(64);
+  return tns_outbuf_init_hint(outbuf, NULL);
+}
+
+
+int tns_outbuf_init_hint(tns_outbuf *outbuf, tns_outbuf_hint *hint)
+{
+  size_t size = 64;
+
+  if(hint != NULL && hint->estimate > size) {
+      size = hint->estimate;
+      if(size > TNS_OUTBUF_MAX_HINT) {
+          size = TNS_OUTBUF_MAX_HINT;
+      }
+  }
+
+  TNS_STAT_INC(outbuf_inits);
+  TNS_STAT_ADD(outbuf_alloc_bytes, size);
+  outbuf->buffer = malloc(size);
+  if(outbuf->buffer == NULL) {
+      TNS_STAT_INC(err_memory);
+  }
   check_mem(outbuf->buffer);
 
-  outbuf->head = outbuf->buffer + 64;
-  outbuf->alloc_size = 64;
+  outbuf->head = outbuf->buffer + size;
+  outbuf->alloc_size = size;
+  outbuf->init_size = size;
   return 0;
 
 error:
   outbuf->head = NULL;
   outbuf->alloc_size = 0;
+  outbuf->init_size = 0;
   return -1;
 }
 
 
+void tns_outbuf_hint_update(tns_outbuf_hint *hint, tns_outbuf *outbuf)
+{
+  size_t size = tns_outbuf_size(outbuf);
+
+  hint->renders++;
+  if(outbuf->alloc_size > outbuf->init_size) {
+      hint->extends++;
+  }
+  //  Jump straight up to cover a bigger value, but only decay by 1/16th
+  //  of the difference for a smaller one, so that an occasional small
+  //  value in a stream of big ones doesn't cause another round of growth.
+  if(size >= hint->estimate) {
+      hint->estimate = size;
+  } else {
+      hint->estimate -= (hint->estimate - size) / 16;
+  }
+}
+
+
 static INLINE void tns_outbuf_free(tns_outbuf *outbuf)
 {
   if(outbuf) {
@@ -389,6 +325,7 @@ static INLINE void tns_outbuf_free(tns_outbuf *outbuf)
       outbuf->buffer = NULL;
       outbuf->head = 0;
       outbuf->alloc_size = 0;
+      outbuf->init_size = 0;
   }
 }
 
@@ -407,10 +344,16 @@ static INLINE int tns_outbuf_extend(tns_outbuf *outbuf, size_t free_size)
   }
 
   new_buf = malloc(new_size);
+  if(new_buf == NULL) {
+      TNS_STAT_INC(err_memory);
+  }
   check_mem(new_buf);
  
   new_head = new_buf + new_size - used_size;
   memmove(new_head, outbuf->head, used_size);
+  TNS_STAT_INC(outbuf_extends);
+  TNS_STAT_ADD(outbuf_extend_bytes, used_size);
+  TNS_STAT_ADD(outbuf_alloc_bytes, new_size);
 
   free(outbuf->buffer);
   outbuf->buffer = new_buf;
@@ -463,6 +406,7 @@ static char* tns_outbuf_finalize(tns_outbuf *outbuf, size_t *len)
   used_size = tns_outbuf_size(outbuf);
 
   memmove(outbuf->buffer, outbuf->head, used_size);
+  TNS_STAT_ADD(outbuf_final_bytes, used_size);
 
   if(len != NULL) {
       *len = used_size;
@@ -470,6 +414,7 @@ static char* tns_outbuf_finalize(tns_outbuf *outbuf, size_t *len)
       if(outbuf->head == outbuf->buffer) {
           new_buf = realloc(outbuf->buffer, outbuf->alloc_size*2);
           check_mem(new_buf);
+          TNS_STAT_ADD(outbuf_alloc_bytes, outbuf->alloc_size);
           outbuf->buffer = new_buf;
           outbuf->alloc_size = outbuf->alloc_size * 2;
       }
@@ -502,6 +447,7 @@ error:
 
 void tns_outbuf_memmove(tns_outbuf *outbuf, char *dest)
 {
+  TNS_STAT_ADD(outbuf_final_bytes, tns_outbuf_size(outbuf));
   memmove(dest, outbuf->head, tns_outbuf_size(outbuf));
 }
 
@@ -19,6 +19,10 @@
   #define INLINE inline        /* use standard inline */
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 
 //  tnetstring rendering is done using an "outbuf" struct, which combines
 //  a malloced string with its allocation information.  Rendering is done
@@ -85,6 +89,13 @@ struct tns_ops_s {
   int (*add_to_dict)(const tns_ops *ops, void* dict, void* key, void* item);
   int (*render_dict)(const tns_ops *ops, void* dict, tns_outbuf *outbuf);
 
+  //  Optional constructors for containers that will receive exactly 'size'
+  //  items, found by hopping over the length prefixes before parsing them.
+  //  Use these to allocate the container at its final capacity up front.
+  //  If NULL, the core calls new_list/new_dict and skips the pre-scan.
+  void* (*new_list_sized)(const tns_ops *ops, size_t size);
+  void* (*new_dict_sized)(const tns_ops *ops, size_t size);
+
   //  Free values that are no longer in use
   void (*free_value)(const tns_ops *ops, void *value);
 
@@ -102,6 +113,13 @@ extern void* tns_parse(const tns_ops *ops, const char *data, size_t len, char**
 //  the payload parsing logic.
 extern void* tns_parse_payload(const tns_ops *ops, tns_type_tag type, const char *data, size_t len);
 
+//  Split the tnetstring at the front of a string into its type tag and
+//  payload without parsing the payload, e.g. to skip over a value or to
+//  dispatch on its type yourself.  Returns 0 on success, -1 on error.
+//  The final argument receives the unparsed remainder of the string.
+extern int tns_split_value(const char *data, size_t len, tns_type_tag *type,
+                           char **payload, size_t *paylen, char **remain);
+
 //  Render an object into a string.
 //  On success this function returns a malloced string containing
 //  the serialization of the given object.  The second argument
@@ -120,9 +138,92 @@ extern int tns_render_value(const tns_ops *ops, void *val, tns_outbuf *outbuf);
 extern int tns_outbuf_init(tns_outbuf *outbuf);
 extern void tns_outbuf_memmove(tns_outbuf *outbuf, char *dest);
 
+//  A fresh outbuf starts small and doubles as needed, so a 2KB value costs
+//  five reallocations.  If you render similar values over and over, keep
+//  one of these per call site (or per thread, they're not synchronized) to
+//  size the first allocation from a moving estimate of recent output sizes.
+//  The estimate jumps up to any larger output and decays slowly back down.
+//  It's capped at TNS_OUTBUF_MAX_HINT bytes.  The counters record how many
+//  renders were done and how many of them still had to grow the outbuf.
+//  Zero-initialize the struct before first use.
+struct tns_outbuf_hint_s {
+  size_t estimate;
+  size_t renders;
+  size_t extends;
+};
+typedef struct tns_outbuf_hint_s tns_outbuf_hint;
+
+#ifndef TNS_OUTBUF_MAX_HINT
+#define TNS_OUTBUF_MAX_HINT 65536
+#endif
+
+//  Initialize an outbuf at the size suggested by the hint.
+//  Call tns_outbuf_hint_update before finishing with the outbuf.
+extern int tns_outbuf_init_hint(tns_outbuf *outbuf, tns_outbuf_hint *hint);
+extern void tns_outbuf_hint_update(tns_outbuf_hint *hint, tns_outbuf *outbuf);
+
+//  Like tns_render, but using a hint for the initial outbuf size.
+extern char* tns_render_hint(const tns_ops *ops, void *val, size_t *len,
+                             tns_outbuf_hint *hint);
+
 //  Use these functions for rendering into an outbuf.
 extern size_t tns_outbuf_size(tns_outbuf *outbuf);
 extern int tns_outbuf_putc(tns_outbuf *outbuf, char c);
 extern int tns_outbuf_puts(tns_outbuf *outbuf, const char *data, size_t len);
 
+
+//  If compiled with TNS_STATS defined, the core keeps count of what it's
+//  doing in the hot paths: how often the outbuf has to grow, how much
+//  memory it allocates and how much data gets moved around, how many
+//  values of each type are parsed, and the root cause of each parse or
+//  render error.  The counters are global and unsynchronized, so callers
+//  must serialize access to the core.  Without TNS_STATS, all the
+//  counting compiles away to nothing.
+#ifdef TNS_STATS
+
+struct tns_stats_s {
+  size_t outbuf_inits;
+  size_t outbuf_extends;
+  size_t outbuf_extend_bytes;
+  size_t outbuf_alloc_bytes;
+  size_t outbuf_final_bytes;
+  size_t parsed_string;
+  size_t parsed_integer;
+  size_t parsed_float;
+  size_t parsed_bool;
+  size_t parsed_null;
+  size_t parsed_dict;
+  size_t parsed_list;
+  size_t err_length_prefix;
+  size_t err_string;
+  size_t err_integer;
+  size_t err_float;
+  size_t err_bool;
+  size_t err_null;
+  size_t err_type_tag;
+  size_t err_unserializable;
+  size_t err_render;
+  size_t err_memory;
+};
+typedef struct tns_stats_s tns_stats;
+
+extern tns_stats tns_global_stats;
+
+//  Copy the current counters into 'stats', then zero them if 'reset'.
+extern void tns_stats_get(tns_stats *stats, int reset);
+
+#define TNS_STAT_INC(field) (tns_global_stats.field++)
+#define TNS_STAT_ADD(field, n) (tns_global_stats.field += (n))
+
+#else
+
+#define TNS_STAT_INC(field)
+#define TNS_STAT_ADD(field, n)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,1486 @@
+//
+//  tns_core.hpp:  header-only C++ binding for tnetstrings
+//
+//  This maps tnetstrings directly onto C++ structs.  Rather than building
+//  a tree of void* values through the tns_ops callbacks, you declare the
+//  fields of each struct at compile time and the templates below decode
+//  into (and render from) those fields directly:
+//
+//    struct user {
+//      std::string_view name;
+//      int64_t age;
+//      std::optional<bool> admin;
+//      std::vector<std::string_view> tags;
+//    };
+//    TNS_FIELDS(user, name, age, admin, tags)
+//
+//    user u;
+//    if(!tns::loads(data, u)) { ... }
+//    std::string out = tns::dumps(u);
+//
+//  Supported field types are std::string_view, std::string, bool, the
+//  integer and floating-point types, std::optional<T>, std::vector<T>
+//  and other structs declared with TNS_FIELDS.  Decoded string_views point
+//  into the input buffer, so they're only valid as long as it is.
+//
+//  Constant fragments can be encoded at compile time with tns::lit, and
+//  spliced into the output as tns::fixed or tns::raw fields.  With C++20,
+//  tns::dumps_into can also render into buffers that you supply, and
+//  tns::dumps_iov into iovecs that refer to big strings in place.
+//
+//  Struct fields that aren't std::optional are required when decoding;
+//  optional fields that are missing come out empty.
+//  Keys that aren't fields of the struct are skipped without parsing.
+//  All dispatch happens at compile time; there are no virtual calls.
+//
+//  For data whose shape isn't known up front, tns::parser calls handlers
+//  that you define for each value, much like the tns_ops callbacks but
+//  bound at compile time.  Or tns::document wraps the arena-allocated node
+//  array from tns_dom.h, taking its memory from a std::pmr::memory_resource.
+//  tns::parallel_parser, in tns_parallel.hpp, fills one using many threads.
+//  For documents too big to parse at all, tns::cursor navigates them in
+//  place, e.g. in a tns::mapped_file.  Those parts aren't header-only:
+//  you'll also need to compile tns_dom.c into your program.
+//
+
+#ifndef _tns_core_hpp
+#define _tns_core_hpp
+
+#include <cctype>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "tns_core.h"
+#include "tns_dom.h"
+
+#if defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define TNS_HAVE_PMR 1
+#endif
+#if __has_include(<span>) && __cplusplus >= 202002L
+#include <span>
+#define TNS_HAVE_SPAN 1
+#endif
+#if __has_include(<sys/uio.h>)
+#include <sys/uio.h>
+#define TNS_HAVE_IOVEC 1
+#endif
+#endif
+
+#ifndef TNS_MAX_LENGTH
+#define TNS_MAX_LENGTH 999999999
+#endif
+
+
+namespace tns {
+
+
+//  A struct field: its name in the tnetstring dict, and a pointer to the
+//  member that stores it.  Usually created by the TNS_FIELDS macro.
+template<class T, class M>
+struct field {
+  std::string_view name;
+  M T::*member;
+};
+
+template<class T, class M>
+constexpr field<T, M> make_field(std::string_view name, M T::*member)
+{
+  return field<T, M>{name, member};
+}
+
+
+//  A tnetstring encoded at compile time, held by value as exactly N bytes.
+//  Build these with the functions in tns::lit, so constant fragments of
+//  the output (fixed status dicts, header sets) are static data that never
+//  needs rendering:
+//
+//    constexpr auto ok = tns::lit::dict(
+//        tns::lit::string("code"), tns::lit::integer<200>(),
+//        tns::lit::string("status"), tns::lit::string("OK"));
+//    static_assert(ok.view() == "27:4:code,3:200#6:status,2:OK,}");
+//
+template<size_t N>
+struct fixed {
+  char bytes[N];
+
+  constexpr size_t size() const noexcept { return N; }
+  constexpr const char *data() const noexcept { return bytes; }
+  constexpr std::string_view view() const noexcept
+  {
+    return std::string_view(bytes, N);
+  }
+};
+
+
+//  A value that is already encoded as a tnetstring, such as the view() of
+//  a tns::fixed.  As a struct field or vector item it's spliced into the
+//  output as is, without checking that it's a single valid tnetstring.
+//  Decoding into one just records the bytes of the value without parsing
+//  its payload, e.g. to pass part of a message along untouched.
+struct raw {
+  std::string_view bytes;
+};
+
+
+//  Split the tnetstring at the front of 'data' into its type tag and
+//  payload, without parsing the payload.  This follows the same rules as
+//  tns_split_value in the C core.  On success 'data' is advanced past
+//  the value; on failure it is left untouched.
+inline bool split(std::string_view &data, tns_type_tag &type,
+                  std::string_view &payload) noexcept
+{
+  size_t len = 0;
+  size_t pos = 0;
+
+  if(data.empty()) {
+      return false;
+  }
+  //  The netstring spec explicitly forbids padding zeros.
+  //  So if it's a zero, it must be the only char in the length.
+  if(data[0] == '0') {
+      pos = 1;
+  } else if(data[0] >= '1' && data[0] <= '9') {
+      while(pos < data.size() && data[pos] >= '0' && data[pos] <= '9') {
+          len = (len * 10) + (data[pos] - '0');
+          if(len > TNS_MAX_LENGTH) {
+              return false;
+          }
+          pos++;
+      }
+  } else {
+      return false;
+  }
+  if(pos >= data.size() || data[pos] != ':') {
+      return false;
+  }
+  pos++;
+  if(len >= data.size() - pos) {
+      return false;
+  }
+
+  payload = data.substr(pos, len);
+  type = static_cast<tns_type_tag>(data[pos + len]);
+  data.remove_prefix(pos + len + 1);
+  return true;
+}
+
+
+namespace detail {
+
+template<class T>
+struct is_optional : std::false_type {};
+template<class T>
+struct is_optional<std::optional<T>> : std::true_type {};
+
+template<class T>
+struct is_vector : std::false_type {};
+template<class T, class A>
+struct is_vector<std::vector<T, A>> : std::true_type {};
+
+//  Structs are detected by looking up tns_fields() through ADL.
+template<class T, class = void>
+struct has_fields : std::false_type {};
+template<class T>
+struct has_fields<T, std::void_t<decltype(tns_fields((const T*)nullptr))>>
+    : std::true_type {};
+
+template<class T>
+constexpr auto fields_of()
+{
+  return tns_fields((const T*)nullptr);
+}
+
+template<class T>
+struct dependent_false : std::false_type {};
+
+template<class T>
+struct is_fixed : std::false_type {};
+template<size_t N>
+struct is_fixed<fixed<N>> : std::true_type {};
+
+
+constexpr size_t digits(size_t n) noexcept
+{
+  size_t d = 1;
+
+  while(n >= 10) {
+      n /= 10;
+      d++;
+  }
+  return d;
+}
+
+
+//  The size of a value with a payload of 'len' bytes, once it has its
+//  length prefix and type tag.
+constexpr size_t framed_size(size_t len) noexcept
+{
+  return digits(len) + 1 + len + 1;
+}
+
+//  Optional handlers of tns::parser are detected with these.
+template<class H, class V, class = void>
+struct has_new_list_sized : std::false_type {};
+template<class H, class V>
+struct has_new_list_sized<H, V, std::void_t<decltype(
+    std::declval<H&>().new_list_sized(std::declval<V&>(), size_t()))>>
+    : std::true_type {};
+
+template<class H, class V, class = void>
+struct has_new_dict_sized : std::false_type {};
+template<class H, class V>
+struct has_new_dict_sized<H, V, std::void_t<decltype(
+    std::declval<H&>().new_dict_sized(std::declval<V&>(), size_t()))>>
+    : std::true_type {};
+
+
+//  Count the items in a list or dict payload by hopping over their
+//  length prefixes.  Like tns_count_items, it's only good as a size hint.
+inline size_t count_items(std::string_view payload) noexcept
+{
+  tns_type_tag type;
+  std::string_view item;
+  size_t count = 0;
+
+  while(split(payload, type, item)) {
+      count++;
+  }
+  return count;
+}
+
+
+template<class T>
+bool parse_integer(std::string_view payload, T &out) noexcept
+{
+  const char *pos = payload.data();
+  const char *eod = pos + payload.size();
+
+  //  from_chars doesn't accept a leading plus sign, but the C core does.
+  if(pos < eod && *pos == '+') {
+      pos++;
+      if(pos < eod && *pos == '-') {
+          return false;
+      }
+  }
+  if(pos == eod) {
+      return false;
+  }
+  auto res = std::from_chars(pos, eod, out);
+  return res.ec == std::errc() && res.ptr == eod;
+}
+
+
+template<class T>
+bool parse_float(std::string_view payload, T &out) noexcept
+{
+  char buf[64];
+  char *end = nullptr;
+  double d;
+
+  //  Not every standard library has from_chars for floats yet, so we
+  //  copy into a terminated buffer for strtod.  No float literal that
+  //  round-trips needs anywhere near this many characters.  strtod would
+  //  skip leading whitespace, which isn't part of a float literal.
+  if(payload.empty() || payload.size() >= sizeof(buf) ||
+     std::isspace(static_cast<unsigned char>(payload[0]))) {
+      return false;
+  }
+  memcpy(buf, payload.data(), payload.size());
+  buf[payload.size()] = '\0';
+  d = strtod(buf, &end);
+  if(end != buf + payload.size()) {
+      return false;
+  }
+  out = static_cast<T>(d);
+  return true;
+}
+
+
+template<class T>
+bool decode_value(tns_type_tag type, std::string_view payload, T &out);
+
+
+template<class T, class Fields, size_t... I>
+bool decode_field(std::string_view key, tns_type_tag type,
+                  std::string_view payload, T &out, const Fields &fields,
+                  bool *seen, std::index_sequence<I...>)
+{
+  bool matched = false;
+  bool ok = true;
+
+  ((!matched && std::get<I>(fields).name == key
+      ? (matched = true, seen[I] = true,
+         ok = decode_value(type, payload, out.*(std::get<I>(fields).member)))
+      : false), ...);
+  return ok;
+}
+
+
+template<class T, class Fields, size_t... I>
+bool check_required(const Fields &fields, const bool *seen,
+                    std::index_sequence<I...>)
+{
+  bool ok = true;
+
+  ((ok = ok && (seen[I] || is_optional<std::remove_reference_t<
+          decltype(std::declval<T&>().*(std::get<I>(fields).member))>>::value)),
+   ...);
+  return ok;
+}
+
+
+//  Optional fields that weren't in the dict are reset, so that decoding
+//  into a struct that was used before doesn't leave stale values behind.
+template<class M>
+void reset_optional(M &) noexcept {}
+
+template<class M>
+void reset_optional(std::optional<M> &out) noexcept { out.reset(); }
+
+template<class T, class Fields, size_t... I>
+void reset_missing(T &out, const Fields &fields, const bool *seen,
+                   std::index_sequence<I...>)
+{
+  ((seen[I] ? void() : reset_optional(out.*(std::get<I>(fields).member))),
+   ...);
+}
+
+
+template<class T>
+bool decode_struct(std::string_view payload, T &out)
+{
+  constexpr auto fields = fields_of<T>();
+  constexpr size_t nfields = std::tuple_size<decltype(fields)>::value;
+  using indices = std::make_index_sequence<nfields>;
+  bool seen[nfields + 1] = {false};
+  tns_type_tag type;
+  std::string_view key, item;
+
+  //  The data is written <key><value><key><value>
+  while(!payload.empty()) {
+      if(!split(payload, type, key) || type != tns_tag_string) {
+          return false;
+      }
+      if(!split(payload, type, item)) {
+          return false;
+      }
+      if(!decode_field(key, type, item, out, fields, seen, indices())) {
+          return false;
+      }
+  }
+  if(!check_required<T>(fields, seen, indices())) {
+      return false;
+  }
+  reset_missing(out, fields, seen, indices());
+  return true;
+}
+
+
+template<class T>
+bool decode_value(tns_type_tag type, std::string_view payload, T &out)
+{
+  if constexpr(std::is_same_v<T, std::string_view>) {
+      if(type != tns_tag_string) {
+          return false;
+      }
+      out = payload;
+      return true;
+  } else if constexpr(std::is_same_v<T, std::string>) {
+      if(type != tns_tag_string) {
+          return false;
+      }
+      out.assign(payload.data(), payload.size());
+      return true;
+  } else if constexpr(std::is_same_v<T, bool>) {
+      if(type != tns_tag_bool) {
+          return false;
+      }
+      if(payload == "true") {
+          out = true;
+      } else if(payload == "false") {
+          out = false;
+      } else {
+          return false;
+      }
+      return true;
+  } else if constexpr(std::is_integral_v<T>) {
+      return type == tns_tag_integer && parse_integer(payload, out);
+  } else if constexpr(std::is_floating_point_v<T>) {
+      //  Integers are accepted too, since they convert exactly.
+      if(type != tns_tag_float && type != tns_tag_integer) {
+          return false;
+      }
+      return parse_float(payload, out);
+  } else if constexpr(is_optional<T>::value) {
+      if(type == tns_tag_null) {
+          if(!payload.empty()) {
+              return false;
+          }
+          out.reset();
+          return true;
+      }
+      return decode_value(type, payload, out.emplace());
+  } else if constexpr(is_vector<T>::value) {
+      tns_type_tag itype;
+      std::string_view item;
+
+      if(type != tns_tag_list) {
+          return false;
+      }
+      out.clear();
+      while(!payload.empty()) {
+          if(!split(payload, itype, item)) {
+              return false;
+          }
+          if(!decode_value(itype, item, out.emplace_back())) {
+              return false;
+          }
+      }
+      return true;
+  } else if constexpr(has_fields<T>::value) {
+      return type == tns_tag_dict && decode_struct(payload, out);
+  } else if constexpr(std::is_same_v<T, raw>) {
+      //  split() only accepts the canonical length prefix, so we know
+      //  exactly where the value starts.
+      size_t prefix = digits(payload.size()) + 1;
+      out.bytes = std::string_view(payload.data() - prefix,
+                                   prefix + payload.size() + 1);
+      return true;
+  } else {
+      static_assert(dependent_false<T>::value,
+                    "type cannot be decoded from a tnetstring");
+  }
+}
+
+
+//  Rendering is done in two passes: first we compute the exact size of
+//  the output, then write it front-to-back into a buffer of that size.
+//  That avoids the back-to-front outbuf and its reallocations.
+//
+//  The output goes to a "sink", which has put(data, len) and put(c) to
+//  write bytes, and put_string(data, len) to write the payload of a
+//  string value.  That lets the same code fill a single buffer, a chain
+//  of buffers, or a list of iovecs that refers to big strings in place.
+
+//  Writes to a buffer that's known to be big enough.
+struct pointer_sink {
+  char *out;
+
+  void put(const char *data, size_t len) noexcept
+  {
+    memcpy(out, data, len);
+    out += len;
+  }
+  void put(char c) noexcept { *out++ = c; }
+  void put_string(const char *data, size_t len) noexcept { put(data, len); }
+};
+
+
+#ifdef TNS_HAVE_SPAN
+
+//  Writes across a chain of buffers that are known to be big enough in
+//  total, moving on to the next buffer whenever one fills up.
+struct chain_sink {
+  const std::span<char> *next;
+  char *out;
+  char *end;
+
+  void put(const char *data, size_t len) noexcept
+  {
+    while(len > static_cast<size_t>(end - out)) {
+        size_t n = end - out;
+        memcpy(out, data, n);
+        data += n;
+        len -= n;
+        out = next->data();
+        end = out + next->size();
+        next++;
+    }
+    memcpy(out, data, len);
+    out += len;
+  }
+  void put(char c) noexcept { put(&c, 1); }
+  void put_string(const char *data, size_t len) noexcept { put(data, len); }
+};
+
+#endif
+
+#ifdef TNS_HAVE_IOVEC
+
+//  Builds a list of iovecs, copying everything into a scratch buffer
+//  except string payloads of at least 'min_ref' bytes, which are referred
+//  to where they are.  If the scratch buffer fills up it carries on just
+//  counting, so we can say how much scratch space would have been needed.
+struct iovec_sink {
+  std::vector<struct iovec> *iov;
+  char *out;
+  char *end;
+  size_t min_ref;
+  size_t needed;
+
+  void put(const char *data, size_t len)
+  {
+    if(len == 0) {
+        return;
+    }
+    needed += len;
+    if(len > static_cast<size_t>(end - out)) {
+        out = end;
+        return;
+    }
+    //  Extend the last iovec if it ends where this starts.
+    if(!iov->empty() &&
+       static_cast<char*>(iov->back().iov_base) + iov->back().iov_len == out) {
+        iov->back().iov_len += len;
+    } else {
+        iov->push_back(iovec{out, len});
+    }
+    memcpy(out, data, len);
+    out += len;
+  }
+  void put(char c) { put(&c, 1); }
+  void put_string(const char *data, size_t len)
+  {
+    if(len < min_ref || len == 0) {
+        put(data, len);
+    } else {
+        iov->push_back(iovec{const_cast<char*>(data), len});
+    }
+  }
+};
+
+#endif
+
+
+template<class Sink>
+void write_frame(Sink &out, size_t len) noexcept
+{
+  char buf[24];
+  char *end = std::to_chars(buf, buf + sizeof(buf) - 1, len).ptr;
+
+  *end++ = ':';
+  out.put(buf, end - buf);
+}
+
+
+//  Floats are written with enough digits to round-trip exactly.
+//  Use the shortest such representation if the library can find it.
+template<class T>
+size_t format_float(T val, char *buf, size_t size) noexcept
+{
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+  return std::to_chars(buf, buf + size, static_cast<double>(val)).ptr - buf;
+#else
+  int n = snprintf(buf, size, "%.17g", static_cast<double>(val));
+  return n < 0 ? 0 : static_cast<size_t>(n);
+#endif
+}
+
+
+template<class T>
+size_t payload_size(const T &val);
+
+template<class T>
+size_t value_size(const T &val)
+{
+  if constexpr(is_optional<T>::value) {
+      if(!val) {
+          return 3;
+      }
+      return value_size(*val);
+  } else if constexpr(std::is_same_v<T, raw>) {
+      return val.bytes.size();
+  } else if constexpr(is_fixed<T>::value) {
+      return val.size();
+  } else {
+      return framed_size(payload_size(val));
+  }
+}
+
+
+template<class T, class Fields, size_t... I>
+size_t fields_size(const T &val, const Fields &fields,
+                   std::index_sequence<I...>)
+{
+  return (0 + ... + (framed_size(std::get<I>(fields).name.size()) +
+                     value_size(val.*(std::get<I>(fields).member))));
+}
+
+
+template<class T>
+size_t payload_size(const T &val)
+{
+  if constexpr(std::is_same_v<T, std::string_view> ||
+               std::is_same_v<T, std::string>) {
+      return val.size();
+  } else if constexpr(std::is_same_v<T, bool>) {
+      return val ? 4 : 5;
+  } else if constexpr(std::is_integral_v<T>) {
+      char buf[24];
+      return std::to_chars(buf, buf + sizeof(buf), val).ptr - buf;
+  } else if constexpr(std::is_floating_point_v<T>) {
+      char buf[32];
+      return format_float(val, buf, sizeof(buf));
+  } else if constexpr(is_vector<T>::value) {
+      size_t size = 0;
+      for(const auto &item : val) {
+          size += value_size(item);
+      }
+      return size;
+  } else if constexpr(has_fields<T>::value) {
+      constexpr auto fields = fields_of<T>();
+      constexpr size_t nfields = std::tuple_size<decltype(fields)>::value;
+      return fields_size(val, fields, std::make_index_sequence<nfields>());
+  } else {
+      static_assert(dependent_false<T>::value,
+                    "type cannot be rendered as a tnetstring");
+  }
+}
+
+
+template<class Sink, class T>
+void write_value(Sink &out, const T &val);
+
+
+template<class Sink, class T, class Fields, size_t... I>
+void write_fields(Sink &out, const T &val, const Fields &fields,
+                  std::index_sequence<I...>)
+{
+  ((write_value(out, std::get<I>(fields).name),
+    write_value(out, val.*(std::get<I>(fields).member))), ...);
+}
+
+
+template<class Sink, class T>
+void write_value(Sink &out, const T &val)
+{
+  if constexpr(is_optional<T>::value) {
+      if(!val) {
+          out.put("0:~", 3);
+          return;
+      }
+      write_value(out, *val);
+  } else if constexpr(std::is_same_v<T, raw>) {
+      out.put(val.bytes.data(), val.bytes.size());
+  } else if constexpr(is_fixed<T>::value) {
+      out.put(val.data(), val.size());
+  } else if constexpr(std::is_same_v<T, std::string_view> ||
+                      std::is_same_v<T, std::string>) {
+      write_frame(out, val.size());
+      out.put_string(val.data(), val.size());
+      out.put(static_cast<char>(tns_tag_string));
+  } else if constexpr(std::is_same_v<T, bool>) {
+      if(val) {
+          out.put("4:true!", 7);
+      } else {
+          out.put("5:false!", 8);
+      }
+  } else if constexpr(std::is_integral_v<T>) {
+      char buf[24];
+      size_t len = std::to_chars(buf, buf + sizeof(buf), val).ptr - buf;
+      write_frame(out, len);
+      out.put(buf, len);
+      out.put(static_cast<char>(tns_tag_integer));
+  } else if constexpr(std::is_floating_point_v<T>) {
+      char buf[32];
+      size_t len = format_float(val, buf, sizeof(buf));
+      write_frame(out, len);
+      out.put(buf, len);
+      out.put(static_cast<char>(tns_tag_float));
+  } else if constexpr(is_vector<T>::value) {
+      write_frame(out, payload_size(val));
+      for(const auto &item : val) {
+          write_value(out, item);
+      }
+      out.put(static_cast<char>(tns_tag_list));
+  } else if constexpr(has_fields<T>::value) {
+      constexpr auto fields = fields_of<T>();
+      constexpr size_t nfields = std::tuple_size<decltype(fields)>::value;
+      write_frame(out, payload_size(val));
+      write_fields(out, val, fields, std::make_index_sequence<nfields>());
+      out.put(static_cast<char>(tns_tag_dict));
+  } else {
+      static_assert(dependent_false<T>::value,
+                    "type cannot be rendered as a tnetstring");
+  }
+}
+
+}  // namespace detail
+
+
+//  Builders for tns::fixed constants.  Sizes depend on the values, so
+//  integers and booleans are given as template arguments.  There's no
+//  builder for floats, since formatting them can't be done constexpr.
+namespace lit {
+
+namespace detail {
+
+template<size_t N>
+constexpr void put_frame(fixed<N> &out, size_t &pos, size_t len) noexcept
+{
+  size_t d = ::tns::detail::digits(len);
+
+  for(size_t i = d; i > 0; i--) {
+      out.bytes[pos + i - 1] = static_cast<char>('0' + len % 10);
+      len /= 10;
+  }
+  pos += d;
+  out.bytes[pos++] = ':';
+}
+
+template<size_t N>
+constexpr void put_bytes(fixed<N> &out, size_t &pos, const char *data,
+                         size_t len) noexcept
+{
+  for(size_t i = 0; i < len; i++) {
+      out.bytes[pos++] = data[i];
+  }
+}
+
+constexpr unsigned long long magnitude(long long val) noexcept
+{
+  return val < 0 ? 0ULL - static_cast<unsigned long long>(val)
+                 : static_cast<unsigned long long>(val);
+}
+
+template<tns_type_tag Tag, size_t... N>
+constexpr auto join(const fixed<N>&... items) noexcept
+{
+  constexpr size_t len = (0 + ... + N);
+  fixed<::tns::detail::framed_size(len)> out{};
+  size_t pos = 0;
+
+  put_frame(out, pos, len);
+  (put_bytes(out, pos, items.bytes, N), ...);
+  out.bytes[pos] = Tag;
+  return out;
+}
+
+}  // namespace detail
+
+
+//  A string, from a string literal.  The terminating null isn't included.
+template<size_t N>
+constexpr auto string(const char (&s)[N]) noexcept
+{
+  fixed<::tns::detail::framed_size(N - 1)> out{};
+  size_t pos = 0;
+
+  detail::put_frame(out, pos, N - 1);
+  detail::put_bytes(out, pos, s, N - 1);
+  out.bytes[pos] = tns_tag_string;
+  return out;
+}
+
+
+template<long long V>
+constexpr auto integer() noexcept
+{
+  constexpr unsigned long long mag = detail::magnitude(V);
+  constexpr size_t len = ::tns::detail::digits(mag) + (V < 0);
+  fixed<::tns::detail::framed_size(len)> out{};
+  unsigned long long n = mag;
+  size_t pos = 0;
+
+  detail::put_frame(out, pos, len);
+  for(size_t i = len; i > (V < 0); i--) {
+      out.bytes[pos + i - 1] = static_cast<char>('0' + n % 10);
+      n /= 10;
+  }
+  if(V < 0) {
+      out.bytes[pos] = '-';
+  }
+  out.bytes[pos + len] = tns_tag_integer;
+  return out;
+}
+
+
+template<bool V>
+constexpr auto boolean() noexcept
+{
+  if constexpr(V) {
+      return fixed<7>{{'4', ':', 't', 'r', 'u', 'e', '!'}};
+  } else {
+      return fixed<8>{{'5', ':', 'f', 'a', 'l', 's', 'e', '!'}};
+  }
+}
+
+
+constexpr fixed<3> null() noexcept
+{
+  return fixed<3>{{'0', ':', '~'}};
+}
+
+
+template<size_t... N>
+constexpr auto list(const fixed<N>&... items) noexcept
+{
+  return detail::join<tns_tag_list>(items...);
+}
+
+
+//  Keys and values alternate in the arguments.  Keys must be strings.
+template<size_t... N>
+constexpr auto dict(const fixed<N>&... items) noexcept
+{
+  static_assert(sizeof...(N) % 2 == 0, "dict needs a value for each key");
+  return detail::join<tns_tag_dict>(items...);
+}
+
+}  // namespace lit
+
+
+//  Parse a value off the front of a tnetstring into 'out'.
+//  Returns false if the data is not a valid tnetstring, or doesn't match
+//  the type of 'out'.  If 'remain' is non-NULL it will receive the
+//  unparsed remainder of the data.
+template<class T>
+bool loads(std::string_view data, T &out, std::string_view *remain = nullptr)
+{
+  tns_type_tag type;
+  std::string_view payload;
+
+  if(!split(data, type, payload)) {
+      return false;
+  }
+  if(!detail::decode_value(type, payload, out)) {
+      return false;
+  }
+  if(remain != nullptr) {
+      *remain = data;
+  }
+  return true;
+}
+
+
+//  Get the number of bytes needed to render a value as a tnetstring.
+template<class T>
+size_t dumps_size(const T &val)
+{
+  return detail::value_size(val);
+}
+
+
+//  Render a value as a tnetstring into a buffer, which must have room
+//  for at least dumps_size(val) bytes.  Returns the end of the output.
+template<class T>
+char *dumps_into(char *out, const T &val)
+{
+  detail::pointer_sink sink{out};
+  detail::write_value(sink, val);
+  return sink.out;
+}
+
+
+//  Render a value as a tnetstring.
+template<class T>
+std::string dumps(const T &val)
+{
+  std::string out(dumps_size(val), '\0');
+  dumps_into(&out[0], val);
+  return out;
+}
+
+
+#ifdef TNS_HAVE_SPAN
+
+//  Render a value into a buffer supplied by the caller, such as a slot in
+//  a ring buffer, without allocating anything.  Returns the size of the
+//  output.  If that's bigger than the buffer then nothing was written, and
+//  you can call again with a buffer of at least that size.
+template<class T>
+size_t dumps_into(std::span<char> out, const T &val)
+{
+  size_t size = dumps_size(val);
+
+  if(size <= out.size()) {
+      dumps_into(out.data(), val);
+  }
+  return size;
+}
+
+
+//  Render a value across a chain of buffers, filling each in turn before
+//  moving on to the next.  Returns the size of the output; if that's more
+//  than the buffers hold in total then nothing was written.
+template<class T>
+size_t dumps_into(std::span<const std::span<char>> chain, const T &val)
+{
+  size_t size = dumps_size(val);
+  size_t room = 0;
+
+  for(const std::span<char> &buf : chain) {
+      room += buf.size();
+  }
+  if(size <= room) {
+      detail::chain_sink sink{chain.data() + 1, chain[0].data(),
+                              chain[0].data() + chain[0].size()};
+      detail::write_value(sink, val);
+  }
+  return size;
+}
+
+#ifdef TNS_HAVE_IOVEC
+
+//  Render a value as a list of iovecs for writev() or sendmsg(), which
+//  refer to string payloads of at least 'min_ref' bytes in place rather
+//  than copying them.  Everything else is copied into 'scratch'.  The
+//  iovecs are appended to 'iov', and may point into both 'scratch' and
+//  'val', so both must stay alive and unchanged until they're sent.
+//
+//  Returns the number of bytes of scratch space needed.  If that's more
+//  than scratch.size() then 'iov' is left as it was, and you can call
+//  again with a scratch buffer of at least that size.
+template<class T>
+size_t dumps_iov(std::span<char> scratch, std::vector<struct iovec> &iov,
+                 const T &val, size_t min_ref = 4096)
+{
+  size_t count = iov.size();
+  detail::iovec_sink sink{&iov, scratch.data(),
+                          scratch.data() + scratch.size(), min_ref, 0};
+
+  detail::write_value(sink, val);
+  if(sink.needed > scratch.size()) {
+      iov.resize(count);
+  }
+  return sink.needed;
+}
+
+#endif  // TNS_HAVE_IOVEC
+
+#endif  // TNS_HAVE_SPAN
+
+
+//  A parser for data whose shape isn't known up front.  This is the same
+//  parse loop as tns_parse, but instead of calling through the function
+//  pointers of a tns_ops struct it calls the handlers of the derived class
+//  directly, so the compiler can inline them into the loop:
+//
+//    struct builder : tns::parser<builder, my_value> {
+//      bool parse_string(std::string_view payload, my_value &out);
+//      bool parse_integer(std::string_view payload, my_value &out);
+//      bool parse_float(std::string_view payload, my_value &out);
+//      bool get_null(my_value &out);
+//      bool get_true(my_value &out);
+//      bool get_false(my_value &out);
+//      bool new_list(my_value &out);
+//      bool add_to_list(my_value &list, my_value &&item);
+//      bool new_dict(my_value &out);
+//      bool add_to_dict(my_value &dict, my_value &&key, my_value &&item);
+//    };
+//
+//    builder b;
+//    my_value val;
+//    if(!b.parse(data, val)) { ... }
+//
+//  Each handler stores its result in 'out' and returns false to abort the
+//  parse.  The builder may also define new_list_sized(out, size) and
+//  new_dict_sized(out, size), which are then called instead of new_list
+//  and new_dict with the number of items, found by a pre-scan of their
+//  length prefixes.  Items are default-constructed before parsing and
+//  cleaned up by their destructors, so there's no free_value.
+template<class Derived, class Value>
+class parser {
+public:
+  //  Parse a value off the front of 'data' into 'out'.  Returns false if
+  //  it's not a valid tnetstring or a handler failed.  If 'remain' is
+  //  non-NULL it will receive the unparsed remainder of the data.
+  bool parse(std::string_view data, Value &out,
+             std::string_view *remain = nullptr)
+  {
+    tns_type_tag type;
+    std::string_view payload;
+
+    if(!split(data, type, payload)) {
+        return false;
+    }
+    if(!parse_payload(type, payload, out)) {
+        return false;
+    }
+    if(remain != nullptr) {
+        *remain = data;
+    }
+    return true;
+  }
+
+  //  Parse a payload whose length prefix and type tag were read already.
+  bool parse_payload(tns_type_tag type, std::string_view payload,
+                     Value &out)
+  {
+    Derived &self = static_cast<Derived&>(*this);
+
+    switch(type) {
+      case tns_tag_string:
+        return self.parse_string(payload, out);
+      case tns_tag_integer:
+        return self.parse_integer(payload, out);
+      case tns_tag_float:
+        return self.parse_float(payload, out);
+      //  The only acceptable values are "true" and "false".
+      case tns_tag_bool:
+        if(payload == "true") {
+            return self.get_true(out);
+        }
+        if(payload == "false") {
+            return self.get_false(out);
+        }
+        return false;
+      //  This must be a zero-length string.
+      case tns_tag_null:
+        return payload.empty() && self.get_null(out);
+      case tns_tag_dict:
+        return parse_dict(payload, out);
+      case tns_tag_list:
+        return parse_list(payload, out);
+      default:
+        return false;
+    }
+  }
+
+private:
+  bool parse_list(std::string_view payload, Value &out)
+  {
+    Derived &self = static_cast<Derived&>(*this);
+    tns_type_tag type;
+    std::string_view data;
+
+    if constexpr(detail::has_new_list_sized<Derived, Value>::value) {
+        if(!self.new_list_sized(out, detail::count_items(payload))) {
+            return false;
+        }
+    } else {
+        if(!self.new_list(out)) {
+            return false;
+        }
+    }
+    //  The data is written <item><item><item>
+    while(!payload.empty()) {
+        Value item{};
+        if(!split(payload, type, data) || !parse_payload(type, data, item)) {
+            return false;
+        }
+        if(!self.add_to_list(out, std::move(item))) {
+            return false;
+        }
+    }
+    return true;
+  }
+
+  bool parse_dict(std::string_view payload, Value &out)
+  {
+    Derived &self = static_cast<Derived&>(*this);
+    tns_type_tag type;
+    std::string_view data;
+
+    if constexpr(detail::has_new_dict_sized<Derived, Value>::value) {
+        if(!self.new_dict_sized(out, detail::count_items(payload) / 2)) {
+            return false;
+        }
+    } else {
+        if(!self.new_dict(out)) {
+            return false;
+        }
+    }
+    //  The data is written <key><value><key><value>
+    while(!payload.empty()) {
+        Value key{};
+        Value item{};
+        if(!split(payload, type, data) || !parse_payload(type, data, key)) {
+            return false;
+        }
+        if(!split(payload, type, data) || !parse_payload(type, data, item)) {
+            return false;
+        }
+        if(!self.add_to_dict(out, std::move(key), std::move(item))) {
+            return false;
+        }
+    }
+    return true;
+  }
+};
+
+
+//  A position within a tnetstring held in memory, which moves between
+//  values by hopping over their length prefixes.  This wraps tns_cursor
+//  from tns_dom.h; it's for navigating documents far too big to parse,
+//  such as a tns::mapped_file.  Like tns::node, a cursor that failed to
+//  find its value converts to false, and further lookups on it fail too:
+//
+//    tns::mapped_file f("snapshot.tns");
+//    tns::cursor root(f.view());
+//    int64_t port;
+//    if(!root["services"]["web"]["port"].get(port)) { ... }
+//
+class cursor {
+public:
+  cursor() noexcept : ok_(false), c_() {}
+
+  explicit cursor(std::string_view data) noexcept : ok_(false), c_()
+  {
+    ok_ = tns_cursor_init(&c_, data.data(), data.size()) == 0;
+  }
+
+  explicit operator bool() const noexcept { return ok_; }
+
+  tns_type_tag type() const noexcept
+  {
+    return static_cast<tns_type_tag>(c_.type);
+  }
+
+  //  The raw payload of the value.  For a container this covers all of
+  //  its items, without them having been looked at.
+  std::string_view payload() const noexcept
+  {
+    return std::string_view(c_.data, c_.len);
+  }
+
+  //  The whole of the value, including its length prefix and type tag.
+  raw encoded() const noexcept
+  {
+    size_t prefix = detail::digits(c_.len) + 1;
+    return raw{std::string_view(c_.data - prefix, prefix + c_.len + 1)};
+  }
+
+  //  Look up an item of a list by index, or of a dict by key.
+  cursor operator[](size_t index) const noexcept
+  {
+    cursor item;
+    item.ok_ = ok_ && tns_cursor_index(&c_, index, &item.c_) == 0;
+    return item;
+  }
+
+  cursor operator[](std::string_view key) const noexcept
+  {
+    cursor value;
+    value.ok_ = ok_ && tns_cursor_key(&c_, key.data(), key.size(),
+                                      &value.c_) == 0;
+    return value;
+  }
+
+  //  Decode the value into any type supported by tns::loads.  Decoding a
+  //  container reads all of it, so only do that for small subtrees.
+  template<class T>
+  bool get(T &out) const
+  {
+    return ok_ && detail::decode_value(type(), payload(), out);
+  }
+
+  //  Iterate over the items of a list, or the keys and values of a dict
+  //  in alternation.  Iteration stops early if an item is malformed.
+  class iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = cursor;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = cursor;
+
+    iterator() noexcept : parent_(nullptr), ok_(false), c_() {}
+    iterator(const tns_cursor *parent, bool ok, const tns_cursor &c) noexcept
+      : parent_(parent), ok_(ok), c_(c) {}
+
+    cursor operator*() const noexcept { return cursor(c_); }
+    iterator &operator++() noexcept
+    {
+      ok_ = tns_cursor_next(parent_, &c_) == 0;
+      return *this;
+    }
+    iterator operator++(int) noexcept { iterator i = *this; ++*this; return i; }
+    bool operator==(const iterator &o) const noexcept
+    {
+      return ok_ == o.ok_ && (!ok_ || c_.data == o.c_.data);
+    }
+    bool operator!=(const iterator &o) const noexcept { return !(*this == o); }
+
+  private:
+    const tns_cursor *parent_;
+    bool ok_;
+    tns_cursor c_;
+  };
+
+  iterator begin() const noexcept
+  {
+    tns_cursor item = tns_cursor();
+    bool ok = ok_ && tns_cursor_first(&c_, &item) == 0;
+    return iterator(&c_, ok, item);
+  }
+  iterator end() const noexcept { return iterator(&c_, false, tns_cursor()); }
+
+  const tns_cursor *raw_cursor() const noexcept { return &c_; }
+
+private:
+  explicit cursor(const tns_cursor &c) noexcept : ok_(true), c_(c) {}
+
+  bool ok_;
+  tns_cursor c_;
+};
+
+
+#ifdef TNS_HAVE_MMAP
+
+//  A file mapped read-only into memory, for use with tns::cursor.
+//  Check it with operator bool; if mapping failed, errno says why.
+class mapped_file {
+public:
+  explicit mapped_file(const char *path) noexcept
+    : ok_(tns_map_file(&map_, path) == 0) {}
+
+  ~mapped_file() { tns_unmap_file(&map_); }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  explicit operator bool() const noexcept { return ok_; }
+
+  std::string_view view() const noexcept
+  {
+    return std::string_view(map_.data, map_.len);
+  }
+
+private:
+  bool ok_;
+  tns_mapping map_;
+};
+
+#endif  // TNS_HAVE_MMAP
+
+
+#ifdef TNS_HAVE_PMR
+
+//  A single value in a tns::document.  This is a cheap handle that can be
+//  passed by value; it's only valid as long as the document is.  A null
+//  node (as returned for missing items) converts to false.
+class node {
+public:
+  node() noexcept : n_(nullptr) {}
+  explicit node(const tns_node *n) noexcept : n_(n) {}
+
+  explicit operator bool() const noexcept { return n_ != nullptr; }
+
+  tns_type_tag type() const noexcept
+  {
+    return static_cast<tns_type_tag>(n_->type);
+  }
+
+  //  The raw payload of the value, pointing into the parsed data.
+  std::string_view payload() const noexcept
+  {
+    return std::string_view(n_->data, n_->len);
+  }
+
+  //  The number of items in a list, or of key/value pairs in a dict.
+  size_t size() const noexcept
+  {
+    return n_->type == tns_tag_dict ? n_->count / 2 : n_->count;
+  }
+
+  //  Look up an item of a list by index, or of a dict by key.
+  //  Both are linear in the number of items.
+  node operator[](size_t index) const noexcept
+  {
+    return node(n_ != nullptr ? tns_dom_list_get(n_, index) : nullptr);
+  }
+
+  node operator[](std::string_view key) const noexcept
+  {
+    if(n_ == nullptr) {
+        return node();
+    }
+    return node(tns_dom_dict_get(n_, key.data(), key.size()));
+  }
+
+  //  Decode the value into any type supported by tns::loads.
+  template<class T>
+  bool get(T &out) const
+  {
+    return n_ != nullptr && detail::decode_value(type(), payload(), out);
+  }
+
+  //  Iterate over the items of a list, or the keys and values of a dict
+  //  in alternation.
+  class iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = node;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = node;
+
+    iterator() noexcept : n_(nullptr) {}
+    explicit iterator(const tns_node *n) noexcept : n_(n) {}
+
+    node operator*() const noexcept { return node(n_); }
+    iterator &operator++() noexcept { n_ += n_->size; return *this; }
+    iterator operator++(int) noexcept { iterator i = *this; ++*this; return i; }
+    bool operator==(const iterator &o) const noexcept { return n_ == o.n_; }
+    bool operator!=(const iterator &o) const noexcept { return n_ != o.n_; }
+
+  private:
+    const tns_node *n_;
+  };
+
+  iterator begin() const noexcept { return iterator(n_ + 1); }
+  iterator end() const noexcept { return iterator(n_ + n_->size); }
+
+  const tns_node *raw() const noexcept { return n_; }
+
+private:
+  const tns_node *n_;
+};
+
+
+class parallel_parser;
+
+
+//  A parsed tnetstring, with its nodes allocated from a memory resource.
+//  With a std::pmr::monotonic_buffer_resource per request, all the
+//  documents parsed while handling it are freed by a single release().
+//  The nodes point into the parsed data, which must outlive the document.
+class document {
+public:
+  explicit document(std::pmr::memory_resource *mr =
+                        std::pmr::get_default_resource()) noexcept
+    : mr_(mr), nodes_(nullptr), capacity_(0), dom_{nullptr, 0, nullptr} {}
+
+  ~document() { clear(); }
+
+  document(const document &) = delete;
+  document &operator=(const document &) = delete;
+
+  document(document &&o) noexcept
+    : mr_(o.mr_), nodes_(o.nodes_), capacity_(o.capacity_), dom_(o.dom_)
+  {
+    o.nodes_ = nullptr;
+    o.capacity_ = 0;
+    o.dom_ = tns_dom{nullptr, 0, nullptr};
+  }
+
+  //  Parse a value off the front of 'data', replacing any previous one.
+  //  Returns false if it's not a valid tnetstring; error() says why.
+  //  Space is allocated for the largest number of nodes that could fit
+  //  in the value, since a monotonic resource couldn't reuse it anyway;
+  //  any data after the value doesn't count.
+  bool parse(std::string_view data, std::string_view *remain = nullptr)
+  {
+    char *rest = nullptr;
+    size_t capacity = tns_dom_value_max_nodes(data.data(), data.size());
+
+    if(capacity > capacity_) {
+        clear();
+        nodes_ = static_cast<tns_node*>(
+            mr_->allocate(capacity * sizeof(tns_node), alignof(tns_node)));
+        capacity_ = capacity;
+    }
+    if(tns_dom_parse_into(&dom_, nodes_, capacity_, data.data(), data.size(),
+                          &rest) == -1) {
+        return false;
+    }
+    if(remain != nullptr) {
+        *remain = data.substr(rest - data.data());
+    }
+    return true;
+  }
+
+  //  Give the node memory back to the resource.
+  void clear() noexcept
+  {
+    if(nodes_ != nullptr) {
+        mr_->deallocate(nodes_, capacity_ * sizeof(tns_node),
+                        alignof(tns_node));
+    }
+    nodes_ = nullptr;
+    capacity_ = 0;
+    dom_ = tns_dom{nullptr, 0, nullptr};
+  }
+
+  node root() const noexcept
+  {
+    return node(dom_.count > 0 ? dom_.nodes : nullptr);
+  }
+
+  size_t node_count() const noexcept { return dom_.count; }
+  const char *error() const noexcept { return dom_.error; }
+  std::pmr::memory_resource *resource() const noexcept { return mr_; }
+
+private:
+  //  See tns_parallel.hpp, which fills in the nodes from several threads.
+  friend class parallel_parser;
+
+  std::pmr::memory_resource *mr_;
+  tns_node *nodes_;
+  size_t capacity_;
+  tns_dom dom_;
+};
+
+#endif  // TNS_HAVE_PMR
+
+
+}  // namespace tns
+
+
+//  Declare the fields of a struct for mapping to and from a tnetstring
+//  dict, using the member names as keys.  Use this at namespace scope,
+//  in the same namespace as the struct.  For up to 24 fields; for more,
+//  or to use different key names, define tns_fields() yourself:
+//
+//    inline constexpr auto tns_fields(const user*) {
+//      return std::make_tuple(tns::make_field("user-name", &user::name));
+//    }
+//
+#define TNS_FIELDS(S, ...) \
+  inline constexpr auto tns_fields(const S*) { \
+    return std::make_tuple(TNS_PP_MAP(TNS_PP_FIELD, S, __VA_ARGS__)); \
+  }
+
+#define TNS_PP_FIELD(S, m) ::tns::make_field(#m, &S::m)
+
+#define TNS_PP_CAT(a, b) TNS_PP_CAT_(a, b)
+#define TNS_PP_CAT_(a, b) a##b
+#define TNS_PP_NARGS(...) \
+  TNS_PP_NARGS_(__VA_ARGS__, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, \
+                13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1)
+#define TNS_PP_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, \
+                      _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, \
+                      _23, _24, N, ...) N
+#define TNS_PP_MAP(f, S, ...) \
+  TNS_PP_CAT(TNS_PP_MAP_, TNS_PP_NARGS(__VA_ARGS__))(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_1(f, S, x) f(S, x)
+#define TNS_PP_MAP_2(f, S, x, ...) f(S, x), TNS_PP_MAP_1(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_3(f, S, x, ...) f(S, x), TNS_PP_MAP_2(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_4(f, S, x, ...) f(S, x), TNS_PP_MAP_3(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_5(f, S, x, ...) f(S, x), TNS_PP_MAP_4(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_6(f, S, x, ...) f(S, x), TNS_PP_MAP_5(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_7(f, S, x, ...) f(S, x), TNS_PP_MAP_6(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_8(f, S, x, ...) f(S, x), TNS_PP_MAP_7(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_9(f, S, x, ...) f(S, x), TNS_PP_MAP_8(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_10(f, S, x, ...) f(S, x), TNS_PP_MAP_9(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_11(f, S, x, ...) f(S, x), TNS_PP_MAP_10(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_12(f, S, x, ...) f(S, x), TNS_PP_MAP_11(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_13(f, S, x, ...) f(S, x), TNS_PP_MAP_12(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_14(f, S, x, ...) f(S, x), TNS_PP_MAP_13(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_15(f, S, x, ...) f(S, x), TNS_PP_MAP_14(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_16(f, S, x, ...) f(S, x), TNS_PP_MAP_15(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_17(f, S, x, ...) f(S, x), TNS_PP_MAP_16(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_18(f, S, x, ...) f(S, x), TNS_PP_MAP_17(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_19(f, S, x, ...) f(S, x), TNS_PP_MAP_18(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_20(f, S, x, ...) f(S, x), TNS_PP_MAP_19(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_21(f, S, x, ...) f(S, x), TNS_PP_MAP_20(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_22(f, S, x, ...) f(S, x), TNS_PP_MAP_21(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_23(f, S, x, ...) f(S, x), TNS_PP_MAP_22(f, S, __VA_ARGS__)
+#define TNS_PP_MAP_24(f, S, x, ...) f(S, x), TNS_PP_MAP_23(f, S, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,293 @@
+//
+//  tns_core_tmpl.h:  the parse and render loops of the tnetstring core
+//
+//  This file is included by tns_core.c to build the standard functions,
+//  which call every op through the function pointers in the tns_ops struct.
+//  You can include it again to build a copy of the loops specialized for
+//  one particular set of ops, with each callback bound at compile time so
+//  the compiler can inline the small ones.  Define these macros first:
+//
+//    TNS_FUNC(name)         the name of each generated function, e.g.
+//                           "myops_##name" gives myops_parse etc.
+//    TNS_OP(ops, name)      the callback for op 'name', e.g. "myops_##name"
+//                           to call the myops_parse_string function etc.
+//    TNS_HAS_OP(ops, name)  whether an optional op is provided, e.g. "1"
+//    TNS_SCOPE              the linkage of the generated functions
+//
+//  All four are undefined again at the end of this file.  The generated
+//  functions behave exactly like tns_parse, tns_parse_payload and
+//  tns_render_value, and still pass 'ops' through to each callback.
+//  Container callbacks that render their items must call the specialized
+//  render_value function themselves to stay on the fast path.
+//
+//  There's no include guard, since it's meant to be included repeatedly.
+//
+
+TNS_SCOPE void* TNS_FUNC(parse_payload)(const tns_ops *ops, tns_type_tag type,
+                                        const char *data, size_t len);
+static int TNS_FUNC(parse_dict)(const tns_ops *ops, void *dict,
+                                const char *data, size_t len);
+static int TNS_FUNC(parse_list)(const tns_ops *ops, void *list,
+                                const char *data, size_t len);
+
+
+TNS_SCOPE void*
+TNS_FUNC(parse)(const tns_ops *ops, const char *data, size_t len,
+                char **remain)
+{
+  char *valstr = NULL;
+  char *rest = NULL;
+  tns_type_tag type = tns_tag_null;
+  size_t vallen = 0;
+
+  check(tns_split_value(data, len, &type, &valstr, &vallen, &rest) != -1,
+        "Not a tnetstring: invalid length prefix.");
+
+  //  Output the remainder of the string if necessary.
+  if(remain != NULL) {
+      *remain = rest;
+  }
+
+  //  Now dispatch type parsing based on the type tag.
+  return TNS_FUNC(parse_payload)(ops, type, valstr, vallen);
+
+error:
+  return NULL;
+}
+
+
+//  This appears to be faster than using strncmp to compare
+//  against a small string constant.  Ugly but fast.
+#define STR_EQ_TRUE(s) (s[0]=='t' && s[1]=='r' && s[2]=='u' && s[3]=='e')
+#define STR_EQ_FALSE(s) (s[0]=='f' && s[1]=='a' && s[2]=='l' \
+                                   && s[3]=='s' && s[4] == 'e')
+
+TNS_SCOPE void*
+TNS_FUNC(parse_payload)(const tns_ops *ops, tns_type_tag type,
+                        const char *data, size_t len)
+{
+  void *val = NULL;
+
+  assert(ops != NULL && "ops struct cannot be NULL");
+
+  switch(type) {
+    //  Primitive type: a string blob.
+    case tns_tag_string:
+        val = TNS_OP(ops, parse_string)(ops, data, len);
+        check(val != NULL, "Not a tnetstring: invalid string literal.");
+        TNS_STAT_INC(parsed_string);
+        break;
+    //  Primitive type: an integer.
+    case tns_tag_integer:
+        val = TNS_OP(ops, parse_integer)(ops, data, len);
+        check(val != NULL, "Not a tnetstring: invalid integer literal.");
+        TNS_STAT_INC(parsed_integer);
+        break;
+    //  Primitive type: a float.
+    case tns_tag_float:
+        val = TNS_OP(ops, parse_float)(ops, data, len);
+        check(val != NULL, "Not a tnetstring: invalid float literal.");
+        TNS_STAT_INC(parsed_float);
+        break;
+    //  Primitive type: a boolean.
+    //  The only acceptable values are "true" and "false".
+    case tns_tag_bool:
+        if(len == 4 && STR_EQ_TRUE(data)) {
+            val = TNS_OP(ops, get_true)(ops);
+        } else if(len == 5 && STR_EQ_FALSE(data)) {
+            val = TNS_OP(ops, get_false)(ops);
+        } else {
+            sentinel("Not a tnetstring: invalid boolean literal.");
+            val = NULL;
+        }
+        TNS_STAT_INC(parsed_bool);
+        break;
+    //  Primitive type: a null.
+    //  This must be a zero-length string.
+    case tns_tag_null:
+        check(len == 0, "Not a tnetstring: invalid null literal.");
+        val = TNS_OP(ops, get_null)(ops);
+        TNS_STAT_INC(parsed_null);
+        break;
+    //  Compound type: a dict.
+    //  The data is written <key><value><key><value>
+    case tns_tag_dict:
+        if(TNS_HAS_OP(ops, new_dict_sized)) {
+            val = TNS_OP(ops, new_dict_sized)(ops, tns_count_items(data, len) / 2);
+        } else {
+            val = TNS_OP(ops, new_dict)(ops);
+        }
+        check(val != NULL, "Could not create dict.");
+        check(TNS_FUNC(parse_dict)(ops, val, data, len) != -1,
+              "Not a tnetstring: broken dict items.");
+        TNS_STAT_INC(parsed_dict);
+        break;
+    //  Compound type: a list.
+    //  The data is written <item><item><item>
+    case tns_tag_list:
+        if(TNS_HAS_OP(ops, new_list_sized)) {
+            val = TNS_OP(ops, new_list_sized)(ops, tns_count_items(data, len));
+        } else {
+            val = TNS_OP(ops, new_list)(ops);
+        }
+        check(val != NULL, "Could not create list.");
+        check(TNS_FUNC(parse_list)(ops, val, data, len) != -1,
+              "Not a tnetstring: broken list items.");
+        TNS_STAT_INC(parsed_list);
+        break;
+    //  Whoops, that ain't a tnetstring.
+    default:
+        sentinel("Not a tnetstring: invalid type tag.");
+  }
+
+  return val;
+
+error:
+  TNS_STAT_PARSE_ERROR(type);
+  if(val != NULL) {
+      TNS_OP(ops, free_value)(ops, val);
+  }
+  return NULL;
+}
+
+
+#undef STR_EQ_TRUE
+#undef STR_EQ_FALSE
+
+
+TNS_SCOPE int
+TNS_FUNC(render_value)(const tns_ops *ops, void *val, tns_outbuf *outbuf)
+{
+  tns_type_tag type = tns_tag_null;
+  int res = -1;
+  size_t orig_size = 0;
+
+  assert(ops != NULL && "ops struct cannot be NULL");
+
+  //  Find out the type tag for the given value.
+  type = TNS_OP(ops, get_type)(ops, val);
+  if(type == 0) {
+      TNS_STAT_INC(err_unserializable);
+  }
+  check(type != 0, "type not serializable.");
+
+  tns_outbuf_putc(outbuf, type);
+  orig_size = tns_outbuf_size(outbuf);
+
+  //  Render it into the output buffer using callbacks.
+  switch(type) {
+    case tns_tag_string:
+      res = TNS_OP(ops, render_string)(ops, val, outbuf);
+      break;
+    case tns_tag_integer:
+      res = TNS_OP(ops, render_integer)(ops, val, outbuf);
+      break;
+    case tns_tag_float:
+      res = TNS_OP(ops, render_float)(ops, val, outbuf);
+      break;
+    case tns_tag_bool:
+      res = TNS_OP(ops, render_bool)(ops, val, outbuf);
+      break;
+    case tns_tag_null:
+      res = 0;
+      break;
+    case tns_tag_dict:
+      res = TNS_OP(ops, render_dict)(ops, val, outbuf);
+      break;
+    case tns_tag_list:
+      res = TNS_OP(ops, render_list)(ops, val, outbuf);
+      break;
+    default:
+      sentinel("unknown type tag: '%c'.", type);
+  }
+
+  if(res != 0 && type != tns_tag_dict && type != tns_tag_list) {
+      TNS_STAT_INC(err_render);
+  }
+  check(res == 0, "Failed to render value of type '%c'.", type);
+  return tns_outbuf_clamp(outbuf, orig_size);
+
+error:
+  return -1;
+}
+
+
+static int
+TNS_FUNC(parse_list)(const tns_ops *ops, void *val,
+                     const char *data, size_t len)
+{
+  void *item = NULL;
+  char *remain = NULL;
+  int res;
+
+  assert(val != NULL && "value cannot be NULL");
+  assert(data != NULL && "data cannot be NULL");
+
+  while(len > 0) {
+      item = TNS_FUNC(parse)(ops, data, len, &remain);
+      check(item != NULL, "Failed to parse list.");
+      len = len - (remain - data);
+      data = remain;
+      //  The item belongs to the list now, even if adding it failed.
+      res = TNS_OP(ops, add_to_list)(ops, val, item);
+      item = NULL;
+      check(res != -1, "Failed to add item to list.");
+  }
+
+  return 0;
+
+error:
+  if(item) {
+      TNS_OP(ops, free_value)(ops, item);
+  }
+  return -1;
+}
+
+
+static int
+TNS_FUNC(parse_dict)(const tns_ops *ops, void *val,
+                     const char *data, size_t len)
+{
+  void *key = NULL;
+  void *item = NULL;
+  char *remain = NULL;
+  int res;
+
+  assert(val != NULL && "value cannot be NULL");
+  assert(data != NULL && "data cannot be NULL");
+
+  while(len > 0) {
+      key = TNS_FUNC(parse)(ops, data, len, &remain);
+      check(key != NULL, "Failed to parse dict key from tnetstring.");
+      len = len - (remain - data);
+      data = remain;
+
+      item = TNS_FUNC(parse)(ops, data, len, &remain);
+      check(item != NULL, "Failed to parse dict item from tnetstring.");
+      len = len - (remain - data);
+      data = remain;
+
+      //  The key and item belong to the dict now, even if adding failed.
+      res = TNS_OP(ops, add_to_dict)(ops, val, key, item);
+      key = NULL;
+      item = NULL;
+      check(res != -1, "Failed to add element to dict.");
+  }
+
+  return 0;
+
+error:
+  if(key) {
+      TNS_OP(ops, free_value)(ops, key);
+  }
+  if(item) {
+      TNS_OP(ops, free_value)(ops, item);
+  }
+  return -1;
+}
+
+
+#undef TNS_FUNC
+#undef TNS_OP
+#undef TNS_HAS_OP
+#undef TNS_SCOPE
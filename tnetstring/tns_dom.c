@@ -0,0 +1,604 @@
+//
+//  tns_dom.c:  compact document model for tnetstrings
+//
+//  See tns_dom.h for the details.  This file doesn't use the python-flavoured
+//  checking macros from dbg.h, since it must be usable without python and
+//  without holding the GIL; errors are reported through dom->error instead.
+//
+
+//  We need posix_madvise from POSIX.1-2001 for tns_map_file.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "tns_dom.h"
+
+#ifdef TNS_HAVE_MMAP
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifndef TNS_MAX_LENGTH
+#define TNS_MAX_LENGTH 999999999
+#endif
+
+//  Cursors accept any length that can't overflow a size_t.
+#define TNS_CURSOR_MAX_LENGTH (((size_t)-1 - 9) / 10)
+
+//  Arena allocations are aligned to this many bytes.
+#define TNS_ARENA_ALIGN 16
+
+//  State shared by the recursive calls of the parser.
+struct tns_dom_parser_s {
+  tns_node *nodes;
+  size_t count;
+  size_t capacity;
+  const char *error;
+};
+typedef struct tns_dom_parser_s tns_dom_parser;
+
+
+//  Helper function to split a tnetstring into type tag and payload.
+//  This is tns_split_value from tns_core.c, minus the python error handling,
+//  and with the maximum length as a parameter.
+static int tns_dom_split(const char *data, size_t len, size_t max,
+                         char *type, const char **payload, size_t *paylen,
+                         const char **remain);
+
+//  Helper function to parse a single value and all of its children.
+static int tns_dom_parse_value(tns_dom_parser *parser, const char *data,
+                               size_t len, const char **remain);
+
+
+int tns_arena_init(tns_arena *arena, size_t size)
+{
+  arena->buffer = malloc(size > 0 ? size : 1);
+  arena->size = arena->buffer != NULL ? size : 0;
+  arena->used = 0;
+  arena->owned = 1;
+  return arena->buffer != NULL ? 0 : -1;
+}
+
+
+void tns_arena_init_static(tns_arena *arena, void *buffer, size_t size)
+{
+  arena->buffer = buffer;
+  arena->size = size;
+  arena->used = 0;
+  arena->owned = 0;
+}
+
+
+void* tns_arena_alloc(tns_arena *arena, size_t size)
+{
+  size_t start = (arena->used + TNS_ARENA_ALIGN - 1) & ~(TNS_ARENA_ALIGN - 1);
+
+  if(start > arena->size || size > arena->size - start) {
+      return NULL;
+  }
+  arena->used = start + size;
+  return arena->buffer + start;
+}
+
+
+void tns_arena_reset(tns_arena *arena)
+{
+  arena->used = 0;
+}
+
+
+void tns_arena_free(tns_arena *arena)
+{
+  if(arena->owned) {
+      free(arena->buffer);
+  }
+  arena->buffer = NULL;
+  arena->size = 0;
+  arena->used = 0;
+}
+
+
+size_t tns_dom_max_nodes(size_t len)
+{
+  return len / 3 + 1;
+}
+
+
+size_t tns_dom_value_max_nodes(const char *data, size_t len)
+{
+  const char *payload = NULL;
+  const char *rest = data;
+  size_t paylen = 0;
+  char type;
+
+  //  If there's no valid length prefix then parsing fails before it
+  //  needs any nodes, but we still say one for the sake of allocators.
+  if(tns_dom_split(data, len, TNS_MAX_LENGTH, &type, &payload, &paylen,
+                   &rest) == -1) {
+      return 1;
+  }
+  return tns_dom_max_nodes(rest - data);
+}
+
+
+int tns_dom_parse_into(tns_dom *dom, tns_node *nodes, size_t capacity,
+                       const char *data, size_t len, char **remain)
+{
+  tns_dom_parser parser;
+  const char *rest = NULL;
+
+  parser.nodes = nodes;
+  parser.count = 0;
+  parser.capacity = capacity;
+  parser.error = NULL;
+
+  dom->nodes = nodes;
+  dom->count = 0;
+  dom->error = NULL;
+
+  if(tns_dom_parse_value(&parser, data, len, &rest) == -1) {
+      dom->error = parser.error;
+      return -1;
+  }
+
+  dom->count = parser.count;
+  if(remain != NULL) {
+      *remain = (char*) rest;
+  }
+  return 0;
+}
+
+
+int tns_dom_parse(tns_dom *dom, tns_arena *arena,
+                  const char *data, size_t len, char **remain)
+{
+  size_t capacity = tns_dom_value_max_nodes(data, len);
+  size_t start = 0;
+  tns_node *nodes = NULL;
+
+  dom->nodes = NULL;
+  dom->count = 0;
+
+  if(arena->buffer == NULL) {
+      if(tns_arena_init(arena, capacity * sizeof(tns_node)) == -1) {
+          dom->error = "Out of memory.";
+          return -1;
+      }
+  }
+
+  //  Take whatever room is left in the arena, up to the most we could
+  //  need, then hand back the unused part once we know the real count.
+  start = arena->used;
+  nodes = tns_arena_alloc(arena, 0);
+  if(nodes == NULL) {
+      dom->error = "Not enough room in arena.";
+      return -1;
+  }
+  if(capacity > (arena->size - arena->used) / sizeof(tns_node)) {
+      capacity = (arena->size - arena->used) / sizeof(tns_node);
+  }
+
+  if(tns_dom_parse_into(dom, nodes, capacity, data, len, remain) == -1) {
+      arena->used = start;
+      return -1;
+  }
+  arena->used = (char*)(nodes + dom->count) - arena->buffer;
+  return 0;
+}
+
+
+static int tns_dom_split(const char *data, size_t len, size_t max,
+                         char *type, const char **payload, size_t *paylen,
+                         const char **remain)
+{
+  const char *pos = data;
+  const char *eod = data + len;
+  size_t value = 0;
+
+  //  The netstring spec explicitly forbids padding zeros.
+  //  So if it's a zero, it must be the only char in the length.
+  if(pos == eod) {
+      return -1;
+  }
+  if(*pos == '0') {
+      pos++;
+  } else if(*pos >= '1' && *pos <= '9') {
+      while(pos < eod && *pos >= '0' && *pos <= '9') {
+          value = (value * 10) + (*pos - '0');
+          if(value > max) {
+              return -1;
+          }
+          pos++;
+      }
+  } else {
+      return -1;
+  }
+  if(pos == eod || *pos != ':') {
+      return -1;
+  }
+  pos++;
+  if(value >= (size_t)(eod - pos)) {
+      return -1;
+  }
+
+  *type = pos[value];
+  *payload = pos;
+  *paylen = value;
+  *remain = pos + value + 1;
+  return 0;
+}
+
+
+static int tns_dom_parse_value(tns_dom_parser *parser, const char *data,
+                               size_t len, const char **remain)
+{
+  const char *valstr = NULL;
+  const char *pos, *eod;
+  size_t vallen = 0;
+  size_t index = 0;
+  size_t count = 0;
+  tns_node *node = NULL;
+  char type;
+
+  if(tns_dom_split(data, len, TNS_MAX_LENGTH, &type, &valstr, &vallen,
+                   remain) == -1) {
+      parser->error = "Not a tnetstring: invalid length prefix.";
+      return -1;
+  }
+  if(parser->count == parser->capacity) {
+      parser->error = "Not enough room for document nodes.";
+      return -1;
+  }
+
+  index = parser->count++;
+  node = &parser->nodes[index];
+  node->type = type;
+  node->data = valstr;
+  node->len = (uint32_t)vallen;
+  node->count = 0;
+
+  switch(type) {
+    //  Numbers are validated when they're decoded, not here.
+    case tns_tag_string:
+    case tns_tag_integer:
+    case tns_tag_float:
+        break;
+    case tns_tag_bool:
+        if(!(vallen == 4 && memcmp(valstr, "true", 4) == 0) &&
+           !(vallen == 5 && memcmp(valstr, "false", 5) == 0)) {
+            parser->error = "Not a tnetstring: invalid boolean literal.";
+            return -1;
+        }
+        break;
+    case tns_tag_null:
+        if(vallen != 0) {
+            parser->error = "Not a tnetstring: invalid null literal.";
+            return -1;
+        }
+        break;
+    case tns_tag_dict:
+    case tns_tag_list:
+        pos = valstr;
+        eod = valstr + vallen;
+        while(pos < eod) {
+            if(tns_dom_parse_value(parser, pos, eod - pos, &pos) == -1) {
+                return -1;
+            }
+            count++;
+        }
+        if(type == tns_tag_dict && count % 2 != 0) {
+            parser->error = "Not a tnetstring: broken dict items.";
+            return -1;
+        }
+        node->count = (uint32_t)count;
+        break;
+    default:
+        parser->error = "Not a tnetstring: invalid type tag.";
+        return -1;
+  }
+
+  node->size = (uint32_t)(parser->count - index);
+  return 0;
+}
+
+
+const tns_node* tns_dom_first_child(const tns_node *node)
+{
+  return node->count > 0 ? node + 1 : NULL;
+}
+
+
+const tns_node* tns_dom_next_sibling(const tns_node *parent,
+                                     const tns_node *node)
+{
+  const tns_node *next = node + node->size;
+
+  return next < parent + parent->size ? next : NULL;
+}
+
+
+const tns_node* tns_dom_list_get(const tns_node *list, size_t index)
+{
+  const tns_node *item = list + 1;
+
+  if(list->type != tns_tag_list || index >= list->count) {
+      return NULL;
+  }
+  while(index-- > 0) {
+      item += item->size;
+  }
+  return item;
+}
+
+
+const tns_node* tns_dom_dict_get(const tns_node *dict,
+                                 const char *key, size_t len)
+{
+  const tns_node *k = dict + 1;
+  const tns_node *end = dict + dict->size;
+  const tns_node *v = NULL;
+
+  if(dict->type != tns_tag_dict) {
+      return NULL;
+  }
+  while(k < end) {
+      v = k + k->size;
+      if(k->type == tns_tag_string && k->len == len &&
+         memcmp(k->data, key, len) == 0) {
+          return v;
+      }
+      k = v + v->size;
+  }
+  return NULL;
+}
+
+
+int tns_dom_to_integer(const tns_node *node, long long *val)
+{
+  const char *pos = node->data;
+  const char *eod = node->data + node->len;
+  unsigned long long value = 0;
+  unsigned long long limit = LLONG_MAX;
+  int negative = 0;
+
+  if(node->type != tns_tag_integer || pos == eod) {
+      return -1;
+  }
+  if(*pos == '+' || *pos == '-') {
+      negative = (*pos == '-');
+      limit += negative;
+      pos++;
+      if(pos == eod) {
+          return -1;
+      }
+  }
+  while(pos < eod) {
+      if(*pos < '0' || *pos > '9') {
+          return -1;
+      }
+      if(value > (limit - (*pos - '0')) / 10) {
+          return -1;
+      }
+      value = (value * 10) + (*pos - '0');
+      pos++;
+  }
+
+  if(negative) {
+      *val = value == limit ? LLONG_MIN : -(long long)value;
+  } else {
+      *val = (long long)value;
+  }
+  return 0;
+}
+
+
+int tns_dom_to_float(const tns_node *node, double *val)
+{
+  char buf[64];
+  char *str = buf;
+  char *end = NULL;
+  double d;
+  int ok;
+
+  //  strtod needs a terminated string, and skips any leading whitespace.
+  if(node->type != tns_tag_float && node->type != tns_tag_integer) {
+      return -1;
+  }
+  if(node->len == 0 || isspace((unsigned char)node->data[0])) {
+      return -1;
+  }
+  if(node->len >= sizeof(buf)) {
+      str = malloc(node->len + 1);
+      if(str == NULL) {
+          return -1;
+      }
+  }
+  memcpy(str, node->data, node->len);
+  str[node->len] = '\0';
+  d = strtod(str, &end);
+  ok = (end == str + node->len);
+  if(str != buf) {
+      free(str);
+  }
+  if(!ok) {
+      return -1;
+  }
+
+  *val = d;
+  return 0;
+}
+
+
+int tns_cursor_init(tns_cursor *cur, const char *data, size_t len)
+{
+  return tns_dom_split(data, len, TNS_CURSOR_MAX_LENGTH, &cur->type,
+                       &cur->data, &cur->len, &cur->end);
+}
+
+
+int tns_cursor_first(const tns_cursor *parent, tns_cursor *child)
+{
+  if(parent->type != tns_tag_list && parent->type != tns_tag_dict) {
+      return -1;
+  }
+  if(parent->len == 0) {
+      return -1;
+  }
+  return tns_cursor_init(child, parent->data, parent->len);
+}
+
+
+int tns_cursor_next(const tns_cursor *parent, tns_cursor *cur)
+{
+  const char *eod = parent->data + parent->len;
+
+  if(cur->end >= eod) {
+      return -1;
+  }
+  return tns_cursor_init(cur, cur->end, eod - cur->end);
+}
+
+
+int tns_cursor_index(const tns_cursor *list, size_t index, tns_cursor *item)
+{
+  tns_cursor parent = *list;
+  tns_cursor cur;
+
+  if(parent.type != tns_tag_list || tns_cursor_first(&parent, &cur) == -1) {
+      return -1;
+  }
+  while(index-- > 0) {
+      if(tns_cursor_next(&parent, &cur) == -1) {
+          return -1;
+      }
+  }
+  *item = cur;
+  return 0;
+}
+
+
+int tns_cursor_key(const tns_cursor *dict, const char *key, size_t len,
+                   tns_cursor *value)
+{
+  tns_cursor parent = *dict;
+  tns_cursor k, v;
+
+  if(parent.type != tns_tag_dict || tns_cursor_first(&parent, &k) == -1) {
+      return -1;
+  }
+  for(;;) {
+      v = k;
+      if(tns_cursor_next(&parent, &v) == -1) {
+          return -1;
+      }
+      if(k.type == tns_tag_string && k.len == len &&
+         memcmp(k.data, key, len) == 0) {
+          *value = v;
+          return 0;
+      }
+      k = v;
+      if(tns_cursor_next(&parent, &k) == -1) {
+          return -1;
+      }
+  }
+}
+
+
+//  Numbers are short, so we can borrow the node decoding functions.
+static int tns_cursor_to_node(const tns_cursor *cur, tns_node *node)
+{
+  if(cur->len > TNS_MAX_LENGTH) {
+      return -1;
+  }
+  node->data = cur->data;
+  node->len = (uint32_t)cur->len;
+  node->size = 1;
+  node->count = 0;
+  node->type = cur->type;
+  return 0;
+}
+
+
+int tns_cursor_to_integer(const tns_cursor *cur, long long *val)
+{
+  tns_node node;
+
+  if(tns_cursor_to_node(cur, &node) == -1) {
+      return -1;
+  }
+  return tns_dom_to_integer(&node, val);
+}
+
+
+int tns_cursor_to_float(const tns_cursor *cur, double *val)
+{
+  tns_node node;
+
+  if(tns_cursor_to_node(cur, &node) == -1) {
+      return -1;
+  }
+  return tns_dom_to_float(&node, val);
+}
+
+
+#ifdef TNS_HAVE_MMAP
+
+int tns_map_file(tns_mapping *map, const char *path)
+{
+  struct stat st;
+  void *addr = NULL;
+  int saved = 0;
+  int fd;
+
+  map->data = NULL;
+  map->len = 0;
+
+  fd = open(path, O_RDONLY);
+  if(fd == -1) {
+      return -1;
+  }
+  if(fstat(fd, &st) == -1) {
+      goto error;
+  }
+  //  mmap refuses empty files, but an empty mapping is fine by us.
+  if(st.st_size == 0) {
+      close(fd);
+      return 0;
+  }
+  addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if(addr == MAP_FAILED) {
+      goto error;
+  }
+  posix_madvise(addr, (size_t)st.st_size, POSIX_MADV_RANDOM);
+  close(fd);
+
+  map->data = addr;
+  map->len = (size_t)st.st_size;
+  return 0;
+
+error:
+  saved = errno;
+  close(fd);
+  errno = saved;
+  return -1;
+}
+
+
+void tns_unmap_file(tns_mapping *map)
+{
+  if(map->data != NULL) {
+      munmap((void*)map->data, map->len);
+  }
+  map->data = NULL;
+  map->len = 0;
+}
+
+#endif
@@ -0,0 +1,196 @@
+//
+//  tns_dom.h:  compact document model for tnetstrings
+//
+//  The tns_ops callbacks build one object per node, which usually means
+//  one malloc per node.  This is an alternative for code outside python:
+//  parse a tnetstring into a flat array of nodes that point back into the
+//  input data, with all the memory coming from a single bump arena.
+//  Throwing away a parsed document is then just a matter of resetting
+//  or freeing the arena.
+//
+//  Nodes are stored in depth-first order.  The children of a container
+//  start immediately after it, and each node records the size of its
+//  subtree so that siblings can be found by skipping over it.  Dicts
+//  store their keys and values alternately, like the wire format.
+//
+//  For documents too big to parse into nodes at all, there are also
+//  cursors that navigate the raw tnetstring in place; see tns_cursor below.
+//
+//  Unlike tns_core.c, this code has no dependency on python and never
+//  touches any global state, so it's safe to call from any thread.
+//
+
+#ifndef _tns_dom_h
+#define _tns_dom_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tns_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+//  A single value in a parsed document.  The payload isn't copied or
+//  decoded; 'data' points into the parsed string and is not terminated.
+//  Lengths are bounded by TNS_MAX_LENGTH, so they fit in 32 bits.
+struct tns_node_s {
+  const char *data;
+  uint32_t len;
+  uint32_t size;
+  uint32_t count;
+  char type;
+};
+typedef struct tns_node_s tns_node;
+
+
+//  A simple bump allocator.  Allocation just advances a pointer through
+//  a single block of memory, and everything is freed at once by a reset.
+struct tns_arena_s {
+  char *buffer;
+  size_t size;
+  size_t used;
+  int owned;
+};
+typedef struct tns_arena_s tns_arena;
+
+
+//  A parsed document.  The root is always nodes[0].  If parsing fails
+//  then 'error' describes the problem and the nodes should not be used.
+struct tns_dom_s {
+  tns_node *nodes;
+  size_t count;
+  const char *error;
+};
+typedef struct tns_dom_s tns_dom;
+
+
+//  Initialize an arena with a malloced block of the given size.
+//  Returns 0 on success, -1 if the memory could not be allocated.
+extern int tns_arena_init(tns_arena *arena, size_t size);
+
+//  Initialize an arena using a block of memory supplied by the caller.
+//  The arena will never free it.
+extern void tns_arena_init_static(tns_arena *arena, void *buffer, size_t size);
+
+//  Allocate memory from an arena, suitably aligned for any node.
+//  Returns NULL if the arena doesn't have enough room left.
+extern void* tns_arena_alloc(tns_arena *arena, size_t size);
+
+//  Release everything allocated from an arena, keeping its memory.
+extern void tns_arena_reset(tns_arena *arena);
+
+//  Free the memory of an arena, if it was malloced by tns_arena_init.
+extern void tns_arena_free(tns_arena *arena);
+
+
+//  Get an upper bound on the number of nodes in a tnetstring of the given
+//  length.  The smallest possible value "0:~" takes three bytes.  For big
+//  inputs the bound is generous, but the nodes are written front to back
+//  and most allocators don't commit large blocks until they're touched.
+extern size_t tns_dom_max_nodes(size_t len);
+
+//  The same bound for the tnetstring at the front of some data, ignoring
+//  anything after it.  A buffer holding many messages would otherwise
+//  need nodes for all of them, at about ten times its size.
+extern size_t tns_dom_value_max_nodes(const char *data, size_t len);
+
+//  Parse a tnetstring off the front of some data into an array of nodes
+//  supplied by the caller, which must have room for 'capacity' nodes.
+//  Returns 0 on success or -1 on error, setting dom->error.  If 'remain'
+//  is non-NULL it receives the unparsed remainder of the string.
+extern int tns_dom_parse_into(tns_dom *dom, tns_node *nodes, size_t capacity,
+                              const char *data, size_t len, char **remain);
+
+//  Parse a tnetstring into nodes allocated from an arena.  If the arena
+//  has not been initialized (its buffer is NULL) then it is malloced at
+//  the size needed for the first value in the input; otherwise it must
+//  have enough room.
+extern int tns_dom_parse(tns_dom *dom, tns_arena *arena,
+                         const char *data, size_t len, char **remain);
+
+
+//  Functions for navigating a parsed document.
+//  These return NULL if the requested node doesn't exist.
+extern const tns_node* tns_dom_first_child(const tns_node *node);
+extern const tns_node* tns_dom_next_sibling(const tns_node *parent,
+                                            const tns_node *node);
+extern const tns_node* tns_dom_list_get(const tns_node *list, size_t index);
+extern const tns_node* tns_dom_dict_get(const tns_node *dict,
+                                        const char *key, size_t len);
+
+//  Functions for decoding primitive values.  Numbers are not checked
+//  while parsing, so these validate them and return -1 if invalid.
+extern int tns_dom_to_integer(const tns_node *node, long long *val);
+extern int tns_dom_to_float(const tns_node *node, double *val);
+
+
+//  A cursor is the position of a single value within a tnetstring that
+//  is held in memory, such as a file mapped with tns_map_file.  Moving a
+//  cursor to a child or a sibling just hops over the length prefixes of
+//  the values in between, without looking inside them, so only the pages
+//  along the way are ever read.  You hold one cursor for each level you
+//  descend into, so memory use is proportional to the path rather than
+//  the document.  Lengths aren't limited by TNS_MAX_LENGTH here, so
+//  containers of many gigabytes are fine.
+//
+//  Values are only checked as far as needed to move over them; use the
+//  decoding functions, or tns_dom_parse on a small subtree, to validate.
+struct tns_cursor_s {
+  const char *data;
+  size_t len;
+  const char *end;
+  char type;
+};
+typedef struct tns_cursor_s tns_cursor;
+
+//  Point a cursor at the value at the front of some data.  cur->end is
+//  just past its type tag, i.e. the start of any remaining data.
+//  These all return 0 on success, or -1 if the data is not a tnetstring
+//  or the requested value doesn't exist.
+extern int tns_cursor_init(tns_cursor *cur, const char *data, size_t len);
+
+//  Move to the first item of a list or dict, or to the item after 'cur'
+//  within the same parent.  Dict keys and values count as separate items.
+extern int tns_cursor_first(const tns_cursor *parent, tns_cursor *child);
+extern int tns_cursor_next(const tns_cursor *parent, tns_cursor *cur);
+
+//  Find an item of a list by index, or the value for a key in a dict.
+//  Both are linear in the number of items, but skip over their contents.
+//  The result may be written over the cursor being searched.
+extern int tns_cursor_index(const tns_cursor *list, size_t index,
+                            tns_cursor *item);
+extern int tns_cursor_key(const tns_cursor *dict, const char *key,
+                          size_t len, tns_cursor *value);
+
+//  Decode primitive values, as tns_dom_to_integer and tns_dom_to_float.
+extern int tns_cursor_to_integer(const tns_cursor *cur, long long *val);
+extern int tns_cursor_to_float(const tns_cursor *cur, double *val);
+
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TNS_HAVE_MMAP 1
+
+//  A read-only memory mapping of a whole file.
+struct tns_mapping_s {
+  const char *data;
+  size_t len;
+};
+typedef struct tns_mapping_s tns_mapping;
+
+//  Map a file into memory, read-only.  The kernel is told to expect
+//  random access, so skipping over a big subtree doesn't read it ahead.
+//  Returns 0 on success, or -1 with errno set.
+extern int tns_map_file(tns_mapping *map, const char *path);
+extern void tns_unmap_file(tns_mapping *map);
+
+#endif
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,407 @@
+//
+//  tns_parallel.hpp:  parse one big tnetstring into a document on many cores
+//
+//  tns::document::parse runs on a single thread, however big the input.
+//  But every value in a tnetstring is length-prefixed, so the items of a
+//  list or dict can be found by hopping from one prefix to the next without
+//  looking inside them, and then parsed independently.  A parallel_parser
+//  does just that, with a pool of threads that it keeps between calls:
+//
+//    tns::parallel_parser pp;        //  One thread per core.
+//    tns::document doc;
+//    if(!pp.parse(doc, data)) { ... doc.error() ... }
+//
+//  The calling thread hops over the items of the top-level value and
+//  groups them into chunks of about chunk_size() bytes.  Any item much
+//  bigger than that, such as the list in {"records": [...]}, is descended
+//  into and split up in turn.  Each worker starts with a contiguous run of
+//  chunks and parses them into nodes in its own arena; when it runs out it
+//  steals from the far end of another worker's run.  Once the counts are
+//  known the chunks are copied into place in the document, again spread
+//  over the pool, and the containers that were split are filled in around
+//  them.  The result is exactly what document::parse would have produced.
+//
+//  If the input is small, or not a container, or any part of it fails to
+//  parse, this just calls document::parse, so errors are reported the
+//  same way too.  A parallel_parser handles one parse at a time; use one
+//  per thread that needs it.  Like tns::document, this needs <memory_resource>
+//  and tns_dom.c, and you'll have to link with your platform's threads.
+//
+
+#ifndef _tns_parallel_hpp
+#define _tns_parallel_hpp
+
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "tns_core.hpp"
+
+#ifdef TNS_HAVE_PMR
+
+
+namespace tns {
+
+
+class parallel_parser {
+public:
+  //  Start a pool of 'threads' workers, including the thread that calls
+  //  parse(); zero means one per core.  Inputs of less than two chunks
+  //  are parsed serially.
+  explicit parallel_parser(unsigned threads = 0, size_t chunk_size = 65536)
+    : chunk_size_(chunk_size > 0 ? chunk_size : 1), step_(nullptr),
+      generation_(0), pending_(0), stop_(false)
+  {
+    if(threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if(threads == 0) {
+        threads = 1;
+    }
+    queues_ = std::make_unique<queue[]>(threads);
+    for(unsigned i = 0; i < threads; i++) {
+        arenas_.push_back(
+            std::make_unique<std::pmr::monotonic_buffer_resource>());
+    }
+    //  If we can't start them all, stop the ones we did start; the
+    //  destructor won't run, and joinable threads would terminate us.
+    try {
+        for(unsigned i = 1; i < threads; i++) {
+            workers_.emplace_back(&parallel_parser::worker_main, this, i);
+        }
+    } catch(...) {
+        stop();
+        throw;
+    }
+  }
+
+  ~parallel_parser()
+  {
+    stop();
+  }
+
+  parallel_parser(const parallel_parser &) = delete;
+  parallel_parser &operator=(const parallel_parser &) = delete;
+
+  //  Parse a value off the front of 'data' into 'doc', replacing any
+  //  previous one; this behaves exactly like doc.parse(data, remain).
+  bool parse(document &doc, std::string_view data,
+             std::string_view *remain = nullptr)
+  {
+    std::string_view rest = data;
+    std::string_view payload;
+    tns_type_tag type;
+    size_t total = 0;
+    bool ok = true;
+
+    if(threads() == 1 || data.size() < 2 * chunk_size_ ||
+       !split(rest, type, payload) ||
+       (type != tns_tag_list && type != tns_tag_dict)) {
+        return doc.parse(data, remain);
+    }
+
+    releaser guard{this};
+
+    //  Find the chunks, then parse them all.  Anything wrong with the
+    //  structure sends us back to the serial parser for the error.
+    segments_.clear();
+    ok = plan(type, payload);
+    if(ok) {
+        run(&parallel_parser::parse_step);
+        for(const segment &seg : segments_) {
+            if(seg.failed) {
+                ok = false;
+                break;
+            }
+        }
+    }
+    if(!ok) {
+        release();
+        return doc.parse(data, remain);
+    }
+
+    //  Now we know where everything goes, copy it all into place.
+    for(segment &seg : segments_) {
+        seg.offset = total;
+        total += seg.count;
+    }
+    doc.clear();
+    doc.nodes_ = static_cast<tns_node*>(
+        doc.mr_->allocate(total * sizeof(tns_node), alignof(tns_node)));
+    doc.capacity_ = total;
+    nodes_ = doc.nodes_;
+    total_ = total;
+    run(&parallel_parser::copy_step);
+    doc.dom_ = tns_dom{doc.nodes_, total, nullptr};
+
+    if(remain != nullptr) {
+        *remain = rest;
+    }
+    return true;
+  }
+
+  unsigned threads() const noexcept
+  {
+    return static_cast<unsigned>(workers_.size() + 1);
+  }
+
+  size_t chunk_size() const noexcept { return chunk_size_; }
+
+private:
+  //  A piece of the output.  Either a run of consecutive items that are
+  //  parsed together, or a container that was split into smaller pieces;
+  //  its node comes first, and its descendants run up to segment 'end'.
+  struct segment {
+    const char *data;
+    size_t len;
+    size_t items;
+    size_t end;
+    tns_node *nodes;
+    size_t count;
+    size_t offset;
+    char type;
+    bool failed;
+  };
+
+  //  The segments left for one worker.  The owner takes them from the
+  //  front and thieves take them from the back, so they rarely meet.
+  struct alignas(64) queue {
+    std::mutex lock;
+    size_t head = 0;
+    size_t tail = 0;
+  };
+
+  //  Hands back the arena memory however parse() finishes, even if
+  //  allocating the document's nodes throws.
+  struct releaser {
+    parallel_parser *pp;
+    ~releaser() { pp->release(); }
+  };
+
+  typedef void (parallel_parser::*step)(segment &seg, unsigned worker);
+
+  //  Hop over the items of a container payload, adding its segments.
+  bool plan(tns_type_tag type, std::string_view payload)
+  {
+    size_t self = segments_.size();
+    size_t chunk = 0;
+    size_t items = 0;
+    bool open = false;
+
+    segments_.push_back(segment{payload.data(), payload.size(), 0, 0,
+                                nullptr, 1, 0, static_cast<char>(type),
+                                false});
+    while(!payload.empty()) {
+        const char *start = payload.data();
+        std::string_view p;
+        tns_type_tag t;
+        if(!split(payload, t, p)) {
+            return false;
+        }
+        items++;
+        if((t == tns_tag_list || t == tns_tag_dict) &&
+           p.size() > 4 * chunk_size_) {
+            open = false;
+            if(!plan(t, p)) {
+                return false;
+            }
+            continue;
+        }
+        if(!open) {
+            chunk = segments_.size();
+            segments_.push_back(segment{start, 0, 0, 0, nullptr, 0, 0, 0,
+                                        false});
+            open = true;
+        }
+        segments_[chunk].len = payload.data() - segments_[chunk].data;
+        segments_[chunk].items++;
+        if(segments_[chunk].len >= chunk_size_) {
+            open = false;
+        }
+    }
+    if(type == tns_tag_dict && items % 2 != 0) {
+        return false;
+    }
+    segments_[self].items = items;
+    segments_[self].end = segments_.size();
+    return true;
+  }
+
+  //  Parse the items of a chunk into the worker's arena.
+  void parse_step(segment &seg, unsigned worker)
+  {
+    const char *pos = seg.data;
+    const char *end = seg.data + seg.len;
+    size_t capacity = tns_dom_max_nodes(seg.len);
+    tns_dom dom;
+    char *rest;
+
+    if(seg.type != 0) {
+        return;
+    }
+    try {
+        seg.nodes = static_cast<tns_node*>(arenas_[worker]->allocate(
+            capacity * sizeof(tns_node), alignof(tns_node)));
+    } catch(const std::bad_alloc &) {
+        seg.failed = true;
+        return;
+    }
+    while(pos < end) {
+        if(tns_dom_parse_into(&dom, seg.nodes + seg.count,
+                              capacity - seg.count, pos, end - pos,
+                              &rest) == -1) {
+            seg.failed = true;
+            return;
+        }
+        seg.count += dom.count;
+        pos = rest;
+    }
+  }
+
+  //  Copy a chunk into its final place, or fill in a split container.
+  void copy_step(segment &seg, unsigned)
+  {
+    tns_node *node = nodes_ + seg.offset;
+    size_t end;
+
+    if(seg.type == 0) {
+        memcpy(node, seg.nodes, seg.count * sizeof(tns_node));
+        return;
+    }
+    end = seg.end < segments_.size() ? segments_[seg.end].offset : total_;
+    node->data = seg.data;
+    node->len = static_cast<uint32_t>(seg.len);
+    node->size = static_cast<uint32_t>(end - seg.offset);
+    node->count = static_cast<uint32_t>(seg.items);
+    node->type = seg.type;
+  }
+
+  //  Run a step over every segment, on every thread in the pool.
+  void run(step s)
+  {
+    size_t n = segments_.size();
+    unsigned nthreads = threads();
+
+    for(unsigned i = 0; i < nthreads; i++) {
+        queues_[i].head = n * i / nthreads;
+        queues_[i].tail = n * (i + 1) / nthreads;
+    }
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      step_ = s;
+      generation_++;
+      pending_ = workers_.size();
+    }
+    wake_.notify_all();
+    work(0);
+    std::unique_lock<std::mutex> lock(lock_);
+    done_.wait(lock, [this]() { return pending_ == 0; });
+  }
+
+  void work(unsigned worker)
+  {
+    unsigned nthreads = threads();
+    size_t index;
+
+    for(;;) {
+        if(!take(queues_[worker], false, index)) {
+            unsigned victim = worker;
+            bool found = false;
+            for(unsigned i = 1; i < nthreads && !found; i++) {
+                victim = (worker + i) % nthreads;
+                found = take(queues_[victim], true, index);
+            }
+            if(!found) {
+                return;
+            }
+        }
+        (this->*step_)(segments_[index], worker);
+    }
+  }
+
+  static bool take(queue &q, bool steal, size_t &index)
+  {
+    std::lock_guard<std::mutex> lock(q.lock);
+    if(q.head == q.tail) {
+        return false;
+    }
+    index = steal ? --q.tail : q.head++;
+    return true;
+  }
+
+  void worker_main(unsigned worker)
+  {
+    size_t seen = 0;
+
+    for(;;) {
+        {
+          std::unique_lock<std::mutex> lock(lock_);
+          wake_.wait(lock, [&]() { return stop_ || generation_ != seen; });
+          if(stop_) {
+              return;
+          }
+          seen = generation_;
+        }
+        work(worker);
+        {
+          std::lock_guard<std::mutex> lock(lock_);
+          if(--pending_ == 0) {
+              done_.notify_one();
+          }
+        }
+    }
+  }
+
+  //  Tell the workers to finish, and wait for them.
+  void stop() noexcept
+  {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for(std::thread &t : workers_) {
+        t.join();
+    }
+  }
+
+  //  Hand the arena memory back once the chunks have been copied out.
+  void release()
+  {
+    for(auto &arena : arenas_) {
+        arena->release();
+    }
+    segments_.clear();
+    nodes_ = nullptr;
+    total_ = 0;
+  }
+
+  size_t chunk_size_;
+  std::vector<segment> segments_;
+  std::unique_ptr<queue[]> queues_;
+  std::vector<std::unique_ptr<std::pmr::monotonic_buffer_resource>> arenas_;
+  tns_node *nodes_ = nullptr;
+  size_t total_ = 0;
+
+  std::vector<std::thread> workers_;
+  std::mutex lock_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  step step_;
+  size_t generation_;
+  size_t pending_;
+  bool stop_;
+};
+
+
+}  // namespace tns
+
+#endif  // TNS_HAVE_PMR
+
+#endif
@@ -0,0 +1,256 @@
+//
+//  tns_stream.hpp:  incremental tnetstring parsing with C++20 coroutines
+//
+//  This reads a stream of tnetstrings as it arrives off a socket, in
+//  whatever chunks the reads happen to return.  Inside is a coroutine that
+//  co_awaits more input whenever it runs out, so there's no hand-written
+//  state machine; from outside you just feed it each chunk as you read it:
+//
+//    struct builder : tns::parser<builder, my_value> { ... };
+//
+//    builder b;
+//    tns::stream<builder, my_value> s(b);
+//
+//    //  In your read callback:
+//    std::string_view data(buf, nread);
+//    while(!data.empty()) {
+//      switch(s.feed(data)) {
+//        case tns::stream_status::ready:
+//          handle(s.take());
+//          break;
+//        case tns::stream_status::error:
+//          close_connection(s.error());
+//          return;
+//        case tns::stream_status::more:
+//          break;
+//      }
+//    }
+//
+//  The length prefix is checked byte by byte as it arrives, with the same
+//  rules as tns_split_value, so garbage is rejected before anything gets
+//  buffered.  The type tag comes after the payload though, so a value
+//  can't be interpreted until all of it has arrived.  When it arrives in a
+//  single chunk it's parsed in place; otherwise it's collected into a
+//  buffer that grows as the chunks arrive, so a peer can't make us
+//  allocate memory just by sending a big length prefix.  Either way the
+//  payload is then parsed by tns::parser::parse_payload, so it's
+//  validated exactly as tns_parse_payload would do.  The string_views
+//  passed to the handlers are only valid for the duration of each call.
+//
+//  This needs a C++20 compiler with coroutine support.
+//
+
+#ifndef _tns_stream_hpp
+#define _tns_stream_hpp
+
+#include <algorithm>
+#include <coroutine>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "tns_core.hpp"
+
+
+namespace tns {
+
+
+enum class stream_status {
+  more,     //  All the input was consumed; feed it more.
+  ready,    //  A value is ready; call take() to get it.
+  error     //  The input is not a valid stream of tnetstrings.
+};
+
+
+//  Parses a stream of tnetstrings using a tns::parser subclass.
+//  The parser is held by reference and must outlive the stream.
+template<class Parser, class Value>
+class stream {
+public:
+  explicit stream(Parser &parser)
+    : parser_(parser), status_(stream_status::more), error_(nullptr),
+      value_(), buffered_(0), task_(run())
+  {
+  }
+
+  ~stream()
+  {
+    task_.destroy();
+  }
+
+  stream(const stream &) = delete;
+  stream &operator=(const stream &) = delete;
+
+  //  Consume bytes from the front of 'data', up to the end of the next
+  //  complete value.  'data' is advanced past whatever was consumed, so
+  //  call this again with the rest once you've taken the value.  If the
+  //  parser throws, the exception comes out of here and the stream fails;
+  //  it can't pick up where it left off, so reset() it to go on.
+  stream_status feed(std::string_view &data)
+  {
+    if(status_ == stream_status::error) {
+        return status_;
+    }
+    chunk_ = data;
+    status_ = stream_status::more;
+    try {
+        task_.resume();
+    } catch(...) {
+        chunk_ = std::string_view();
+        fail("Parser threw an exception.");
+        throw;
+    }
+    data = chunk_;
+    chunk_ = std::string_view();
+    return status_;
+  }
+
+  //  Move out the value that was just parsed.
+  Value take()
+  {
+    return std::move(value_);
+  }
+
+  //  Why the stream failed, or NULL if it hasn't.
+  const char *error() const noexcept { return error_; }
+
+  //  Start again from the beginning of a fresh stream, e.g. after an error.
+  void reset()
+  {
+    task_.destroy();
+    status_ = stream_status::more;
+    error_ = nullptr;
+    value_ = Value();
+    buffer_.clear();
+    task_ = run();
+  }
+
+  //  The number of payload bytes that had to be copied into the buffer
+  //  because their value arrived over more than one chunk.
+  size_t buffered_bytes() const noexcept { return buffered_; }
+
+private:
+  //  The coroutine that does the parsing.  It's started lazily by the
+  //  first feed(), and never finishes except by failing.  An exception
+  //  from the parser finishes it too, on its way out to feed().
+  struct task {
+    struct promise_type {
+      task get_return_object()
+      {
+        return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+      }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      std::suspend_always final_suspend() noexcept { return {}; }
+      void return_void() noexcept {}
+      void unhandled_exception() { throw; }
+    };
+
+    void resume() { if(!handle.done()) handle.resume(); }
+    void destroy() { if(handle) handle.destroy(); }
+
+    std::coroutine_handle<promise_type> handle;
+  };
+
+  //  Awaited when the coroutine needs more bytes.  Suspends only if the
+  //  current chunk is used up.
+  struct input {
+    stream *s;
+    bool await_ready() const noexcept { return !s->chunk_.empty(); }
+    void await_suspend(std::coroutine_handle<>) const noexcept {}
+    void await_resume() const noexcept {}
+  };
+
+  //  Awaited to hand a finished value back to the caller of feed().
+  struct yield {
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<>) const noexcept {}
+    void await_resume() const noexcept {}
+  };
+
+  task run()
+  {
+    for(;;) {
+        size_t len = 0;
+        size_t ndigits = 0;
+        std::string_view payload;
+        char c;
+
+        //  Read the length prefix one byte at a time.  The netstring spec
+        //  explicitly forbids padding zeros, so a zero must be the only
+        //  digit in the length.
+        for(;;) {
+            co_await input{this};
+            c = chunk_[0];
+            chunk_.remove_prefix(1);
+            if(c == ':') {
+                break;
+            }
+            if(c < '0' || c > '9' || (ndigits == 1 && len == 0)) {
+                fail("Not a tnetstring: invalid length prefix.");
+                co_return;
+            }
+            len = (len * 10) + (c - '0');
+            ndigits++;
+            if(len > TNS_MAX_LENGTH) {
+                fail("Not a tnetstring: invalid length prefix.");
+                co_return;
+            }
+        }
+        if(ndigits == 0) {
+            fail("Not a tnetstring: invalid length prefix.");
+            co_return;
+        }
+
+        //  Get the payload and type tag, in place if we can.
+        co_await input{this};
+        if(chunk_.size() > len) {
+            payload = chunk_.substr(0, len + 1);
+            chunk_.remove_prefix(len + 1);
+        } else {
+            //  Don't trust the length prefix with the allocation size; a
+            //  peer could claim a huge value and never send it.  Reserve a
+            //  little more than we have, and grow as the rest arrives.
+            buffer_.clear();
+            buffer_.reserve(std::min(len + 1, chunk_.size() * 2 + 65536));
+            while(buffer_.size() < len + 1) {
+                co_await input{this};
+                size_t n = std::min(chunk_.size(), len + 1 - buffer_.size());
+                buffer_.append(chunk_.data(), n);
+                chunk_.remove_prefix(n);
+            }
+            buffered_ += len;
+            payload = buffer_;
+        }
+
+        value_ = Value();
+        if(!parser_.parse_payload(static_cast<tns_type_tag>(payload[len]),
+                                  payload.substr(0, len), value_)) {
+            fail("Not a tnetstring: invalid payload.");
+            co_return;
+        }
+        status_ = stream_status::ready;
+        co_await yield{};
+    }
+  }
+
+  void fail(const char *msg) noexcept
+  {
+    status_ = stream_status::error;
+    error_ = msg;
+  }
+
+  Parser &parser_;
+  stream_status status_;
+  const char *error_;
+  Value value_;
+  std::string_view chunk_;
+  std::string buffer_;
+  size_t buffered_;
+  task task_;
+};
+
+
+}  // namespace tns
+
+#endif
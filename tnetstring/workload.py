@@ -0,0 +1,244 @@
+"""
+tnetstring.workload:  profile the shape of the tnetstrings passing through
+
+Which fast paths matter depends on the traffic: lots of small integers,
+lots of short dict keys, a few big blobs, deeply nested documents, etc.
+The Profiler class in this module samples messages as they are loaded or
+dumped and keeps histograms of their shape:
+
+    :size:           total size of each message in bytes
+    :depth:          maximum container nesting depth of each message
+    :fanout:         number of items in each list, or pairs in each dict
+    :string_length:  length of each string value, including dict keys
+    :tags:           number of values seen with each type tag
+
+Sizes and lengths are bucketed on a log2 scale, with each bucket keyed by
+its lower bound; depths are recorded exactly.  The histograms are exported
+as a plain dict, which can itself be dumped as a tnetstring::
+
+    >>> profiler = Profiler()
+    >>> profiler.loads("11:1:a,4:true!}")
+    {'a': True}
+    >>> sorted(profiler.export()["tags"].items())
+    [('!', 1), (',', 1), ('}', 1)]
+
+Call install() to have the profiler sample every call to tnetstring.loads()
+and tnetstring.dumps().  It only replaces the module attributes, so code that
+has already done "from tnetstring import loads" won't be profiled.
+"""
+
+import random
+
+import tnetstring
+
+
+#  Names of the histograms, in the order they are formatted.
+HISTOGRAMS = ("size","depth","fanout","string_length")
+
+
+def _bucket(n):
+    """Get the lower bound of the log2 bucket containing n."""
+    if n <= 0:
+        return 0
+    return 1 << (n.bit_length() - 1)
+
+
+class Profiler(object):
+    """Profiler(rate=1.0,seed=None)
+
+    Sampling profiler for the shape of tnetstring messages.  Each message
+    passed to loads(), dumps() or record() is sampled with probability
+    'rate', using a private random generator seeded from 'seed'.  Sampled
+    messages are scanned on the wire, without building any objects.  If
+    a sampled message can't be scanned it's counted in 'errors' rather
+    than recorded, and the call goes on as if it hadn't been sampled.
+    """
+
+    def __init__(self,rate=1.0,seed=None):
+        if not 0 <= rate <= 1:
+            raise ValueError("sample rate must be between 0 and 1")
+        self.rate = rate
+        self._random = random.Random(seed)
+        self._installed = None
+        self.reset()
+
+    def reset(self):
+        """Discard all the data collected so far."""
+        self.messages = {"loads":0,"dumps":0}
+        self.sampled = 0
+        self.errors = 0
+        self.size = {}
+        self.depth = {}
+        self.fanout = {}
+        self.string_length = {}
+        self.tags = {}
+
+    def loads(self,string,encoding=None,_loads=None):
+        """loads(string,encoding=None) -> object
+
+        Parse a tnetstring using tnetstring.loads(), sampling its shape.
+        """
+        value = (_loads or tnetstring.loads)(string,encoding)
+        self.messages["loads"] += 1
+        if self._should_sample():
+            self._sample(string)
+        return value
+
+    def dumps(self,value,encoding=None,_dumps=None):
+        """dumps(object,encoding=None) -> string
+
+        Dump an object using tnetstring.dumps(), sampling its shape.
+        """
+        string = (_dumps or tnetstring.dumps)(value,encoding)
+        self.messages["dumps"] += 1
+        if self._should_sample():
+            self._sample(string)
+        return string
+
+    def install(self):
+        """Sample all calls to tnetstring.loads() and tnetstring.dumps()."""
+        if self._installed is not None:
+            raise RuntimeError("profiler is already installed")
+        (loads,dumps) = (tnetstring.loads,tnetstring.dumps)
+        def profiled_loads(string,encoding=None):
+            return self.loads(string,encoding,loads)
+        def profiled_dumps(value,encoding=None):
+            return self.dumps(value,encoding,dumps)
+        tnetstring.loads = profiled_loads
+        tnetstring.dumps = profiled_dumps
+        self._installed = (loads,dumps)
+
+    def uninstall(self):
+        """Restore the functions replaced by install()."""
+        if self._installed is None:
+            raise RuntimeError("profiler is not installed")
+        (tnetstring.loads,tnetstring.dumps) = self._installed
+        self._installed = None
+
+    def record(self,string):
+        """Record the shape of the tnetstring at the front of a string.
+
+        Returns the number of bytes in the recorded tnetstring.  Trailing
+        data is ignored, but the tnetstring itself must be well-formed; if
+        it isn't then nothing at all is recorded.
+        """
+        try:
+            (end,depth,hists) = self._scan(string)
+        except (ValueError,IndexError):
+            raise ValueError("not a tnetstring: cannot record its shape")
+        self.sampled += 1
+        self._add(self.size,_bucket(end))
+        self._add(self.depth,depth)
+        for (name,hist) in hists.iteritems():
+            for (key,count) in hist.iteritems():
+                self._add(getattr(self,name),key,count)
+        return end
+
+    def export(self):
+        """export() -> dict
+
+        Get a copy of the collected data as a dict of dicts, which can be
+        dumped as a tnetstring and merged into another profiler with merge().
+        """
+        data = {"rate":self.rate,"sampled":self.sampled,
+                "errors":self.errors}
+        data["messages"] = dict(self.messages)
+        data["tags"] = dict(self.tags)
+        for name in HISTOGRAMS:
+            data[name] = dict(getattr(self,name))
+        return data
+
+    def merge(self,data):
+        """Add in data exported by another profiler."""
+        self.sampled += data["sampled"]
+        self.errors += data["errors"]
+        for (op,count) in data["messages"].iteritems():
+            self.messages[op] = self.messages.get(op,0) + count
+        for name in HISTOGRAMS + ("tags",):
+            hist = getattr(self,name)
+            for (key,count) in data[name].iteritems():
+                self._add(hist,key,count)
+
+    def format(self):
+        """format() -> string
+
+        Format the collected data as a tab-separated histogram dump, with
+        one line per bucket giving its name, lower bound, count and the
+        percentage of values in that histogram.
+        """
+        lines = ["# messages loads=%d dumps=%d sampled=%d errors=%d "
+                 "rate=%g" % (self.messages["loads"],self.messages["dumps"],
+                              self.sampled,self.errors,self.rate)]
+        lines.append("histogram\tbucket\tcount\tpercent")
+        for name in HISTOGRAMS + ("tags",):
+            hist = getattr(self,name)
+            total = float(sum(hist.itervalues()))
+            for key in sorted(hist):
+                count = hist[key]
+                lines.append("%s\t%s\t%d\t%.2f" % (name,key,count,
+                                                    100 * count / total))
+        return "\n".join(lines) + "\n"
+
+    def _should_sample(self):
+        return self.rate >= 1 or self._random.random() < self.rate
+
+    def _add(self,hist,key,count=1):
+        hist[key] = hist.get(key,0) + count
+
+    def _sample(self,string):
+        try:
+            self.record(string)
+        except ValueError:
+            self.errors += 1
+
+    def _scan(self,string):
+        """Scan the tnetstring at the front of a string.
+
+        Returns a tuple giving the offset just past the end of the value,
+        the maximum nesting depth found within it, and a dict of the tags,
+        fanout and string_length histograms for the values within it.
+        Containers are tracked on an explicit stack rather than by
+        recursion, so deep nesting can't hit the recursion limit.
+        """
+        hists = {"tags":{},"fanout":{},"string_length":{}}
+        #  One [end,tag,count] entry for each container we're inside.
+        stack = []
+        depth = pos = 0
+        while True:
+            colon = string.index(":",pos,pos + 10)
+            size = string[pos:colon]
+            if not size.isdigit() or (len(size) > 1 and size[0] == "0"):
+                raise ValueError
+            start = colon + 1
+            end = start + int(size)
+            tag = string[end]
+            if tag not in ",#^!~]}":
+                raise ValueError
+            self._add(hists["tags"],tag)
+            if tag == "]" or tag == "}":
+                if len(stack) + 1 > depth:
+                    depth = len(stack) + 1
+                if start < end:
+                    stack.append([end,tag,0])
+                    pos = start
+                    continue
+                self._add(hists["fanout"],0)
+            elif tag == ",":
+                self._add(hists["string_length"],_bucket(end - start))
+            pos = end + 1
+            #  Close all the containers that this value was the last item of.
+            while stack:
+                frame = stack[-1]
+                frame[2] += 1
+                if pos < frame[0]:
+                    break
+                if pos != frame[0]:
+                    raise ValueError
+                stack.pop()
+                count = frame[2]
+                if frame[1] == "}":
+                    count //= 2
+                self._add(hists["fanout"],_bucket(count))
+                pos += 1
+            if not stack:
+                return (pos,depth,hists)
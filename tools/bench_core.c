@@ -0,0 +1,1013 @@
+//
+//  bench_core.c:  microbenchmarks for the tnetstring C core
+//
+//  This times tns_parse and tns_render_value on their own, without python
+//  in the way, so that changes to tns_core.c can be measured in isolation.
+//  It links the core against a minimal set of C ops that allocate one
+//  struct per node, which is about the least work any real ops can do.
+//  Parsed strings point into the input rather than being copied.
+//
+//  Build it from the top of the source tree with something like:
+//
+//    cc -O2 -std=c99 -Itnetstring -o bench_core tools/bench_core.c
+//
+//  Each benchmark case works through a batch of values of one type and
+//  size class, all generated from a fixed seed so that runs are directly
+//  comparable.  Output is one tab-separated line per case and operation:
+//
+//    op  type  size  bytes_per_op  nodes_per_op  ns_per_op  bytes_per_sec
+//
+//  where an "op" is parsing or rendering a single top-level value, and
+//  the timing is the best of several repeats.  Options:
+//
+//    -t SECS   minimum time for each repeat (default 0.2)
+//    -r N      number of repeats (default 5)
+//    -s SEED   random seed (default 1)
+//    -f TEXT   only run cases whose "type/size" name contains TEXT
+//    -n        don't provide the sized list/dict ops, to skip the pre-scan
+//    -a        render with a tns_outbuf_hint, to size the outbuf adaptively
+//    -S        use the loops specialized to these ops from tns_core_tmpl.h,
+//              which call them directly instead of through the ops struct
+//    -p        also read hardware performance counters (linux only)
+//
+//  With -p, the cycles, instructions, branch misses, L1 data cache read
+//  misses and last-level cache misses are counted over all the repeats,
+//  and each is reported both per byte and per node, followed by the IPC.
+//  Counters that the kernel or hardware doesn't provide are shown as "-".
+//
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+  #include <linux/perf_event.h>
+  #include <sys/ioctl.h>
+  #include <sys/syscall.h>
+  #define BENCH_HAVE_PERF 1
+#endif
+
+#include "tns_core.c"
+
+
+//  Number of distinct values in each case.  Cycling through a few dozen
+//  values keeps the branch predictor from simply learning a single input.
+#define BENCH_BATCH 64
+
+
+//  A minimal C value: one malloced struct per node.
+//  Dicts store their keys and values alternately in 'items'.
+struct bench_value_s;
+typedef struct bench_value_s bench_value;
+
+struct bench_value_s {
+  char type;
+  int owned;
+  size_t len;
+  size_t alloc;
+  union {
+    long long i;
+    double f;
+    const char *s;
+    bench_value **items;
+  } v;
+};
+
+static bench_value bench_null = {tns_tag_null, 0, 0, 0, {0}};
+static bench_value bench_true = {tns_tag_bool, 0, 0, 0, {1}};
+static bench_value bench_false = {tns_tag_bool, 0, 0, 0, {0}};
+
+//  The loops specialized to the bench ops, built further down.
+void* bench_static_parse(const tns_ops *ops, const char *data,
+                         size_t len, char **remain);
+int bench_static_render_value(const tns_ops *ops, void *val,
+                              tns_outbuf *outbuf);
+
+
+//  A benchmark case: a generator for values of one type and size class.
+struct bench_case_s {
+  const char *type;
+  const char *size;
+  bench_value* (*generate)(unsigned long long *rng, size_t param);
+  size_t param;
+};
+typedef struct bench_case_s bench_case;
+
+
+//  A hardware counter, read through perf_event_open.
+struct bench_counter_s {
+  const char *name;
+  unsigned int type;
+  unsigned long long config;
+  int fd;
+  double total;
+};
+typedef struct bench_counter_s bench_counter;
+
+#ifdef BENCH_HAVE_PERF
+  #define BENCH_CACHE_MISS(c) (PERF_COUNT_HW_CACHE_##c | \
+                               (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+static bench_counter bench_counters[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, 0},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1, 0},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1, 0},
+    {"l1d_misses", PERF_TYPE_HW_CACHE, BENCH_CACHE_MISS(L1D), -1, 0},
+    {"llc_misses", PERF_TYPE_HW_CACHE, BENCH_CACHE_MISS(LL), -1, 0},
+    {NULL, 0, 0, -1, 0}
+};
+#else
+static bench_counter bench_counters[] = {
+    {NULL, 0, 0, -1, 0}
+};
+#endif
+
+static tns_ops bench_ops;
+static int bench_perf = 0;
+static int bench_hint = 0;
+static int bench_static = 0;
+static double bench_min_time = 0.2;
+static int bench_repeats = 5;
+static unsigned long long bench_seed = 1;
+static const char *bench_filter = NULL;
+
+
+//  xorshift64*, so the generated data doesn't depend on the libc.
+static unsigned long long bench_rand(unsigned long long *rng)
+{
+  *rng ^= *rng >> 12;
+  *rng ^= *rng << 25;
+  *rng ^= *rng >> 27;
+  return *rng * 2685821657736338717ULL;
+}
+
+
+static double bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+//  Open all the counters, disabled.  Any that can't be opened are
+//  left with fd -1 and reported as unavailable.
+static int bench_perf_open(void)
+{
+#ifdef BENCH_HAVE_PERF
+  struct perf_event_attr attr;
+  bench_counter *c = NULL;
+  int count = 0;
+
+  for(c = bench_counters; c->name != NULL; c++) {
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = c->type;
+      attr.config = c->config;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                         PERF_FORMAT_TOTAL_TIME_RUNNING;
+      c->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if(c->fd == -1) {
+          fprintf(stderr, "bench_core: counter %s is not available\n",
+                  c->name);
+      } else {
+          count++;
+      }
+  }
+  return count;
+#else
+  fprintf(stderr, "bench_core: counters are only supported on linux\n");
+  return 0;
+#endif
+}
+
+
+static void bench_perf_reset(void)
+{
+  bench_counter *c = NULL;
+
+  for(c = bench_counters; c->name != NULL; c++) {
+      c->total = 0;
+  }
+}
+
+
+static void bench_perf_start(void)
+{
+#ifdef BENCH_HAVE_PERF
+  bench_counter *c = NULL;
+
+  for(c = bench_counters; c->name != NULL; c++) {
+      if(c->fd != -1) {
+          ioctl(c->fd, PERF_EVENT_IOC_RESET, 0);
+          ioctl(c->fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+  }
+#endif
+}
+
+
+//  Stop the counters and add their values to the totals.  If the kernel
+//  had to multiplex the counters, the value is scaled up to estimate the
+//  count over the whole time they were enabled.
+static void bench_perf_stop(void)
+{
+#ifdef BENCH_HAVE_PERF
+  bench_counter *c = NULL;
+  unsigned long long vals[3];
+
+  for(c = bench_counters; c->name != NULL; c++) {
+      if(c->fd != -1) {
+          ioctl(c->fd, PERF_EVENT_IOC_DISABLE, 0);
+      }
+  }
+  for(c = bench_counters; c->name != NULL; c++) {
+      if(c->fd == -1) {
+          continue;
+      }
+      if(read(c->fd, vals, sizeof(vals)) != sizeof(vals) || vals[2] == 0) {
+          continue;
+      }
+      c->total += (double)vals[0] * ((double)vals[1] / vals[2]);
+  }
+#endif
+}
+
+
+static bench_counter* bench_perf_get(const char *name)
+{
+  bench_counter *c = NULL;
+
+  for(c = bench_counters; c->name != NULL; c++) {
+      if(strcmp(c->name, name) == 0) {
+          return c->fd != -1 ? c : NULL;
+      }
+  }
+  return NULL;
+}
+
+
+static void bench_perf_header(void)
+{
+  bench_counter *c = NULL;
+
+  for(c = bench_counters; c->name != NULL; c++) {
+      printf("\t%s_per_byte\t%s_per_node", c->name, c->name);
+  }
+  printf("\tipc");
+}
+
+
+static void bench_perf_print(double bytes, double nodes)
+{
+  bench_counter *c = NULL;
+  bench_counter *cycles = bench_perf_get("cycles");
+  bench_counter *instrs = bench_perf_get("instructions");
+
+  for(c = bench_counters; c->name != NULL; c++) {
+      if(c->fd == -1) {
+          printf("\t-\t-");
+      } else {
+          printf("\t%.4f\t%.4f", c->total / bytes, c->total / nodes);
+      }
+  }
+  if(cycles != NULL && instrs != NULL && cycles->total > 0) {
+      printf("\t%.3f", instrs->total / cycles->total);
+  } else {
+      printf("\t-");
+  }
+}
+
+
+static bench_value* bench_new(char type)
+{
+  bench_value *val = malloc(sizeof(bench_value));
+
+  if(val != NULL) {
+      memset(val, 0, sizeof(bench_value));
+      val->type = type;
+  }
+  return val;
+}
+
+
+static void bench_free_value(const tns_ops *ops, void *value)
+{
+  bench_value *val = value;
+  size_t i;
+
+  if(val == NULL || val == &bench_null ||
+     val == &bench_true || val == &bench_false) {
+      return;
+  }
+  if(val->type == tns_tag_list || val->type == tns_tag_dict) {
+      for(i = 0; i < val->len; i++) {
+          bench_free_value(ops, val->v.items[i]);
+      }
+      free(val->v.items);
+  } else if(val->type == tns_tag_string && val->owned) {
+      free((char*)val->v.s);
+  }
+  free(val);
+}
+
+
+//  The parsing half of the ops.
+
+static void* bench_parse_string(const tns_ops *ops, const char *data,
+                                size_t len)
+{
+  bench_value *val = bench_new(tns_tag_string);
+
+  if(val != NULL) {
+      val->v.s = data;
+      val->len = len;
+  }
+  return val;
+}
+
+
+static void* bench_parse_integer(const tns_ops *ops, const char *data,
+                                 size_t len)
+{
+  const char *pos = data;
+  const char *eod = data + len;
+  unsigned long long value = 0;
+  unsigned long long limit = LLONG_MAX;
+  int negative = 0;
+  bench_value *val = NULL;
+
+  if(pos < eod && (*pos == '-' || *pos == '+')) {
+      negative = (*pos == '-');
+      limit += negative;
+      pos++;
+  }
+  if(pos == eod) {
+      return NULL;
+  }
+  while(pos < eod) {
+      if(*pos < '0' || *pos > '9') {
+          return NULL;
+      }
+      if(value > (limit - (*pos - '0')) / 10) {
+          return NULL;
+      }
+      value = (value * 10) + (*pos - '0');
+      pos++;
+  }
+
+  val = bench_new(tns_tag_integer);
+  if(val != NULL) {
+      if(negative) {
+          val->v.i = value == limit ? LLONG_MIN : -(long long)value;
+      } else {
+          val->v.i = (long long)value;
+      }
+  }
+  return val;
+}
+
+
+static void* bench_parse_float(const tns_ops *ops, const char *data,
+                               size_t len)
+{
+  char buf[64];
+  char *end = NULL;
+  bench_value *val = NULL;
+  double d;
+
+  if(len == 0 || len >= sizeof(buf)) {
+      return NULL;
+  }
+  memcpy(buf, data, len);
+  buf[len] = '\0';
+  d = strtod(buf, &end);
+  if(end != buf + len) {
+      return NULL;
+  }
+
+  val = bench_new(tns_tag_float);
+  if(val != NULL) {
+      val->v.f = d;
+  }
+  return val;
+}
+
+
+static void* bench_get_null(const tns_ops *ops)
+{
+  return &bench_null;
+}
+
+
+static void* bench_get_true(const tns_ops *ops)
+{
+  return &bench_true;
+}
+
+
+static void* bench_get_false(const tns_ops *ops)
+{
+  return &bench_false;
+}
+
+
+static void* bench_new_container(char type, size_t size)
+{
+  bench_value *val = bench_new(type);
+
+  if(val != NULL && size > 0) {
+      val->v.items = malloc(size * sizeof(bench_value*));
+      if(val->v.items == NULL) {
+          free(val);
+          return NULL;
+      }
+      val->alloc = size;
+  }
+  return val;
+}
+
+
+static void* bench_new_list(const tns_ops *ops)
+{
+  return bench_new_container(tns_tag_list, 0);
+}
+
+
+static void* bench_new_dict(const tns_ops *ops)
+{
+  return bench_new_container(tns_tag_dict, 0);
+}
+
+
+static void* bench_new_list_sized(const tns_ops *ops, size_t size)
+{
+  return bench_new_container(tns_tag_list, size);
+}
+
+
+static void* bench_new_dict_sized(const tns_ops *ops, size_t size)
+{
+  return bench_new_container(tns_tag_dict, size * 2);
+}
+
+
+static int bench_append(bench_value *val, bench_value *item)
+{
+  bench_value **items = NULL;
+  size_t alloc;
+
+  if(val->len == val->alloc) {
+      alloc = val->alloc > 0 ? val->alloc * 2 : 4;
+      items = realloc(val->v.items, alloc * sizeof(bench_value*));
+      if(items == NULL) {
+          return -1;
+      }
+      val->v.items = items;
+      val->alloc = alloc;
+  }
+  val->v.items[val->len++] = item;
+  return 0;
+}
+
+
+static int bench_add_to_list(const tns_ops *ops, void *list, void *item)
+{
+  if(bench_append(list, item) == -1) {
+      bench_free_value(ops, item);
+      return -1;
+  }
+  return 0;
+}
+
+
+static int bench_add_to_dict(const tns_ops *ops, void *dict,
+                             void *key, void *item)
+{
+  if(bench_append(dict, key) == -1) {
+      bench_free_value(ops, key);
+      bench_free_value(ops, item);
+      return -1;
+  }
+  return bench_add_to_list(ops, dict, item);
+}
+
+
+//  The rendering half of the ops.
+
+static tns_type_tag bench_get_type(const tns_ops *ops, void *val)
+{
+  return ((bench_value*)val)->type;
+}
+
+
+static int bench_render_string(const tns_ops *ops, void *val,
+                               tns_outbuf *outbuf)
+{
+  bench_value *v = val;
+
+  return tns_outbuf_puts(outbuf, v->v.s, v->len);
+}
+
+
+static int bench_render_integer(const tns_ops *ops, void *val,
+                                tns_outbuf *outbuf)
+{
+  long long i = ((bench_value*)val)->v.i;
+  unsigned long long n = i < 0 ? -(unsigned long long)i : i;
+
+  do {
+      if(tns_outbuf_putc(outbuf, n % 10 + '0') == -1) {
+          return -1;
+      }
+      n = n / 10;
+  } while(n > 0);
+  if(i < 0) {
+      return tns_outbuf_putc(outbuf, '-');
+  }
+  return 0;
+}
+
+
+static int bench_render_float(const tns_ops *ops, void *val,
+                              tns_outbuf *outbuf)
+{
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "%.17g", ((bench_value*)val)->v.f);
+
+  return tns_outbuf_puts(outbuf, buf, len);
+}
+
+
+static int bench_render_bool(const tns_ops *ops, void *val,
+                             tns_outbuf *outbuf)
+{
+  if(((bench_value*)val)->v.i) {
+      return tns_outbuf_puts(outbuf, "true", 4);
+  }
+  return tns_outbuf_puts(outbuf, "false", 5);
+}
+
+
+static int bench_render_list(const tns_ops *ops, void *val,
+                             tns_outbuf *outbuf)
+{
+  bench_value *list = val;
+  size_t i = list->len;
+
+  while(i-- > 0) {
+      if(bench_static) {
+          if(bench_static_render_value(ops, list->v.items[i], outbuf) == -1) {
+              return -1;
+          }
+      } else if(tns_render_value(ops, list->v.items[i], outbuf) == -1) {
+          return -1;
+      }
+  }
+  return 0;
+}
+
+
+static int bench_render_dict(const tns_ops *ops, void *val,
+                             tns_outbuf *outbuf)
+{
+  //  Keys and values alternate, so going backwards renders each
+  //  value before its key, just as the core expects.
+  return bench_render_list(ops, val, outbuf);
+}
+
+
+//  The loops specialized to the bench ops.  The sized ops are still looked
+//  up in the struct, so that -n works with -S.  They're given external
+//  linkage only so that the unused bench_static_parse_payload is no bother.
+#define TNS_FUNC(name) bench_static_##name
+#define TNS_OP(ops, name) bench_##name
+#define TNS_HAS_OP(ops, name) ((ops)->name != NULL)
+#define TNS_SCOPE
+#include "tns_core_tmpl.h"
+
+
+//  Like tns_render_hint, but with the specialized render loop.
+static char* bench_static_render(const tns_ops *ops, void *val, size_t *len,
+                                 tns_outbuf_hint *hint)
+{
+  tns_outbuf outbuf;
+
+  if(tns_outbuf_init_hint(&outbuf, hint) == -1) {
+      return NULL;
+  }
+  if(bench_static_render_value(ops, val, &outbuf) == -1) {
+      tns_outbuf_free(&outbuf);
+      return NULL;
+  }
+  if(hint != NULL) {
+      tns_outbuf_hint_update(hint, &outbuf);
+  }
+  return tns_outbuf_finalize(&outbuf, len);
+}
+
+
+static void bench_init_ops(tns_ops *ops, int sized)
+{
+  memset(ops, 0, sizeof(tns_ops));
+  ops->get_type = &bench_get_type;
+  ops->parse_string = &bench_parse_string;
+  ops->parse_integer = &bench_parse_integer;
+  ops->parse_float = &bench_parse_float;
+  ops->get_null = &bench_get_null;
+  ops->get_true = &bench_get_true;
+  ops->get_false = &bench_get_false;
+  ops->render_string = &bench_render_string;
+  ops->render_integer = &bench_render_integer;
+  ops->render_float = &bench_render_float;
+  ops->render_bool = &bench_render_bool;
+  ops->new_list = &bench_new_list;
+  ops->add_to_list = &bench_add_to_list;
+  ops->render_list = &bench_render_list;
+  ops->new_dict = &bench_new_dict;
+  ops->add_to_dict = &bench_add_to_dict;
+  ops->render_dict = &bench_render_dict;
+  if(sized) {
+      ops->new_list_sized = &bench_new_list_sized;
+      ops->new_dict_sized = &bench_new_dict_sized;
+  }
+  ops->free_value = &bench_free_value;
+}
+
+
+//  Generators for the values in each benchmark case.
+//  These abort on allocation failure, since there's nothing to measure.
+
+static void* bench_xmalloc(size_t size)
+{
+  void *ptr = malloc(size > 0 ? size : 1);
+
+  if(ptr == NULL) {
+      fprintf(stderr, "bench_core: out of memory\n");
+      exit(1);
+  }
+  return ptr;
+}
+
+
+static bench_value* bench_gen_string(unsigned long long *rng, size_t len)
+{
+  bench_value *val = bench_new(tns_tag_string);
+  char *s = bench_xmalloc(len);
+  size_t i;
+
+  for(i = 0; i < len; i++) {
+      s[i] = (char)(' ' + bench_rand(rng) % 95);
+  }
+  val->v.s = s;
+  val->len = len;
+  val->owned = 1;
+  return val;
+}
+
+
+//  Integers with up to 'digits' digits, and either sign.
+static bench_value* bench_gen_integer(unsigned long long *rng, size_t digits)
+{
+  bench_value *val = bench_new(tns_tag_integer);
+  long long limit = 1;
+  size_t i;
+
+  for(i = 0; i < digits && i < 18; i++) {
+      limit *= 10;
+  }
+  val->v.i = (long long)(bench_rand(rng) % limit);
+  if(bench_rand(rng) & 1) {
+      val->v.i = -val->v.i;
+  }
+  return val;
+}
+
+
+static bench_value* bench_gen_float(unsigned long long *rng, size_t unused)
+{
+  bench_value *val = bench_new(tns_tag_float);
+
+  val->v.f = (double)(long long)bench_rand(rng) / (1 << 20);
+  return val;
+}
+
+
+static bench_value* bench_gen_bool(unsigned long long *rng, size_t unused)
+{
+  return (bench_rand(rng) & 1) ? &bench_true : &bench_false;
+}
+
+
+static bench_value* bench_gen_null(unsigned long long *rng, size_t unused)
+{
+  return &bench_null;
+}
+
+
+//  A mix of small scalars, as found in the items of typical containers.
+static bench_value* bench_gen_scalar(unsigned long long *rng)
+{
+  switch(bench_rand(rng) % 5) {
+    case 0:
+      return bench_gen_integer(rng, 6);
+    case 1:
+      return bench_gen_float(rng, 0);
+    case 2:
+      return bench_gen_bool(rng, 0);
+    case 3:
+      return bench_gen_null(rng, 0);
+    default:
+      return bench_gen_string(rng, 1 + bench_rand(rng) % 16);
+  }
+}
+
+
+static bench_value* bench_gen_list(unsigned long long *rng, size_t size)
+{
+  bench_value *val = bench_new_container(tns_tag_list, size);
+  size_t i;
+
+  for(i = 0; i < size; i++) {
+      val->v.items[val->len++] = bench_gen_scalar(rng);
+  }
+  return val;
+}
+
+
+static bench_value* bench_gen_dict(unsigned long long *rng, size_t size)
+{
+  bench_value *val = bench_new_container(tns_tag_dict, size * 2);
+  size_t i;
+
+  for(i = 0; i < size; i++) {
+      val->v.items[val->len++] = bench_gen_string(rng, 4 + bench_rand(rng) % 9);
+      val->v.items[val->len++] = bench_gen_scalar(rng);
+  }
+  return val;
+}
+
+
+static bench_case bench_cases[] = {
+    {"string", "8", &bench_gen_string, 8},
+    {"string", "64", &bench_gen_string, 64},
+    {"string", "1k", &bench_gen_string, 1024},
+    {"string", "64k", &bench_gen_string, 65536},
+    {"int", "small", &bench_gen_integer, 3},
+    {"int", "large", &bench_gen_integer, 18},
+    {"float", "-", &bench_gen_float, 0},
+    {"bool", "-", &bench_gen_bool, 0},
+    {"null", "-", &bench_gen_null, 0},
+    {"list", "8", &bench_gen_list, 8},
+    {"list", "64", &bench_gen_list, 64},
+    {"list", "1k", &bench_gen_list, 1024},
+    {"dict", "8", &bench_gen_dict, 8},
+    {"dict", "64", &bench_gen_dict, 64},
+    {"dict", "1k", &bench_gen_dict, 1024},
+    {NULL, NULL, NULL, 0}
+};
+
+
+static size_t bench_count_nodes(bench_value *val)
+{
+  size_t count = 1;
+  size_t i;
+
+  if(val->type == tns_tag_list || val->type == tns_tag_dict) {
+      for(i = 0; i < val->len; i++) {
+          count += bench_count_nodes(val->v.items[i]);
+      }
+  }
+  return count;
+}
+
+
+//  The data for one case: the encoded batch, and the values it decodes to.
+struct bench_batch_s {
+  char *data[BENCH_BATCH];
+  size_t len[BENCH_BATCH];
+  bench_value *values[BENCH_BATCH];
+  size_t bytes;
+  size_t nodes;
+};
+typedef struct bench_batch_s bench_batch;
+
+
+static void bench_batch_init(bench_batch *batch, const bench_case *bc,
+                             unsigned long long seed)
+{
+  unsigned long long rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+  size_t i;
+
+  batch->bytes = 0;
+  batch->nodes = 0;
+  for(i = 0; i < BENCH_BATCH; i++) {
+      batch->values[i] = bc->generate(&rng, bc->param);
+      batch->data[i] = tns_render(&bench_ops, batch->values[i], &batch->len[i]);
+      if(batch->data[i] == NULL) {
+          fprintf(stderr, "bench_core: failed to render %s/%s\n",
+                  bc->type, bc->size);
+          exit(1);
+      }
+      batch->bytes += batch->len[i];
+      batch->nodes += bench_count_nodes(batch->values[i]);
+  }
+}
+
+
+static void bench_batch_free(bench_batch *batch)
+{
+  size_t i;
+
+  for(i = 0; i < BENCH_BATCH; i++) {
+      bench_free_value(&bench_ops, batch->values[i]);
+      free(batch->data[i]);
+  }
+}
+
+
+//  The timed loops.  Each returns the elapsed time for 'iters' passes
+//  over the batch, and fails loudly if the core reports an error.
+
+static double bench_run_parse(bench_batch *batch, size_t iters)
+{
+  double start = bench_now();
+  void *val = NULL;
+  size_t n, i;
+
+  for(n = 0; n < iters; n++) {
+      for(i = 0; i < BENCH_BATCH; i++) {
+          if(bench_static) {
+              val = bench_static_parse(&bench_ops, batch->data[i],
+                                       batch->len[i], NULL);
+          } else {
+              val = tns_parse(&bench_ops, batch->data[i], batch->len[i], NULL);
+          }
+          if(val == NULL) {
+              fprintf(stderr, "bench_core: parse failed\n");
+              exit(1);
+          }
+          bench_free_value(&bench_ops, val);
+      }
+  }
+  return bench_now() - start;
+}
+
+
+static double bench_run_render(bench_batch *batch, size_t iters)
+{
+  double start = bench_now();
+  tns_outbuf_hint hint = {0, 0, 0};
+  char *out = NULL;
+  size_t n, i, len;
+
+  for(n = 0; n < iters; n++) {
+      for(i = 0; i < BENCH_BATCH; i++) {
+          if(bench_static) {
+              out = bench_static_render(&bench_ops, batch->values[i], &len,
+                                        bench_hint ? &hint : NULL);
+          } else {
+              out = tns_render_hint(&bench_ops, batch->values[i], &len,
+                                    bench_hint ? &hint : NULL);
+          }
+          if(out == NULL) {
+              fprintf(stderr, "bench_core: render failed\n");
+              exit(1);
+          }
+          free(out);
+      }
+  }
+  return bench_now() - start;
+}
+
+
+static void bench_report(const char *op, const bench_case *bc,
+                         bench_batch *batch,
+                         double (*run)(bench_batch *batch, size_t iters))
+{
+  size_t iters = 1;
+  double elapsed = 0;
+  double best = 0;
+  double ops;
+  int r;
+
+  //  Double the iterations until a single repeat takes long enough.
+  while((elapsed = run(batch, iters)) < bench_min_time) {
+      iters *= 2;
+  }
+  best = elapsed;
+  if(bench_perf) {
+      //  Count over fresh repeats, so the calibration runs aren't included.
+      bench_perf_reset();
+      best = -1;
+      for(r = 0; r < bench_repeats; r++) {
+          bench_perf_start();
+          elapsed = run(batch, iters);
+          bench_perf_stop();
+          if(best < 0 || elapsed < best) {
+              best = elapsed;
+          }
+      }
+  } else {
+      for(r = 1; r < bench_repeats; r++) {
+          elapsed = run(batch, iters);
+          if(elapsed < best) {
+              best = elapsed;
+          }
+      }
+  }
+
+  ops = (double)iters * BENCH_BATCH;
+  printf("%s\t%s\t%s\t%.1f\t%.1f\t%.2f\t%.0f", op, bc->type, bc->size,
+         (double)batch->bytes / BENCH_BATCH,
+         (double)batch->nodes / BENCH_BATCH,
+         best * 1e9 / ops, batch->bytes * (double)iters / best);
+  if(bench_perf) {
+      bench_perf_print((double)batch->bytes * iters * bench_repeats,
+                       (double)batch->nodes * iters * bench_repeats);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+
+int main(int argc, char **argv)
+{
+  const bench_case *bc = NULL;
+  bench_batch batch;
+  char name[64];
+  int sized = 1;
+  int opt;
+
+  while((opt = getopt(argc, argv, "t:r:s:f:naSp")) != -1) {
+      switch(opt) {
+        case 't':
+          bench_min_time = atof(optarg);
+          break;
+        case 'r':
+          bench_repeats = atoi(optarg) > 0 ? atoi(optarg) : 1;
+          break;
+        case 's':
+          bench_seed = strtoull(optarg, NULL, 10);
+          break;
+        case 'f':
+          bench_filter = optarg;
+          break;
+        case 'n':
+          sized = 0;
+          break;
+        case 'a':
+          bench_hint = 1;
+          break;
+        case 'S':
+          bench_static = 1;
+          break;
+        case 'p':
+          bench_perf = 1;
+          break;
+        default:
+          fprintf(stderr, "usage: %s [-t secs] [-r repeats] [-s seed] "
+                          "[-f filter] [-n] [-a] [-S] [-p]\n", argv[0]);
+          return 2;
+      }
+  }
+  bench_init_ops(&bench_ops, sized);
+  if(bench_perf && bench_perf_open() == 0) {
+      fprintf(stderr, "bench_core: no counters available\n");
+      return 1;
+  }
+
+  printf("# bench_core seed=%llu batch=%d min_time=%g repeats=%d sized=%d "
+         "hint=%d static=%d\n", bench_seed, BENCH_BATCH, bench_min_time,
+         bench_repeats, sized, bench_hint, bench_static);
+  printf("op\ttype\tsize\tbytes_per_op\tnodes_per_op\tns_per_op\t"
+         "bytes_per_sec");
+  if(bench_perf) {
+      bench_perf_header();
+  }
+  printf("\n");
+
+  for(bc = bench_cases; bc->type != NULL; bc++) {
+      snprintf(name, sizeof(name), "%s/%s", bc->type, bc->size);
+      if(bench_filter != NULL && strstr(name, bench_filter) == NULL) {
+          continue;
+      }
+      //  Every case gets its own stream, so filtering doesn't change data.
+      bench_batch_init(&batch, bc, bench_seed + (bc - bench_cases));
+      bench_report("parse", bc, &batch, &bench_run_parse);
+      bench_report("render", bc, &batch, &bench_run_render);
+      bench_batch_free(&batch);
+  }
+
+  return 0;
+}
@@ -0,0 +1,184 @@
+"""
+bench_latency.py:  measure the latency distribution of individual calls
+
+shootout.py reports the best of several timeit runs, which is the right
+way to compare throughput but hides the slow calls: outbuf doubling at
+size thresholds, a garbage collection pass landing on a big tree, etc.
+This times every single call to loads(), dumps() and load() over a corpus
+shaped like Mongrel2 traffic, and reports percentiles for each op, both
+overall and broken down by message size.
+
+Latencies are recorded in a log-linear histogram in the style of HDR
+histogram: each power of two is split into 32 linear sub-buckets, so
+every recorded value is accurate to within about 3%, whatever its size.
+Calls are timed with time.time(), so on most platforms the results are
+only good to about a microsecond.
+
+The default corpus is a mix of request headers, as sent by Mongrel2, and
+handler replies with bodies ranging from nothing to a few hundred kilobytes.
+Use --corpus to read one written by corpus.py instead.
+
+Usage:
+
+    python tools/bench_latency.py [-n count] [-r rounds] [-s seed]
+                                  [-o loads,dumps,load] [--no-gc]
+                                  [--corpus FILE]
+
+Output is one tab-separated line per op and message size bucket, with
+the latencies in microseconds:
+
+    op  size  calls  p50  p90  p99  p99.9  max
+
+"""
+
+import gc
+import sys
+import time
+import optparse
+import cStringIO
+
+import tnetstring
+
+import corpus
+
+
+class Histogram(object):
+    """Log-linear histogram of non-negative integer values."""
+
+    SUB_BITS = 5
+
+    def __init__(self):
+        self.counts = {}
+        self.total = 0
+        self.max = 0
+
+    def record(self,value):
+        value = int(value)
+        if value < (2 << self.SUB_BITS):
+            key = value
+        else:
+            shift = value.bit_length() - self.SUB_BITS - 1
+            key = (shift << self.SUB_BITS) + (value >> shift)
+        self.counts[key] = self.counts.get(key,0) + 1
+        self.total += 1
+        if value > self.max:
+            self.max = value
+
+    def merge(self,other):
+        for (key,count) in other.counts.iteritems():
+            self.counts[key] = self.counts.get(key,0) + count
+        self.total += other.total
+        self.max = max(self.max,other.max)
+
+    def _upper(self,key):
+        """Get the largest value that falls into the given bucket."""
+        if key < (2 << self.SUB_BITS):
+            return key
+        shift = (key >> self.SUB_BITS) - 1
+        top = key - (shift << self.SUB_BITS)
+        return ((top + 1) << shift) - 1
+
+    def percentile(self,p):
+        """Get the value below which p percent of the values fall."""
+        if not self.total:
+            return 0
+        target = max(1,int(round(self.total * p / 100.0)))
+        seen = 0
+        for key in sorted(self.counts):
+            seen += self.counts[key]
+            if seen >= target:
+                return min(self._upper(key),self.max)
+        return self.max
+
+
+def build_corpus(count,seed=7):
+    """Build a list of (object,tnetstring) pairs of requests and replies."""
+    objects = corpus.generate(count,seed,"headers=1,reply=1")
+    return [(obj,tnetstring.dumps(obj)) for obj in objects]
+
+
+def size_bucket(size):
+    """Get a label for the log4 size bucket containing size."""
+    low = 1
+    while low * 4 <= size:
+        low *= 4
+    return "%d-%d" % (low,low * 4 - 1)
+
+
+def run(op,messages,rounds):
+    """Time each call to op; returns a dict of histograms by size bucket."""
+    now = time.time
+    hists = {}
+    for _ in xrange(rounds):
+        for (obj,data) in messages:
+            if op == "loads":
+                t0 = now()
+                tnetstring.loads(data)
+                t1 = now()
+            elif op == "dumps":
+                t0 = now()
+                tnetstring.dumps(obj)
+                t1 = now()
+            else:
+                f = cStringIO.StringIO(data)
+                t0 = now()
+                tnetstring.load(f)
+                t1 = now()
+            bucket = size_bucket(len(data))
+            hist = hists.get(bucket)
+            if hist is None:
+                hist = hists[bucket] = Histogram()
+            hist.record((t1 - t0) * 1e9)
+    return hists
+
+
+def report(op,size,hist):
+    stats = [hist.percentile(p) / 1000.0 for p in (50,90,99,99.9)]
+    print "%s\t%s\t%d\t%s\t%.1f" % (op,size,hist.total,
+          "\t".join("%.1f" % (s,) for s in stats),hist.max / 1000.0)
+
+
+def main(argv):
+    parser = optparse.OptionParser()
+    parser.add_option("-n","--count",type="int",default=2000,
+                      help="number of messages in the corpus")
+    parser.add_option("-r","--rounds",type="int",default=10,
+                      help="number of passes over the corpus")
+    parser.add_option("-s","--seed",type="int",default=7,
+                      help="random seed for the corpus")
+    parser.add_option("-o","--ops",default="loads,dumps,load",
+                      help="comma-separated operations to run")
+    parser.add_option("--no-gc",action="store_true",default=False,
+                      help="disable the cyclic garbage collector")
+    parser.add_option("--corpus",default=None,
+                      help="read the corpus from a file made by corpus.py")
+    (opts,args) = parser.parse_args(argv[1:])
+    for op in opts.ops.split(","):
+        if op not in ("loads","dumps","load"):
+            parser.error("unknown op: " + op)
+
+    if opts.corpus is not None:
+        messages = [(tnetstring.loads(data),data)
+                    for data in corpus.load_corpus(opts.corpus)]
+        source = opts.corpus
+    else:
+        messages = build_corpus(opts.count,opts.seed)
+        source = "seed=%d" % (opts.seed,)
+    if opts.no_gc:
+        gc.disable()
+    print "# bench_latency corpus=%s count=%d rounds=%d gc=%d" % (
+          source,len(messages),opts.rounds,gc.isenabled())
+    print "op\tsize\tcalls\tp50\tp90\tp99\tp99.9\tmax"
+    for op in opts.ops.split(","):
+        hists = run(op,messages,opts.rounds)
+        total = Histogram()
+        for hist in hists.itervalues():
+            total.merge(hist)
+        report(op,"all",total)
+        for size in sorted(hists,key=lambda s: int(s.split("-")[0])):
+            report(op,size,hists[size])
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main(sys.argv)
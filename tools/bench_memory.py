@@ -0,0 +1,170 @@
+"""
+bench_memory.py:  measure the memory cost of loading and dumping messages
+
+Memory per message is what limits how big a batch we can hold at once, so
+this decodes (or encodes) a whole corpus while keeping every result alive,
+and reports the memory cost of doing so:
+
+    :rss_per_msg:      growth in peak resident memory, per message
+    :retained_per_msg: deep sys.getsizeof() of the results, per message
+    :outbuf_per_msg:   bytes malloced for output buffers by the C core,
+                       per message; only when built with TNETSTRING_STATS=1
+
+Python 2 has no tracemalloc, and pymalloc can't be hooked from outside,
+so the python side is measured by peak RSS and by the size of what's left
+behind; the core's own allocations are counted by the TNS_STATS hooks.
+
+Each implementation is run in a fresh interpreter so that their peaks
+don't mask each other.  It compares the C extension and the pure-python
+fallback, each with the bytes API and with the unicode API (-e encoding).
+The corpus is random objects from the test suite, or a file written by
+corpus.py if given with --corpus.
+
+Usage:
+
+    python tools/bench_memory.py [-n count] [-e encoding] [-o loads,dumps]
+                                 [--corpus FILE]
+
+Output is one tab-separated line per implementation, api and op:
+
+    impl  api  op  messages  bytes_per_msg  rss_per_msg  retained_per_msg
+    outbuf_per_msg
+
+"""
+
+import os
+import sys
+import random
+import optparse
+import resource
+import subprocess
+
+
+def build_inputs(op,count,encoding=None,seed=7):
+    """Build the list of inputs for op, from a fixed random seed.
+
+    Only the inputs are kept, and they're generated one at a time, so that
+    the corpus doesn't leave a pile of freed memory for the op to reuse.
+    """
+    import tnetstring
+    from tnetstring.tests.test_format import get_random_object
+    r = random.Random(seed)
+    unicode = encoding is not None
+    if op == "loads":
+        return [tnetstring.dumps(get_random_object(r,0,unicode),encoding)
+                for _ in xrange(count)]
+    return [get_random_object(r,0,unicode) for _ in xrange(count)]
+
+
+def load_inputs(op,filename,encoding=None):
+    """Load the list of inputs for op from a corpus file."""
+    import tnetstring
+    import corpus
+    messages = corpus.load_corpus(filename)
+    if op == "loads":
+        return messages
+    #  Pop each message as it's parsed, so they aren't all held at once.
+    #  Popping from the end is O(1), where popping from the front is O(n).
+    messages.reverse()
+    return [tnetstring.loads(messages.pop(),encoding)
+            for _ in xrange(len(messages))]
+
+
+def deep_sizeof(value,seen=None):
+    """Get the total size of a python object and everything it contains."""
+    if seen is None:
+        seen = set()
+    if id(value) in seen:
+        return 0
+    seen.add(id(value))
+    size = sys.getsizeof(value)
+    if isinstance(value,dict):
+        for (k,v) in value.iteritems():
+            size += deep_sizeof(k,seen) + deep_sizeof(v,seen)
+    elif isinstance(value,(list,tuple)):
+        for item in value:
+            size += deep_sizeof(item,seen)
+    return size
+
+
+def peak_rss():
+    """Get the peak resident memory of this process, in bytes."""
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    #  Linux reports kilobytes, but OSX reports bytes.
+    if sys.platform != "darwin":
+        peak *= 1024
+    return peak
+
+
+def measure(impl,op,count,encoding,filename=None):
+    """Run a single measurement in this process; returns a result line."""
+    if impl == "python":
+        sys.modules["_tnetstring"] = None
+    import tnetstring
+    try:
+        import _tnetstring
+        stats = _tnetstring.stats
+    except ImportError:
+        stats = None
+    if filename is None:
+        inputs = build_inputs(op,count,encoding)
+    else:
+        inputs = load_inputs(op,filename,encoding)
+        count = len(inputs)
+    if op == "loads":
+        func = tnetstring.loads
+        nbytes = sum(len(data) for data in inputs)
+    else:
+        func = tnetstring.dumps
+        nbytes = sum(len(func(obj,encoding)) for obj in inputs)
+    if stats is not None:
+        stats(reset=True)
+    base = peak_rss()
+    results = [func(x,encoding) for x in inputs]
+    rss = peak_rss() - base
+    outbuf = "-"
+    if stats is not None and stats()["enabled"]:
+        outbuf = "%.1f" % (stats()["outbuf_alloc_bytes"] / float(count),)
+    retained = deep_sizeof(results) - sys.getsizeof(results)
+    api = "bytes" if encoding is None else "unicode"
+    return "%s\t%s\t%s\t%d\t%.1f\t%.1f\t%.1f\t%s" % (impl,api,op,count,
+           nbytes / float(count),rss / float(count),retained / float(count),
+           outbuf)
+
+
+def main(argv):
+    parser = optparse.OptionParser()
+    parser.add_option("-n","--count",type="int",default=20000,
+                      help="number of messages in the corpus")
+    parser.add_option("-e","--encoding",default="utf8",
+                      help="encoding to use for the unicode api; use latin1 "
+                           "with a corpus that has binary strings")
+    parser.add_option("-o","--ops",default="loads,dumps",
+                      help="comma-separated operations to run")
+    parser.add_option("--corpus",default=None,
+                      help="read the corpus from a file made by corpus.py")
+    parser.add_option("--child",default=None,help=optparse.SUPPRESS_HELP)
+    (opts,args) = parser.parse_args(argv[1:])
+    if opts.child is not None:
+        (impl,op,encoding) = opts.child.split(",")
+        print measure(impl,op,opts.count,encoding or None,opts.corpus)
+        return
+
+    print "# bench_memory corpus=%s count=%d encoding=%s" % (opts.corpus,
+          opts.count,opts.encoding)
+    print "impl\tapi\top\tmessages\tbytes_per_msg\trss_per_msg\t" \
+          "retained_per_msg\toutbuf_per_msg"
+    for impl in ("c","python"):
+        for encoding in ("",opts.encoding):
+            for op in opts.ops.split(","):
+                child = "%s,%s,%s" % (impl,op,encoding)
+                cmd = [sys.executable,os.path.abspath(__file__),
+                       "-n",str(opts.count),"--child",child]
+                if opts.corpus is not None:
+                    cmd.extend(("--corpus",opts.corpus))
+                sys.stdout.write(subprocess.check_output(cmd))
+                sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main(sys.argv)
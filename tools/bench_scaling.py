@@ -0,0 +1,178 @@
+"""
+bench_scaling.py:  measure how tnetstring throughput scales across cores
+
+This runs loads() and dumps() flat out from N worker threads and from N
+worker processes, for increasing N, and reports the aggregate throughput
+along with the scaling efficiency relative to a single worker.  Any shared
+state that workers contend on (the cached encoding ops, the dumps() size
+hint, the allocator) shows up as efficiency falling away from 1.0.
+The corpus is random objects from the test suite, or a file written by
+corpus.py if given with --corpus.
+
+The C extension holds the GIL for the whole of each call, since it builds
+python objects as it goes, so threads can't scale past one core and are
+expected to show an efficiency of roughly 1/N.  The thread results are
+there to measure the cost of GIL handoff between workers; processes show
+what the library itself can do.  The loads_async op waits on the result of
+loads_async() instead, which parses on native threads and only takes the
+GIL to build the python objects, so its threads should do better.
+
+Usage:
+
+    python tools/bench_scaling.py [-w 1,2,4,8] [-t secs] [-o loads,dumps]
+                                  [-m threads,processes] [-e encoding]
+                                  [--corpus FILE]
+
+Output is one tab-separated line per mode, op and worker count:
+
+    mode  op  workers  ops_per_sec  mb_per_sec  efficiency
+
+"""
+
+import sys
+import time
+import random
+import optparse
+import threading
+import multiprocessing
+
+import tnetstring
+from tnetstring.tests.test_format import FORMAT_EXAMPLES, get_random_object
+
+import corpus
+
+
+def build_corpus(encoding=None,seed=7,count=200):
+    """Build a list of (object,tnetstring) pairs to work through."""
+    r = random.Random(seed)
+    objects = FORMAT_EXAMPLES.values()
+    for _ in xrange(count):
+        objects.append(get_random_object(r,unicode=encoding is not None))
+    return [(o,tnetstring.dumps(o,encoding)) for o in objects]
+
+
+def load_corpus(filename,encoding=None):
+    """Load a list of (object,tnetstring) pairs from a corpus file."""
+    objects = [tnetstring.loads(data,encoding)
+               for data in corpus.load_corpus(filename)]
+    return [(o,tnetstring.dumps(o,encoding)) for o in objects]
+
+
+def run_worker(op,messages,encoding,start,duration):
+    """Run op over the messages until duration has passed.
+
+    Returns a tuple giving the number of calls made and the number of
+    bytes they loaded or dumped.  The clock starts when 'start' is set.
+    """
+    if op == "loads":
+        items = [(tnetstring.loads,data,len(data)) for (_,data) in messages]
+    elif op == "loads_async":
+        items = [(_loads_async,data,len(data)) for (_,data) in messages]
+    else:
+        items = [(tnetstring.dumps,obj,len(data)) for (obj,data) in messages]
+    start.wait()
+    deadline = time.time() + duration
+    calls = nbytes = 0
+    while time.time() < deadline:
+        for (func,arg,size) in items:
+            func(arg,encoding)
+        calls += len(items)
+        nbytes += sum(item[2] for item in items)
+    return (calls,nbytes)
+
+
+def _loads_async(data,encoding):
+    return tnetstring.loads_async(data,encoding).result()
+
+
+def _process_main(queue,op,messages,encoding,start,duration):
+    queue.put(run_worker(op,messages,encoding,start,duration))
+
+
+def run_threads(nworkers,op,messages,encoding,duration):
+    results = []
+    start = threading.Event()
+    def target():
+        results.append(run_worker(op,messages,encoding,start,duration))
+    workers = [threading.Thread(target=target) for _ in xrange(nworkers)]
+    for w in workers:
+        w.start()
+    start.set()
+    for w in workers:
+        w.join()
+    return results
+
+
+def run_processes(nworkers,op,messages,encoding,duration):
+    queue = multiprocessing.Queue()
+    start = multiprocessing.Event()
+    args = (queue,op,messages,encoding,start,duration)
+    workers = [multiprocessing.Process(target=_process_main,args=args)
+               for _ in xrange(nworkers)]
+    for w in workers:
+        w.start()
+    start.set()
+    results = [queue.get() for _ in workers]
+    for w in workers:
+        w.join()
+    return results
+
+
+MODES = {"threads": run_threads, "processes": run_processes}
+
+
+def main(argv):
+    parser = optparse.OptionParser()
+    parser.add_option("-w","--workers",default="1,2,4,8",
+                      help="comma-separated worker counts to run")
+    parser.add_option("-t","--time",type="float",default=2.0,
+                      help="seconds to run each configuration")
+    parser.add_option("-o","--ops",default="loads,dumps",
+                      help="comma-separated operations to run, from "
+                           "loads, dumps and loads_async")
+    parser.add_option("-m","--modes",default="threads,processes",
+                      help="comma-separated modes to run")
+    parser.add_option("-e","--encoding",default=None,
+                      help="load and dump unicode with this encoding")
+    parser.add_option("--corpus",default=None,
+                      help="read the corpus from a file made by corpus.py")
+    (opts,args) = parser.parse_args(argv[1:])
+    counts = [int(n) for n in opts.workers.split(",")]
+    for mode in opts.modes.split(","):
+        if mode not in MODES:
+            parser.error("unknown mode: " + mode)
+    for op in opts.ops.split(","):
+        if op not in ("loads","dumps","loads_async"):
+            parser.error("unknown op: " + op)
+
+    if opts.corpus is not None:
+        messages = load_corpus(opts.corpus,opts.encoding)
+    else:
+        messages = build_corpus(opts.encoding)
+    try:
+        import _tnetstring
+    except ImportError:
+        impl = "python"
+    else:
+        impl = "c" if tnetstring.loads is _tnetstring.loads else "python"
+    print "# bench_scaling impl=%s cpus=%d time=%g encoding=%s corpus=%d" % (
+          impl,multiprocessing.cpu_count(),opts.time,opts.encoding,
+          len(messages))
+    print "mode\top\tworkers\tops_per_sec\tmb_per_sec\tefficiency"
+    for mode in opts.modes.split(","):
+        for op in opts.ops.split(","):
+            base = None
+            for n in counts:
+                results = MODES[mode](n,op,messages,opts.encoding,
+                                      opts.time)
+                calls = sum(r[0] for r in results) / opts.time
+                nbytes = sum(r[1] for r in results) / opts.time
+                if base is None:
+                    base = calls / n
+                print "%s\t%s\t%d\t%.0f\t%.2f\t%.2f" % (mode,op,n,calls,
+                      nbytes / 1e6,calls / (base * n))
+                sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main(sys.argv)
@@ -0,0 +1,920 @@
+//
+//  core_harness.cpp:  check the C++ binding in tns_core.hpp
+//
+//  tns::loads decodes straight into the fields of structs declared with
+//  TNS_FIELDS, so there's no generic value in between to check against.
+//  This decodes a set of hand-built tnetstrings into nested structs, with
+//  optional fields, vectors of values and vectors of structs, and checks
+//  each field that comes out.  It then checks that missing fields, values
+//  of the wrong type and malformed payloads anywhere in the tree make the
+//  decode fail, and that rendering with tns::dumps gives back the input.
+//
+//  The constants built by tns::lit are checked byte for byte against the
+//  output of python's tnetstring.dumps(), at compile time, and spliced
+//  into structs as tns::fixed and tns::raw fields.  With C++20 it also
+//  renders into spans and chains of spans that are exactly big enough or
+//  a byte short, and checks that the iovecs from tns::dumps_iov gather
+//  up to the same bytes as tns::dumps.
+//
+//  Finally it navigates a document with tns::cursor, in memory and in a
+//  tns::mapped_file, including keys and items that aren't there and files
+//  that are empty or truncated.  The same document is parsed with the
+//  functions of tns_dom.h, into arenas and arrays that are big enough or
+//  a node short, and with tns::document, which must only take room for
+//  the value it parses.  Numbers are decoded from nodes at their limits.
+//
+//  Build it from the top of the source tree with something like:
+//
+//    cc -O2 -c -o tns_dom.o tnetstring/tns_dom.c
+//    c++ -O2 -std=c++20 -Itnetstring -o core_harness tools/core_harness.cpp tns_dom.o
+//
+//  It prints a summary line and exits with status 0 if everything passed.
+//
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "tns_core.hpp"
+
+
+struct point {
+  int64_t x;
+  double y;
+};
+TNS_FIELDS(point, x, y)
+
+struct shape {
+  std::string name;
+  std::vector<point> points;
+  std::optional<point> origin;
+  std::optional<std::string_view> label;
+  std::vector<std::vector<int>> grid;
+  bool closed;
+};
+TNS_FIELDS(shape, name, points, origin, label, grid, closed)
+
+struct small {
+  int8_t i;
+  uint16_t u;
+};
+TNS_FIELDS(small, i, u)
+
+
+static size_t checks = 0;
+static size_t failures = 0;
+
+static void expect(bool ok, const char *what)
+{
+  checks++;
+  if(!ok) {
+      fprintf(stderr, "core_harness: %s\n", what);
+      failures++;
+  }
+}
+
+
+//  Frame a payload as a tnetstring, so the inputs below don't need their
+//  length prefixes counted by hand.
+static std::string tn(std::string_view payload, char tag)
+{
+  return std::to_string(payload.size()) + ":" + std::string(payload) + tag;
+}
+
+static std::string str(std::string_view s) { return tn(s, ','); }
+
+template<class... Items>
+static std::string items(const Items&... items)
+{
+  return (std::string() + ... + items);
+}
+
+static std::string point_dict(std::string_view x, std::string_view y)
+{
+  return tn(items(str("x"), tn(x, '#'), str("y"), tn(y, '^')), '}');
+}
+
+
+//  A shape with every field given, from which the others are derived by
+//  replacing one field at a time.
+static std::string shape_dict(std::string name, std::string points,
+                              std::string origin, std::string label,
+                              std::string grid, std::string closed)
+{
+  std::string payload;
+
+  for(auto [key, value] : {std::pair{"name", &name},
+                           std::pair{"points", &points},
+                           std::pair{"origin", &origin},
+                           std::pair{"label", &label},
+                           std::pair{"grid", &grid},
+                           std::pair{"closed", &closed}}) {
+      if(!value->empty()) {
+          payload += str(key) + *value;
+      }
+  }
+  return tn(payload, '}');
+}
+
+static const std::string good_points =
+    tn(point_dict("1", "2.5") + point_dict("-3", "0"), ']');
+static const std::string good_grid =
+    tn(tn(tn("1", '#') + tn("2", '#'), ']') + tn("", ']'), ']');
+
+static std::string good_shape(int skip = -1, const std::string &with = "")
+{
+  std::string f[] = {str("square"), good_points, point_dict("7", "8"),
+                     str("big"), good_grid, tn("true", '!')};
+  if(skip >= 0) {
+      f[skip] = with;
+  }
+  return shape_dict(f[0], f[1], f[2], f[3], f[4], f[5]);
+}
+
+
+static void check_decode()
+{
+  std::string data = good_shape() + "3:abc,";
+  std::string_view rest;
+  shape s;
+
+  expect(tns::loads(data, s, &rest), "good shape failed to decode");
+  expect(rest == "3:abc,", "wrong remainder after the shape");
+  expect(s.name == "square", "wrong name");
+  expect(s.points.size() == 2 && s.points[0].x == 1 &&
+         s.points[0].y == 2.5 && s.points[1].x == -3 &&
+         s.points[1].y == 0.0, "wrong points");
+  expect(s.origin && s.origin->x == 7 && s.origin->y == 8.0,
+         "wrong origin");
+  expect(s.label && *s.label == "big", "wrong label");
+  expect(s.label && s.label->data() >= data.data() &&
+         s.label->data() < data.data() + data.size(),
+         "string_view field doesn't point into the input");
+  expect(s.grid.size() == 2 && s.grid[0] == std::vector<int>{1, 2} &&
+         s.grid[1].empty(), "wrong grid");
+  expect(s.closed, "wrong closed flag");
+  expect(tns::dumps(s) == good_shape(), "dumps doesn't give back the input");
+
+  //  Optional fields may be missing or null, and are reset either way.
+  shape t = s;
+  expect(tns::loads(good_shape(2, ""), t) && !t.origin,
+         "missing optional struct not reset");
+  t = s;
+  expect(tns::loads(good_shape(3, "0:~"), t) && !t.label,
+         "null optional string not reset");
+  t = s;
+  std::string nulled = good_shape(2, "0:~");
+  expect(tns::loads(nulled, t) && !t.origin,
+         "null optional struct not reset");
+  expect(tns::dumps(t) == nulled, "null optional not rendered as null");
+
+  //  Keys that aren't fields are skipped, even if they're malformed.
+  std::string_view whole = data;
+  std::string_view payload;
+  tns_type_tag type;
+  tns::split(whole, type, payload);
+  std::string extra = tn(std::string(payload) + str("junk") + tn("x", '#'),
+                         '}');
+  expect(tns::loads(extra, t) && t.name == "square",
+         "unknown key not skipped");
+
+  //  Integers are accepted for floats, and the C core's leading plus.
+  point p;
+  expect(tns::loads(tn(items(str("x"), tn("+4", '#'), str("y"),
+                             tn("9", '#')), '}'), p) &&
+         p.x == 4 && p.y == 9.0, "integer not accepted as a float");
+}
+
+
+static void check_failures()
+{
+  shape s;
+  small m;
+
+  //  Required fields must be there, including in nested structs.
+  expect(!tns::loads(good_shape(0, ""), s), "missing name accepted");
+  expect(!tns::loads(good_shape(5, ""), s), "missing bool accepted");
+  expect(!tns::loads(good_shape(1, ""), s), "missing vector accepted");
+  expect(!tns::loads(good_shape(2, tn(items(str("x"), tn("1", '#')), '}')),
+                     s), "missing field of optional struct accepted");
+  expect(!tns::loads(good_shape(1, tn(tn(items(str("y"), tn("1.5", '^')),
+                                         '}'), ']')), s),
+         "missing field of struct in vector accepted");
+
+  //  Values of the wrong type, at each level.
+  const std::pair<int, std::string> wrong[] = {
+    {0, tn("5", '#')},                          //  int for string
+    {0, tn("", '~')},                           //  null for required string
+    {1, point_dict("1", "2")},                  //  dict for vector
+    {1, tn(str("a"), ']')},                     //  string in vector of structs
+    {2, tn(str("a"), ']')},                     //  list for struct
+    {2, point_dict("1.5", "2")},                //  float for int
+    {2, point_dict("1", "true")},               //  bad float payload
+    {2, tn(items(str("x"), tn("1", '#'), str("y"), str("2")), '}')},
+    {3, tn("5", '#')},                          //  int for optional string
+    {3, tn("x", '~')},                          //  non-empty null
+    {4, tn(tn(str("1"), ']'), ']')},            //  string in vector<int>
+    {4, tn(tn(tn("", '#'), ']'), ']')},         //  empty integer
+    {4, tn(tn(tn("99999999999", '#'), ']'), ']')},  //  int overflow
+    {5, tn("1", '#')},                          //  int for bool
+    {5, tn("True", '!')},                       //  bad bool payload
+  };
+  for(const auto &[field, value] : wrong) {
+      char what[64];
+      snprintf(what, sizeof(what), "wrong type accepted for field %d",
+               field);
+      expect(!tns::loads(good_shape(field, value), s), what);
+  }
+
+  //  Malformed structure: non-string keys, a key with no value, garbage
+  //  in a vector, and payloads that run past the end of the input.
+  expect(!tns::loads(tn(tn("1", '#') + tn("2", '#'), '}'), m),
+         "integer key accepted");
+  expect(!tns::loads(tn(items(str("i"), tn("1", '#'), str("u")), '}'), m),
+         "key with no value accepted");
+  expect(!tns::loads(good_shape(4, tn("3:1#x", ']')), s),
+         "garbage in a vector accepted");
+  expect(!tns::loads(good_shape().substr(0, 40), s),
+         "truncated input accepted");
+  expect(!tns::loads("", s), "empty input accepted");
+  expect(!tns::loads(tn("", ']'), s), "list accepted as a struct");
+
+  //  Integers must fit the field exactly.
+  auto ints = [](std::string_view i, std::string_view u) {
+    return tn(items(str("i"), tn(i, '#'), str("u"), tn(u, '#')), '}');
+  };
+  expect(tns::loads(ints("-128", "65535"), m) && m.i == -128 &&
+         m.u == 65535, "integer limits not accepted");
+  expect(!tns::loads(ints("128", "0"), m), "int8_t overflow accepted");
+  expect(!tns::loads(ints("0", "-1"), m), "negative unsigned accepted");
+  expect(!tns::loads(ints("0", "65536"), m), "uint16_t overflow accepted");
+  expect(!tns::loads(ints("+-1", "0"), m), "sign after plus accepted");
+  expect(!tns::loads(ints("1 ", "0"), m), "trailing space accepted");
+}
+
+
+//  The tns::lit builders run at compile time, so they're checked with
+//  static_asserts against the output of tnetstring.dumps() in python,
+//  and then against tns::dumps at run time.
+
+namespace lit = tns::lit;
+
+//  A string literal of N copies of a character, for tns::lit::string.
+template<size_t N>
+struct repeated {
+  char s[N + 1];
+};
+
+template<size_t N>
+constexpr repeated<N> repeat(char c)
+{
+  repeated<N> r{};
+
+  for(size_t i = 0; i < N; i++) {
+      r.s[i] = c;
+  }
+  return r;
+}
+
+//  Check that 'v' is 'prefix', then n copies of 'fill', then 'suffix'.
+constexpr bool framed(std::string_view v, std::string_view prefix, char fill,
+                      size_t n, std::string_view suffix)
+{
+  if(v.size() != prefix.size() + n + suffix.size() ||
+     v.substr(0, prefix.size()) != prefix ||
+     v.substr(prefix.size() + n) != suffix) {
+      return false;
+  }
+  for(size_t i = 0; i < n; i++) {
+      if(v[prefix.size() + i] != fill) {
+          return false;
+      }
+  }
+  return true;
+}
+
+constexpr auto x6 = repeat<6>('x');
+constexpr auto x7 = repeat<7>('x');
+constexpr auto x9 = repeat<9>('x');
+constexpr auto x10 = repeat<10>('x');
+constexpr auto x95 = repeat<95>('x');
+constexpr auto x96 = repeat<96>('x');
+constexpr auto x99 = repeat<99>('x');
+constexpr auto x100 = repeat<100>('x');
+
+//  Length prefixes either side of each extra digit, for strings and for
+//  lists whose payload is that long.
+static_assert(lit::string("").view() == "0:,");
+static_assert(lit::string(x9.s).view() == "9:xxxxxxxxx,");
+static_assert(lit::string(x10.s).view() == "10:xxxxxxxxxx,");
+static_assert(framed(lit::string(x99.s).view(), "99:", 'x', 99, ","));
+static_assert(framed(lit::string(x100.s).view(), "100:", 'x', 100, ","));
+static_assert(lit::list(lit::string(x6.s)).view() == "9:6:xxxxxx,]");
+static_assert(lit::list(lit::string(x7.s)).view() == "10:7:xxxxxxx,]");
+static_assert(framed(lit::list(lit::string(x95.s)).view(), "99:95:", 'x', 95,
+                     ",]"));
+static_assert(framed(lit::list(lit::string(x96.s)).view(), "100:96:", 'x',
+                     96, ",]"));
+static_assert(lit::list().view() == "0:]");
+static_assert(lit::dict().view() == "0:}");
+
+//  Integers, including both ends of long long.
+static_assert(lit::integer<0>().view() == "1:0#");
+static_assert(lit::integer<-7>().view() == "2:-7#");
+static_assert(lit::integer<-10>().view() == "3:-10#");
+static_assert(lit::integer<1234567890>().view() == "10:1234567890#");
+static_assert(lit::integer<INT64_MAX>().view() == "19:9223372036854775807#");
+static_assert(lit::integer<INT64_MIN>().view() ==
+              "20:-9223372036854775808#");
+
+//  The other constants, and nested containers.
+static_assert(lit::boolean<true>().view() == "4:true!");
+static_assert(lit::boolean<false>().view() == "5:false!");
+static_assert(lit::null().view() == "0:~");
+static_assert(lit::list(lit::integer<1>(),
+                        lit::dict(lit::string("a"), lit::list()),
+                        lit::null(), lit::boolean<true>(),
+                        lit::string("xy")).view() ==
+              "29:1:1#7:1:a,0:]}0:~4:true!2:xy,]");
+static_assert(lit::dict(lit::string("k"),
+                        lit::list(lit::integer<-12>(),
+                                  lit::dict(lit::string("n"),
+                                            lit::list(lit::boolean<false>()))))
+                  .view() == "33:1:k,25:3:-12#15:1:n,8:5:false!]}]}");
+
+constexpr auto ok_status = lit::dict(
+    lit::string("code"), lit::integer<200>(),
+    lit::string("status"), lit::string("OK"));
+static_assert(ok_status.view() == "27:4:code,3:200#6:status,2:OK,}");
+static_assert(ok_status.size() == sizeof(ok_status.bytes));
+
+//  Pre-encoded fragments spliced into a struct.
+struct reply {
+  std::remove_const_t<decltype(ok_status)> status;
+  tns::raw body;
+  std::vector<tns::raw> parts;
+};
+TNS_FIELDS(reply, status, body, parts)
+
+
+static void check_literals()
+{
+  //  The same values rendered at run time.
+  expect(tns::dumps(std::string(x100.s)) == lit::string(x100.s).view(),
+         "lit::string differs from dumps");
+  expect(tns::dumps(std::vector<std::string>{x95.s}) ==
+         lit::list(lit::string(x95.s)).view(),
+         "lit::list differs from dumps");
+  expect(tns::dumps(std::vector<std::string>{x96.s}) ==
+         lit::list(lit::string(x96.s)).view(),
+         "lit::list differs from dumps");
+  expect(tns::dumps(INT64_MIN) == lit::integer<INT64_MIN>().view(),
+         "lit::integer differs from dumps for INT64_MIN");
+  expect(tns::dumps(-10) == lit::integer<-10>().view(),
+         "lit::integer differs from dumps for -10");
+  expect(tns::dumps(false) == lit::boolean<false>().view(),
+         "lit::boolean differs from dumps");
+  expect(tns::dumps(std::optional<int>()) == lit::null().view(),
+         "lit::null differs from dumps");
+
+  //  Spliced in as is, both as fields and as vector items.
+  constexpr auto body = lit::list(lit::integer<1>(), lit::string("xy"));
+  reply r{ok_status, tns::raw{body.view()},
+          {tns::raw{lit::null().view()}, tns::raw{ok_status.view()}}};
+  std::string out = tns::dumps(r);
+  std::string want = tn(items(str("status"), std::string(ok_status.view()),
+                              str("body"), std::string(body.view()),
+                              str("parts"),
+                              tn(items(std::string("0:~"),
+                                       std::string(ok_status.view())), ']')),
+                        '}');
+  expect(out == want, "fixed and raw fields not spliced in as is");
+  expect(tns::dumps_size(r) == out.size(), "dumps_size wrong for reply");
+
+  //  Decoding into raw takes the whole of each value, prefix and all.
+  std::vector<tns::raw> parts;
+  expect(tns::loads(tn(std::string(body.view()) + "0:~", ']'), parts) &&
+         parts.size() == 2 && parts[0].bytes == body.view() &&
+         parts[1].bytes == "0:~", "raw items not decoded as is");
+}
+
+
+//  A document to navigate with cursors, built by hand so that it can have
+//  things tns::dumps would never write: a non-string key, and a string
+//  value that's the same as a key.
+static std::string cursor_doc()
+{
+  std::string web = tn(items(str("port"), tn("8080", '#'),
+                             str("ratio"), tn("0.5", '^'),
+                             str("hosts"), tn(str("a") + str("bb"), ']')),
+                       '}');
+  return tn(items(str("services"), tn(str("web") + web, '}'),
+                  str("list"), tn(items(tn("1", '#'),
+                                        tn(tn("2", '#') + tn("3", '#'), ']'),
+                                        str("x")), ']'),
+                  tn("5", '#'), str("int key"),
+                  str("alias"), str("list"),
+                  str("n"), tn("", '~')), '}');
+}
+
+
+//  Check cursors over a document in memory.
+static void check_cursors(std::string_view doc)
+{
+  tns::cursor root(doc);
+  int64_t i = 0;
+  double d = 0;
+  std::vector<std::string> hosts;
+
+  expect(bool(root) && root.type() == tns_tag_dict, "root not found");
+
+  //  Lookups by key and position, and decoding the leaves.
+  tns::cursor web = root["services"]["web"];
+  expect(web["port"].get(i) && i == 8080, "wrong port");
+  expect(web["ratio"].get(d) && d == 0.5, "wrong ratio");
+  expect(web["hosts"].get(hosts) &&
+         hosts == std::vector<std::string>{"a", "bb"}, "wrong hosts");
+  expect(root["list"][1][0].get(i) && i == 2, "wrong nested list item");
+  expect(root["list"][2].payload() == "x", "wrong last list item");
+  expect(root["list"][1].encoded().bytes == "8:1:2#1:3#]",
+         "encoded() doesn't cover the whole value");
+  expect(root["alias"].payload() == "list" &&
+         root["list"].type() == tns_tag_list,
+         "key lookup confused a value with a key");
+  expect(root["n"] && root["n"].type() == tns_tag_null, "null not found");
+  expect(!root["n"].get(i), "null decoded as an integer");
+  expect(!web["ratio"].get(hosts), "float decoded as a list");
+
+  //  Things that aren't there, and lookups on a failed cursor.
+  expect(!root["missing"], "missing key found");
+  expect(!root["missing"]["port"] && !root["missing"][0],
+         "lookup on a missing value succeeded");
+  expect(!root["missing"].get(i), "missing value decoded");
+  expect(!root["list"][3] && !root["list"][1][2],
+         "index past the end found");
+  expect(!root["list"]["x"], "key lookup in a list succeeded");
+  expect(!root[0], "index lookup in a dict succeeded");
+  expect(!web["port"][0] && !web["port"]["x"] && !root["n"][0],
+         "lookup in a non-container succeeded");
+  expect(!root["ser"] && !root["services"]["we"],
+         "key prefix matched");
+  expect(!tns::cursor(std::string_view())["x"], "empty cursor valid");
+
+  //  Iteration, as keys and values in alternation.
+  size_t n = 0;
+  for(tns::cursor item : root) {
+      n++;
+      (void)item;
+  }
+  expect(n == 10, "wrong number of dict items iterated");
+  std::string bad = tn(str("a") + "xxx," + str("b"), ']');
+  n = 0;
+  for(tns::cursor item : tns::cursor(bad)) {
+      n++;
+      (void)item;
+  }
+  expect(n == 1, "iteration went on past a malformed item");
+
+  //  The C functions underneath, including where each value ends.
+  tns_cursor c, k;
+  long long ll = 0;
+  expect(tns_cursor_init(&c, doc.data(), doc.size()) == 0 &&
+         std::string_view(doc.data(), c.end - doc.data()) == cursor_doc(),
+         "tns_cursor_init wrong end");
+  expect(tns_cursor_first(&c, &k) == 0 && k.type == tns_tag_string &&
+         std::string_view(k.data, k.len) == "services",
+         "tns_cursor_first wrong");
+  expect(tns_cursor_key(&c, "list", 4, &k) == 0 &&
+         tns_cursor_index(&k, 0, &k) == 0 &&
+         tns_cursor_to_integer(&k, &ll) == 0 && ll == 1,
+         "tns_cursor_index in place wrong");
+  expect(tns_cursor_to_float(&k, &d) == 0 && d == 1.0,
+         "integer not decoded as a float");
+  tns_cursor l;
+  expect(tns_cursor_key(&c, "list", 4, &l) == 0 &&
+         tns_cursor_index(&l, 2, &k) == 0 && tns_cursor_next(&l, &k) == -1,
+         "tns_cursor_next went past the end of its parent");
+  expect(tns_cursor_key(&c, "services", 8, &k) == 0 &&
+         tns_cursor_to_integer(&k, &ll) == -1, "dict decoded as integer");
+  expect(tns_cursor_init(&c, "0:]", 3) == 0 &&
+         tns_cursor_first(&c, &k) == -1 &&
+         tns_cursor_index(&c, 0, &k) == -1, "empty list has an item");
+  expect(tns_cursor_init(&c, "2:1#", 4) == -1, "missing tag accepted");
+}
+
+
+//  A leaf node over a payload, for the decoding functions.
+static tns_node leaf(std::string_view payload, char type)
+{
+  return tns_node{payload.data(), static_cast<uint32_t>(payload.size()), 1,
+                  0, type};
+}
+
+static bool to_integer(std::string_view payload, long long want)
+{
+  tns_node n = leaf(payload, tns_tag_integer);
+  long long val = want + 1;
+
+  return tns_dom_to_integer(&n, &val) == 0 && val == want;
+}
+
+static bool bad_integer(std::string_view payload)
+{
+  tns_node n = leaf(payload, tns_tag_integer);
+  long long val = 12345;
+
+  return tns_dom_to_integer(&n, &val) == -1 && val == 12345;
+}
+
+static bool to_float(std::string_view payload, double want)
+{
+  tns_node n = leaf(payload, tns_tag_float);
+  double val = want + 1;
+
+  return tns_dom_to_float(&n, &val) == 0 && val == want;
+}
+
+static bool bad_float(std::string_view payload)
+{
+  tns_node n = leaf(payload, tns_tag_float);
+  double val = 0.25;
+
+  return tns_dom_to_float(&n, &val) == -1 && val == 0.25;
+}
+
+
+//  Check the C document model directly: parsing into arenas and arrays,
+//  navigating the nodes, and decoding numbers at their limits.
+static void check_dom()
+{
+  std::string doc = cursor_doc();
+  std::string data = doc + "3:abc,";
+  const size_t nodes = 26;
+  tns_arena arena = {nullptr, 0, 0, 0};
+  tns_dom dom;
+  char *rest = nullptr;
+
+  //  An arena sized by tns_dom_parse itself, from the first value only.
+  expect(tns_dom_parse(&dom, &arena, data.data(), data.size(), &rest) == 0 &&
+         dom.count == nodes && rest == data.data() + doc.size(),
+         "tns_dom_parse failed");
+  expect(arena.size == tns_dom_max_nodes(doc.size()) * sizeof(tns_node) &&
+         arena.used == nodes * sizeof(tns_node),
+         "tns_dom_parse sized its arena wrong");
+  expect(dom.nodes[0].type == tns_tag_dict && dom.nodes[0].size == nodes &&
+         dom.nodes[0].count == 10, "wrong root node");
+  tns_arena_free(&arena);
+  expect(tns_dom_value_max_nodes("x", 1) == 1 &&
+         tns_dom_value_max_nodes(data.data(), data.size()) ==
+         tns_dom_max_nodes(doc.size()), "tns_dom_value_max_nodes wrong");
+
+  //  A caller's arena, too small and then with room for a second parse.
+  std::vector<tns_node> buf(2 * nodes);
+  tns_arena_init_static(&arena, buf.data(), (2 * nodes - 1) *
+                        sizeof(tns_node));
+  expect(tns_dom_parse(&dom, &arena, doc.data(), doc.size(), nullptr) == 0 &&
+         tns_dom_parse(&dom, &arena, doc.data(), doc.size(), nullptr) == -1 &&
+         dom.error != nullptr && arena.used == nodes * sizeof(tns_node),
+         "tns_dom_parse overran a static arena");
+  tns_arena_free(&arena);
+  expect(tns_dom_parse(&dom, &arena, "3:abc", 5, nullptr) == -1 &&
+         dom.count == 0 && dom.error != nullptr,
+         "tns_dom_parse accepted a missing tag");
+  tns_arena_free(&arena);
+
+  //  An array of exactly enough nodes, and one too few.
+  expect(tns_dom_parse_into(&dom, buf.data(), nodes, doc.data(), doc.size(),
+                            &rest) == 0 && dom.count == nodes &&
+         rest == doc.data() + doc.size(), "tns_dom_parse_into failed");
+  tns_dom small_dom;
+  expect(tns_dom_parse_into(&small_dom, buf.data() + nodes, nodes - 1,
+                            doc.data(), doc.size(), nullptr) == -1 &&
+         small_dom.error != nullptr, "tns_dom_parse_into overran");
+
+  //  Lookups, on the nodes from the full parse.
+  const tns_node *root = dom.nodes;
+  const tns_node *list = tns_dom_dict_get(root, "list", 4);
+  const tns_node *n;
+  long long val = 0;
+  expect(list != nullptr && list->type == tns_tag_list && list->count == 3,
+         "tns_dom_dict_get didn't find list");
+  n = tns_dom_list_get(tns_dom_list_get(list, 1), 1);
+  expect(n != nullptr && tns_dom_to_integer(n, &val) == 0 && val == 3,
+         "tns_dom_list_get wrong");
+  n = tns_dom_list_get(list, 2);
+  expect(n != nullptr && std::string_view(n->data, n->len) == "x" &&
+         tns_dom_next_sibling(list, n) == nullptr,
+         "wrong last item of list");
+  expect(tns_dom_list_get(list, 3) == nullptr &&
+         tns_dom_list_get(root, 0) == nullptr &&
+         tns_dom_list_get(n, 0) == nullptr,
+         "tns_dom_list_get found something that isn't there");
+  n = tns_dom_dict_get(root, "alias", 5);
+  expect(n != nullptr && std::string_view(n->data, n->len) == "list",
+         "tns_dom_dict_get wrong");
+  expect(tns_dom_dict_get(root, "lis", 3) == nullptr &&
+         tns_dom_dict_get(root, "missing", 7) == nullptr &&
+         tns_dom_dict_get(list, "x", 1) == nullptr &&
+         tns_dom_dict_get(root, "int key", 7) == nullptr,
+         "tns_dom_dict_get found something that isn't there");
+  n = tns_dom_dict_get(tns_dom_dict_get(tns_dom_dict_get(root, "services", 8),
+                                        "web", 3), "port", 4);
+  expect(n != nullptr && tns_dom_to_integer(n, &val) == 0 && val == 8080,
+         "nested tns_dom_dict_get wrong");
+  expect(tns_dom_first_child(tns_dom_dict_get(root, "n", 1)) == nullptr,
+         "null has a child");
+
+  //  Integers, at and past the limits.
+  expect(to_integer("0", 0) && to_integer("-0", 0) && to_integer("+5", 5) &&
+         to_integer("-7", -7), "small integers wrong");
+  expect(to_integer("9223372036854775807", LLONG_MAX) &&
+         to_integer("-9223372036854775808", LLONG_MIN) &&
+         to_integer("+9223372036854775807", LLONG_MAX),
+         "integer limits wrong");
+  expect(bad_integer("9223372036854775808") &&
+         bad_integer("-9223372036854775809") &&
+         bad_integer("99999999999999999999") &&
+         bad_integer("18446744073709551616"), "integer overflow accepted");
+  expect(bad_integer("") && bad_integer("+") && bad_integer("-") &&
+         bad_integer("+-1") && bad_integer("--1") && bad_integer(" 1") &&
+         bad_integer("1 ") && bad_integer("1.0") && bad_integer("0x10"),
+         "malformed integer accepted");
+  tns_node s = leaf("5", tns_tag_string);
+  expect(tns_dom_to_integer(&s, &val) == -1, "string decoded as integer");
+
+  //  Floats, including ones too long for the buffer on the stack.
+  std::string longf = "0." + std::string(70, '0') + "15e72";
+  std::string f63 = "1." + std::string(60, '0') + "5";
+  std::string f64 = "1." + std::string(61, '0') + "5";
+  expect(to_float("1.5", 1.5) && to_float("-2", -2.0) &&
+         to_float("1e3", 1000.0), "floats wrong");
+  expect(f63.size() == 63 && f64.size() == 64 &&
+         to_float(f63, strtod(f63.c_str(), nullptr)) &&
+         to_float(f64, strtod(f64.c_str(), nullptr)) &&
+         to_float(longf, strtod(longf.c_str(), nullptr)),
+         "long floats wrong");
+  expect(bad_float("") && bad_float(" 1.5") && bad_float("\t1") &&
+         bad_float("\n1") && bad_float("1.5 ") && bad_float("1.5x") &&
+         bad_float(" " + longf) && bad_float(longf + "x"),
+         "malformed float accepted");
+  tns_node i = leaf("3", tns_tag_integer);
+  double d = 0;
+  expect(tns_dom_to_float(&i, &d) == 0 && d == 3.0,
+         "integer not decoded as float");
+  expect(tns_dom_to_float(&s, &d) == -1, "string decoded as float");
+}
+
+
+#ifdef TNS_HAVE_PMR
+
+//  Counts the bytes allocated through it.
+struct counting_resource : std::pmr::memory_resource {
+  size_t allocated = 0;
+
+  void *do_allocate(size_t bytes, size_t align) override
+  {
+    allocated += bytes;
+    return std::pmr::new_delete_resource()->allocate(bytes, align);
+  }
+  void do_deallocate(void *p, size_t bytes, size_t align) override
+  {
+    std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+  }
+  bool do_is_equal(const memory_resource &o) const noexcept override
+  {
+    return this == &o;
+  }
+};
+
+
+//  Check that a document only takes room for the value it parses, not
+//  all the data after it.
+static void check_document()
+{
+  std::string doc = cursor_doc();
+  std::string data = doc + std::string(100000, '0');
+  counting_resource mr;
+  tns::document d(&mr);
+  std::string_view rest;
+
+  expect(d.parse(data, &rest) && d.node_count() == 26 &&
+         rest.size() == 100000, "document failed to parse");
+  expect(mr.allocated == tns_dom_max_nodes(doc.size()) * sizeof(tns_node),
+         "document sized for the trailing data");
+  expect(!d.parse(data.substr(doc.size())) && d.error() != nullptr &&
+         mr.allocated == tns_dom_max_nodes(doc.size()) * sizeof(tns_node),
+         "document allocated for garbage");
+  expect(d.parse(data) && d.root()["services"]["web"]["port"],
+         "document not reusable");
+}
+
+#endif  // TNS_HAVE_PMR
+
+
+#ifdef TNS_HAVE_MMAP
+
+//  Write some data to a temporary file, map it, and check that cursors
+//  over the mapping behave as 'ok' says they should.
+static void check_mapped(std::string_view data, bool ok, const char *what)
+{
+  char path[] = "/tmp/core_harness.XXXXXX";
+  int fd = mkstemp(path);
+  bool written = fd != -1 &&
+      write(fd, data.data(), data.size()) == (ssize_t)data.size();
+
+  if(fd != -1) {
+      close(fd);
+  }
+  if(!written) {
+      fprintf(stderr, "core_harness: can't write %s\n", path);
+      failures++;
+      unlink(path);
+      return;
+  }
+  {
+      tns::mapped_file f(path);
+      expect(bool(f) && f.view() == data, what);
+      expect(bool(tns::cursor(f.view())) == ok, what);
+      if(ok) {
+          check_cursors(f.view());
+      }
+  }
+  unlink(path);
+}
+
+
+static void check_files()
+{
+  std::string doc = cursor_doc();
+
+  check_mapped(doc + "trailing", true, "mapped document wrong");
+  check_mapped("", false, "empty file not mapped as empty");
+  check_mapped(std::string_view(doc).substr(0, doc.size() - 1), false,
+               "truncated file wrong");
+  check_mapped(std::string_view(doc).substr(0, doc.size() / 2), false,
+               "truncated file wrong");
+
+  errno = 0;
+  tns::mapped_file missing("/nonexistent/core_harness.tns");
+  expect(!missing && errno == ENOENT && missing.view().empty(),
+         "missing file mapped");
+}
+
+#endif  // TNS_HAVE_MMAP
+
+
+#ifdef TNS_HAVE_SPAN
+
+//  Check a render into caller-supplied buffers: exactly big enough, one
+//  byte short, and split across a chain at every possible point.
+static void check_buffers()
+{
+  shape s;
+  std::string want = good_shape();
+  tns::loads(want, s);
+  size_t size = want.size();
+  std::vector<char> buf(size + 1, '@');
+  char *end;
+
+  end = tns::dumps_into(buf.data(), s);
+  expect(end == buf.data() + size && std::string_view(buf.data(), size) ==
+         want && buf[size] == '@', "dumps_into(char*) wrong");
+
+  buf.assign(size + 1, '@');
+  expect(tns::dumps_into(std::span<char>(buf.data(), size), s) == size &&
+         std::string_view(buf.data(), size) == want && buf[size] == '@',
+         "dumps_into(span) wrong for an exact fit");
+  buf.assign(size + 1, '@');
+  expect(tns::dumps_into(std::span<char>(buf.data(), size - 1), s) == size &&
+         std::count(buf.begin(), buf.end(), '@') == (long)(size + 1),
+         "dumps_into(span) wrote into a span too small");
+  expect(tns::dumps_into(std::span<char>(), s) == size,
+         "dumps_into(span) wrong size for an empty span");
+
+  //  Every split point falls within some put(), so this crosses the
+  //  boundary in the middle of prefixes, payloads and tags alike.  An
+  //  empty buffer in the middle of the chain must be skipped over.
+  bool ok = true;
+  for(size_t k = 0; k <= size; k++) {
+      std::vector<char> a(k, '@'), b(size - k + 1, '@');
+      char none[1] = {'@'};
+      std::span<char> chain[] = {std::span<char>(a),
+                                 std::span<char>(none, size_t(0)),
+                                 std::span<char>(b.data(), size - k)};
+      std::string got;
+      ok = ok && tns::dumps_into(std::span<const std::span<char>>(chain), s)
+                 == size;
+      got.append(a.begin(), a.end());
+      got.append(b.begin(), b.end() - 1);
+      ok = ok && got == want && b[size - k] == '@' && none[0] == '@';
+  }
+  expect(ok, "dumps_into(chain) wrong when split across buffers");
+
+  std::vector<char> a(size / 2, '@'), b(size - size / 2 - 1, '@');
+  std::span<char> shorter[] = {std::span<char>(a), std::span<char>(b)};
+  expect(tns::dumps_into(std::span<const std::span<char>>(shorter), s) ==
+         size && std::count(a.begin(), a.end(), '@') == (long)a.size() &&
+         std::count(b.begin(), b.end(), '@') == (long)b.size(),
+         "dumps_into(chain) wrote into a chain too small");
+}
+
+
+#ifdef TNS_HAVE_IOVEC
+
+//  Check iovecs against dumps(), with strings either side of min_ref.
+static void check_iovecs()
+{
+  const size_t min_ref = 64;
+  std::vector<std::string> strings = {std::string(min_ref - 1, 'a'),
+                                      std::string(min_ref, 'b'),
+                                      std::string(min_ref + 1, 'c'),
+                                      "", "short"};
+  std::string want = tns::dumps(strings);
+  std::vector<char> scratch(want.size(), '@');
+  std::vector<struct iovec> iov;
+  size_t needed;
+
+  //  Leave an iovec already in the list, which must be kept.
+  iov.push_back(iovec{nullptr, 0});
+  needed = tns::dumps_iov(std::span<char>(scratch), iov, strings, min_ref);
+
+  std::string got;
+  size_t refs = 0;
+  for(size_t i = 1; i < iov.size(); i++) {
+      const char *base = static_cast<const char*>(iov[i].iov_base);
+      got.append(base, iov[i].iov_len);
+      if(base == strings[1].data() || base == strings[2].data()) {
+          refs++;
+      } else if(base < scratch.data() ||
+                base + iov[i].iov_len > scratch.data() + needed) {
+          refs += 100;
+      }
+  }
+  expect(iov.size() > 1 && iov[0].iov_base == nullptr,
+         "dumps_iov replaced the iovecs it was given");
+  expect(got == want, "gathered iovecs differ from dumps");
+  expect(refs == 2, "only strings of at least min_ref should be in place");
+  expect(needed == want.size() - 2 * min_ref - 1,
+         "dumps_iov needed the wrong amount of scratch space");
+  //  Everything copied is contiguous in scratch, so it's merged into one
+  //  iovec between each pair of references.
+  expect(iov.size() == 1 + 5, "copied bytes not merged into few iovecs");
+
+  //  Exactly enough scratch space works, one byte less leaves iov alone.
+  iov.assign(1, iovec{nullptr, 0});
+  expect(tns::dumps_iov(std::span<char>(scratch.data(), needed), iov,
+                        strings, min_ref) == needed && iov.size() == 6,
+         "dumps_iov failed with exactly enough scratch space");
+  iov.assign(1, iovec{nullptr, 0});
+  expect(tns::dumps_iov(std::span<char>(scratch.data(), needed - 1), iov,
+                        strings, min_ref) == needed && iov.size() == 1,
+         "dumps_iov didn't fail cleanly with too little scratch space");
+
+  //  With min_ref past every string, it's all one copy just like dumps().
+  iov.clear();
+  expect(tns::dumps_iov(std::span<char>(scratch), iov, strings,
+                        min_ref + 2) == want.size() && iov.size() == 1 &&
+         std::string_view(static_cast<const char*>(iov[0].iov_base),
+                          iov[0].iov_len) == want,
+         "dumps_iov referred to a string shorter than min_ref");
+}
+
+#endif  // TNS_HAVE_IOVEC
+
+#endif  // TNS_HAVE_SPAN
+
+
+int main()
+{
+  check_decode();
+  check_failures();
+  check_literals();
+  check_cursors(cursor_doc());
+  check_dom();
+#ifdef TNS_HAVE_PMR
+  check_document();
+#endif
+#ifdef TNS_HAVE_MMAP
+  check_files();
+#endif
+#ifdef TNS_HAVE_SPAN
+  check_buffers();
+#ifdef TNS_HAVE_IOVEC
+  check_iovecs();
+#endif
+#endif
+
+  printf("%s\tchecks=%zu\tfailures=%zu\n", failures == 0 ? "ok" : "FAILED",
+         checks, failures);
+  return failures == 0 ? 0 : 1;
+}
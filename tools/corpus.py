@@ -0,0 +1,208 @@
+"""
+corpus.py:  generate realistic corpora of tnetstrings for the benchmarks
+
+get_random_object() in the test suite builds uniform random trees, which
+is great for finding bugs but looks nothing like real traffic.  This makes
+messages of a few typical shapes instead:
+
+    :headers:  dicts of request headers, as sent by Mongrel2
+    :reply:    handler replies, with bodies of widely varying size
+    :ids:      lists of integer ids
+    :numbers:  lists of floats
+    :blob:     big binary strings
+    :config:   deeply nested dicts of mixed values
+
+Sizes are drawn from log-normal distributions, which can all be stretched
+or shrunk with the scale factor.  The mix of shapes is given as weights,
+e.g. "headers=4,reply=4,blob=1".  The same seed always gives the same
+corpus, which is written out as a file of concatenated tnetstrings:
+
+    python tools/corpus.py [-n count] [-s seed] [-m mix] [-S scale] -o FILE
+
+The benchmarks take such a file with their --corpus option, and use
+load_corpus() from this module to split it back into messages.
+"""
+
+import sys
+import random
+import optparse
+import binascii
+
+import tnetstring
+
+
+HEADER_NAMES = ("host","user-agent","accept","accept-language",
+                "accept-encoding","cookie","referer","connection")
+
+
+def _size(r,mu,sigma,scale,limit):
+    """Draw a size from a log-normal distribution, scaled and capped."""
+    return min(int(r.lognormvariate(mu,sigma) * scale),limit)
+
+
+def make_headers(r,scale=1.0):
+    """Make a dict of headers like Mongrel2 sends with each request."""
+    parts = ["x" * r.randint(1,12) for _ in xrange(r.randint(1,4))]
+    path = "/" + "/".join(parts)
+    headers = {"PATH":path,"URI":path,"PATTERN":"/","VERSION":"HTTP/1.1",
+               "METHOD":r.choice(("GET","GET","GET","POST")),
+               "x-forwarded-for":"10.0.%d.%d" % (r.randint(0,255),
+                                                 r.randint(0,255))}
+    for name in r.sample(HEADER_NAMES,r.randint(2,len(HEADER_NAMES))):
+        headers[name] = "v" * _size(r,3,1,scale,4096)
+    if r.random() < 0.3:
+        headers["QUERY"] = "q=" + "y" * r.randint(1,40)
+    return headers
+
+
+def make_reply(r,scale=1.0):
+    """Make a handler reply, with a body of widely varying size."""
+    body = "b" * _size(r,6,2.5,scale,512 * 1024)
+    return {"code":r.choice((200,200,200,304,404)),"status":"OK",
+            "headers":{"Content-Type":"text/html",
+                       "Content-Length":str(len(body))},
+            "body":body}
+
+
+def make_ids(r,scale=1.0):
+    """Make a list of integer ids, e.g. connections to reply to."""
+    return [r.randint(0,2**31) for _ in xrange(_size(r,3,1,scale,100000))]
+
+
+def make_numbers(r,scale=1.0):
+    """Make a list of floats, e.g. a series of measurements."""
+    return [r.gauss(0,1000) for _ in xrange(_size(r,4,1.5,scale,100000))]
+
+
+def make_blob(r,scale=1.0):
+    """Make a big string of random bytes."""
+    n = _size(r,10,1.5,scale,4 * 1024 * 1024)
+    if n == 0:
+        return ""
+    return binascii.unhexlify("%0*x" % (2 * n,r.getrandbits(8 * n)))
+
+
+def make_config(r,scale=1.0,depth=0):
+    """Make a nested configuration dict, a few levels deep."""
+    config = {}
+    #  Nesting gets less likely with depth, so the trees stay bounded.
+    nest = 0.5 * 0.6 ** depth
+    for i in xrange(max(1,_size(r,1.5,0.7,scale,1000))):
+        key = "%s_%d" % (r.choice(("opt","path","limit","name","rule")),i)
+        what = r.random()
+        if what < nest * 0.75:
+            config[key] = make_config(r,scale,depth + 1)
+        elif what < nest:
+            config[key] = [make_config(r,scale,depth + 1)
+                           for _ in xrange(r.randint(0,3))]
+        else:
+            what = r.random()
+            if what < 0.4:
+                config[key] = r.randint(0,65536)
+            elif what < 0.6:
+                config[key] = r.choice((True,False,None))
+            else:
+                config[key] = "s" * _size(r,2.5,1,scale,4096)
+    return config
+
+
+SHAPES = {
+    "headers": make_headers,
+    "reply": make_reply,
+    "ids": make_ids,
+    "numbers": make_numbers,
+    "blob": make_blob,
+    "config": make_config,
+}
+
+DEFAULT_MIX = "headers=4,reply=4,ids=1,numbers=1,blob=1,config=1"
+
+
+def parse_mix(mix):
+    """Parse a mix string like "headers=4,blob=1" into (shape,weight) pairs."""
+    pairs = []
+    for item in mix.split(","):
+        (name,_,weight) = item.partition("=")
+        if name not in SHAPES:
+            raise ValueError("unknown message shape: " + name)
+        pairs.append((name,float(weight or 1)))
+    return pairs
+
+
+def generate(count,seed=7,mix=DEFAULT_MIX,scale=1.0):
+    """Generate a list of count objects with the given mix of shapes."""
+    r = random.Random(seed)
+    pairs = parse_mix(mix)
+    total = sum(w for (_,w) in pairs)
+    objects = []
+    for _ in xrange(count):
+        pick = r.random() * total
+        for (name,weight) in pairs:
+            pick -= weight
+            if pick < 0:
+                break
+        objects.append(SHAPES[name](r,scale))
+    return objects
+
+
+def write_corpus(file,objects):
+    """Write objects to a file as concatenated tnetstrings."""
+    for obj in objects:
+        file.write(tnetstring.dumps(obj))
+
+
+def read_corpus(file):
+    """Read a file of concatenated tnetstrings into a list of strings."""
+    data = file.read()
+    messages = []
+    pos = 0
+    while pos < len(data):
+        colon = data.find(":",pos,pos + 10)
+        if colon == -1 or not data[pos:colon].isdigit():
+            raise ValueError("not a tnetstring corpus: bad length prefix")
+        end = colon + 2 + int(data[pos:colon])
+        if end > len(data):
+            raise ValueError("not a tnetstring corpus: truncated message")
+        messages.append(data[pos:end])
+        pos = end
+    return messages
+
+
+def load_corpus(filename):
+    """Read the corpus file with the given name into a list of strings."""
+    f = open(filename,"rb")
+    try:
+        return read_corpus(f)
+    finally:
+        f.close()
+
+
+def main(argv):
+    parser = optparse.OptionParser()
+    parser.add_option("-n","--count",type="int",default=10000,
+                      help="number of messages to generate")
+    parser.add_option("-s","--seed",type="int",default=7,
+                      help="random seed")
+    parser.add_option("-m","--mix",default=DEFAULT_MIX,
+                      help="weights for each message shape")
+    parser.add_option("-S","--scale",type="float",default=1.0,
+                      help="scale factor for message sizes")
+    parser.add_option("-o","--output",default=None,
+                      help="file to write, default stdout")
+    (opts,args) = parser.parse_args(argv[1:])
+    try:
+        objects = generate(opts.count,opts.seed,opts.mix,opts.scale)
+    except ValueError, e:
+        parser.error(str(e))
+    if opts.output is None:
+        write_corpus(sys.stdout,objects)
+    else:
+        f = open(opts.output,"wb")
+        try:
+            write_corpus(f,objects)
+        finally:
+            f.close()
+
+
+if __name__ == "__main__":
+    main(sys.argv)
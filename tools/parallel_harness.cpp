@@ -0,0 +1,233 @@
+//
+//  parallel_harness.cpp:  check tns::parallel_parser against document::parse
+//
+//  A parallel_parser must produce exactly the nodes that a serial parse of
+//  the same input would, whatever the number of threads or the chunk size,
+//  and must fail with the same error when the input is broken.  This builds
+//  a few big random documents, including ones with big containers nested
+//  inside others so that they get split up recursively, and parses each of
+//  them with a range of pool sizes and chunk sizes, comparing every node
+//  with the serial result.  It then corrupts random bytes of the inputs
+//  and checks that both parsers agree on each result.
+//
+//  Build it from the top of the source tree with something like:
+//
+//    cc -O2 -c -o tns_dom.o tnetstring/tns_dom.c
+//    c++ -O2 -std=c++17 -pthread -Itnetstring -o parallel_harness tools/parallel_harness.cpp tns_dom.o
+//
+//  Options:
+//
+//    -n N      number of records in the biggest document (default 20000)
+//    -k N      number of corrupted inputs to try (default 200)
+//    -s SEED   random seed (default 1)
+//
+//  It prints a summary line and exits with status 0 if everything matched.
+//
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "tns_parallel.hpp"
+
+
+struct record {
+  std::string name;
+  int64_t id;
+  std::vector<double> samples;
+  std::optional<bool> active;
+  std::vector<std::string> tags;
+};
+TNS_FIELDS(record, name, id, samples, active, tags)
+
+struct group {
+  std::string name;
+  std::vector<record> records;
+};
+TNS_FIELDS(group, name, records)
+
+struct batch {
+  std::string kind;
+  std::vector<record> records;
+  std::vector<std::vector<record>> lists;
+  std::vector<group> groups;
+};
+TNS_FIELDS(batch, kind, records, lists, groups)
+
+
+static record make_record(std::mt19937_64 &rng)
+{
+  record r;
+  size_t n;
+
+  //  Mostly small records, with the occasional one bigger than a chunk.
+  n = rng() % 500 == 0 ? 5000 + rng() % 50000 : rng() % 40;
+  r.name.assign(n, static_cast<char>('a' + rng() % 26));
+  r.id = static_cast<int64_t>(rng()) >> (rng() % 63);
+  for(n = rng() % 8; n > 0; n--) {
+      r.samples.push_back(static_cast<double>(rng() % 100000) / 7.0);
+  }
+  if(rng() % 3 != 0) {
+      r.active = rng() % 2 == 0;
+  }
+  for(n = rng() % 5; n > 0; n--) {
+      r.tags.push_back(std::string(1 + rng() % 12, 't'));
+  }
+  return r;
+}
+
+
+//  Check that two documents hold the same nodes, pointing at the same data.
+static bool same_nodes(const tns::document &a, const tns::document &b)
+{
+  const tns_node *x;
+  const tns_node *y;
+
+  if(a.node_count() != b.node_count()) {
+      return false;
+  }
+  if(a.node_count() == 0) {
+      return true;
+  }
+  x = a.root().raw();
+  y = b.root().raw();
+  for(size_t i = 0; i < a.node_count(); i++) {
+      if(x[i].data != y[i].data || x[i].len != y[i].len ||
+         x[i].size != y[i].size || x[i].count != y[i].count ||
+         x[i].type != y[i].type) {
+          return false;
+      }
+  }
+  return true;
+}
+
+
+//  Parse 'data' both ways, and check that the results agree.
+static bool check(const char *name, tns::parallel_parser &pp,
+                  std::string_view data)
+{
+  tns::document serial;
+  tns::document parallel;
+  std::string_view srest;
+  std::string_view prest;
+  bool sok = serial.parse(data, &srest);
+  bool pok = pp.parse(parallel, data, &prest);
+
+  if(sok != pok) {
+      fprintf(stderr, "parallel_harness: %s: serial %s but parallel %s "
+                      "(threads=%u chunk=%zu)\n", name,
+              sok ? "succeeded" : "failed", pok ? "succeeded" : "failed",
+              pp.threads(), pp.chunk_size());
+      return false;
+  }
+  if(!sok) {
+      if(std::string(serial.error()) != parallel.error()) {
+          fprintf(stderr, "parallel_harness: %s: errors differ "
+                          "(threads=%u chunk=%zu)\n", name, pp.threads(),
+                  pp.chunk_size());
+          return false;
+      }
+      return true;
+  }
+  if(srest.data() != prest.data() || srest.size() != prest.size() ||
+     !same_nodes(serial, parallel)) {
+      fprintf(stderr, "parallel_harness: %s: nodes differ "
+                      "(threads=%u chunk=%zu)\n", name, pp.threads(),
+              pp.chunk_size());
+      return false;
+  }
+  return true;
+}
+
+
+int main(int argc, char **argv)
+{
+  size_t count = 20000;
+  size_t corruptions = 200;
+  unsigned long long seed = 1;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:k:s:")) != -1) {
+      switch(opt) {
+        case 'n':
+          count = std::max(1UL, strtoul(optarg, NULL, 10));
+          break;
+        case 'k':
+          corruptions = strtoul(optarg, NULL, 10);
+          break;
+        case 's':
+          seed = strtoull(optarg, NULL, 10);
+          break;
+        default:
+          fprintf(stderr, "usage: %s [-n count] [-k corruptions] "
+                          "[-s seed]\n", argv[0]);
+          return 2;
+      }
+  }
+
+  //  A flat list of records with trailing data, a dict holding lists and
+  //  dicts big enough to be split in turn, and a list too small to split.
+  std::mt19937_64 rng(seed);
+  std::vector<record> records;
+  for(size_t i = 0; i < count; i++) {
+      records.push_back(make_record(rng));
+  }
+  batch b;
+  b.kind = "batch";
+  b.records.assign(records.begin(), records.begin() + count / 2);
+  for(size_t g = 0; g < 4; g++) {
+      b.lists.emplace_back(records.begin() + g * count / 8,
+                           records.begin() + (g + 1) * count / 8 - g);
+      b.groups.push_back(group{"group" + std::to_string(g), b.lists.back()});
+  }
+  std::vector<std::string> inputs;
+  inputs.push_back(tns::dumps(records) + "3:abc,");
+  inputs.push_back(tns::dumps(b));
+  inputs.push_back(tns::dumps(std::vector<record>(records.begin(),
+                                                  records.begin() + 3)));
+
+  bool ok = true;
+  size_t checks = 0;
+  size_t bytes = 0;
+  for(unsigned threads : {1u, 2u, 3u, 4u, 8u}) {
+      for(size_t chunk : {64UL, 1000UL, 4096UL, 65536UL}) {
+          tns::parallel_parser pp(threads, chunk);
+          for(const std::string &input : inputs) {
+              //  Twice, so that the pool and its arenas get reused.
+              for(int round = 0; round < 2; round++) {
+                  ok = check("input", pp, input) && ok;
+                  checks++;
+                  bytes += input.size();
+              }
+          }
+      }
+  }
+
+  //  Break the inputs in random places; mostly in the structure, since
+  //  that's what the planning has to cope with.
+  const char breakers[] = ":,#^!~]}0123456789x";
+  tns::parallel_parser pp(4, 1000);
+  for(size_t i = 0; i < corruptions; i++) {
+      std::string input = inputs[i % 2];
+      size_t n = 1 + rng() % 3;
+      while(n-- > 0) {
+          input[rng() % input.size()] =
+              breakers[rng() % (sizeof(breakers) - 1)];
+      }
+      if(rng() % 4 == 0) {
+          input.resize(rng() % input.size());
+      }
+      ok = check("corrupted input", pp, input) && ok;
+      checks++;
+      bytes += input.size();
+  }
+
+  printf("%s\tchecks=%zu\tbytes=%zu\n", ok ? "ok" : "FAILED", checks, bytes);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,351 @@
+//
+//  stream_harness.cpp:  drive tns::stream over a local socketpair
+//
+//  This checks the incremental parser in tns_stream.hpp against the real
+//  thing: a writer thread sends a batch of random records down one end of
+//  a socketpair, in writes of random sizes, and the reader polls the other
+//  end and feeds whatever each read returns straight into a tns::stream.
+//  Every value that comes out must match the result of parsing the same
+//  message in one go with tns::parser.  A few malformed streams, and a
+//  handler that throws, are then checked to fail cleanly.
+//
+//  Build it from the top of the source tree with something like:
+//
+//    c++ -O2 -std=c++20 -pthread -Itnetstring -o stream_harness tools/stream_harness.cpp
+//
+//  Options:
+//
+//    -n N      number of messages to send (default 10000)
+//    -c SIZE   largest single write, in bytes (default 4096)
+//    -r SIZE   read buffer size, in bytes (default 4096)
+//    -s SEED   random seed (default 1)
+//
+//  It prints a summary line and exits with status 0 if everything matched.
+//
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tns_stream.hpp"
+
+
+struct record {
+  std::string name;
+  int64_t id;
+  std::vector<double> samples;
+  std::optional<bool> active;
+  std::vector<std::string> tags;
+};
+TNS_FIELDS(record, name, id, samples, active, tags)
+
+
+//  A digest of a parsed value: the number of nodes, and a hash over the
+//  types and payloads of the leaves in order.  Enough to tell whether two
+//  parses of a message saw the same thing.
+struct digest {
+  size_t nodes = 0;
+  uint64_t hash = 1469598103934665603ULL;
+
+  void mix(char type, std::string_view payload)
+  {
+    hash = (hash ^ static_cast<unsigned char>(type)) * 1099511628211ULL;
+    for(char c : payload) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    nodes++;
+  }
+
+  void add(const digest &item)
+  {
+    hash = (hash ^ item.hash) * 1099511628211ULL;
+    nodes += item.nodes;
+  }
+
+  bool operator==(const digest &o) const
+  {
+    return nodes == o.nodes && hash == o.hash;
+  }
+};
+
+
+struct digester : tns::parser<digester, digest> {
+  //  A string payload that makes the handler throw, to test recovery.
+  std::string_view throw_on;
+
+  bool parse_string(std::string_view p, digest &out)
+  {
+    if(!throw_on.empty() && p == throw_on) {
+        throw std::runtime_error("stream_harness: thrown from handler");
+    }
+    out.mix(',', p);
+    return true;
+  }
+  bool parse_integer(std::string_view p, digest &out)
+  {
+    int64_t i;
+    out.mix('#', p);
+    return tns::detail::parse_integer(p, i);
+  }
+  bool parse_float(std::string_view p, digest &out)
+  {
+    double d;
+    out.mix('^', p);
+    return tns::detail::parse_float(p, d);
+  }
+  bool get_null(digest &out) { out.mix('~', ""); return true; }
+  bool get_true(digest &out) { out.mix('!', "true"); return true; }
+  bool get_false(digest &out) { out.mix('!', "false"); return true; }
+  bool new_list(digest &out) { out.mix(']', ""); return true; }
+  bool add_to_list(digest &list, digest &&item)
+  {
+    list.add(item);
+    return true;
+  }
+  bool new_dict(digest &out) { out.mix('}', ""); return true; }
+  bool add_to_dict(digest &dict, digest &&key, digest &&item)
+  {
+    dict.add(key);
+    dict.add(item);
+    return true;
+  }
+};
+
+
+static record make_record(std::mt19937_64 &rng)
+{
+  record r;
+  size_t n;
+
+  //  Mostly small records, with the occasional big one that's sure to
+  //  arrive over several reads.
+  n = rng() % 50 == 0 ? 20000 + rng() % 200000 : rng() % 40;
+  r.name.assign(n, static_cast<char>('a' + rng() % 26));
+  r.id = static_cast<int64_t>(rng()) >> (rng() % 63);
+  for(n = rng() % 8; n > 0; n--) {
+      r.samples.push_back(static_cast<double>(rng() % 100000) / 7.0);
+  }
+  if(rng() % 3 != 0) {
+      r.active = rng() % 2 == 0;
+  }
+  for(n = rng() % 5; n > 0; n--) {
+      r.tags.push_back(std::string(1 + rng() % 12, 't'));
+  }
+  return r;
+}
+
+
+static void write_all(int fd, std::string_view data, size_t max_write,
+                      std::mt19937_64 &rng)
+{
+  while(!data.empty()) {
+      size_t n = std::min(data.size(), 1 + rng() % max_write);
+      ssize_t res = write(fd, data.data(), n);
+      if(res < 0) {
+          perror("stream_harness: write");
+          exit(1);
+      }
+      data.remove_prefix(res);
+  }
+}
+
+
+//  Feed a whole malformed stream in one byte at a time, and check it fails.
+static bool check_error(const char *name, std::string_view data)
+{
+  digester d;
+  tns::stream<digester, digest> s(d);
+
+  while(!data.empty()) {
+      std::string_view one = data.substr(0, 1);
+      data.remove_prefix(1);
+      switch(s.feed(one)) {
+        case tns::stream_status::error:
+          return true;
+        case tns::stream_status::ready:
+          s.take();
+          break;
+        case tns::stream_status::more:
+          break;
+      }
+  }
+  fprintf(stderr, "stream_harness: %s was not rejected\n", name);
+  return false;
+}
+
+
+//  A handler that throws must leave the stream failed, not stuck waiting
+//  for input it will never consume, and reset() must bring it back.
+static bool check_exception()
+{
+  digester d;
+  tns::stream<digester, digest> s(d);
+  std::string_view data = "4:boom,1:b,";
+  std::string_view more = "1:b,";
+  bool thrown = false;
+
+  d.throw_on = "boom";
+  try {
+      s.feed(data);
+  } catch(const std::runtime_error &) {
+      thrown = true;
+  }
+  if(!thrown) {
+      fprintf(stderr, "stream_harness: the handler's exception was lost\n");
+      return false;
+  }
+  for(int i = 0; i < 3; i++) {
+      if(s.feed(more) != tns::stream_status::error || s.error() == NULL) {
+          fprintf(stderr, "stream_harness: stream went on after an "
+                          "exception\n");
+          return false;
+      }
+  }
+  d.throw_on = std::string_view();
+  s.reset();
+  if(s.feed(more) != tns::stream_status::ready || !more.empty()) {
+      fprintf(stderr, "stream_harness: reset() didn't recover from an "
+                      "exception\n");
+      return false;
+  }
+  return true;
+}
+
+
+int main(int argc, char **argv)
+{
+  size_t count = 10000;
+  size_t max_write = 4096;
+  size_t read_size = 4096;
+  unsigned long long seed = 1;
+  int fds[2];
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:c:r:s:")) != -1) {
+      switch(opt) {
+        case 'n':
+          count = strtoul(optarg, NULL, 10);
+          break;
+        case 'c':
+          max_write = std::max(1UL, strtoul(optarg, NULL, 10));
+          break;
+        case 'r':
+          read_size = std::max(1UL, strtoul(optarg, NULL, 10));
+          break;
+        case 's':
+          seed = strtoull(optarg, NULL, 10);
+          break;
+        default:
+          fprintf(stderr, "usage: %s [-n count] [-c max_write] "
+                          "[-r read_size] [-s seed]\n", argv[0]);
+          return 2;
+      }
+  }
+
+  //  Build the messages, and what each one should parse to.
+  std::mt19937_64 rng(seed);
+  std::vector<std::string> messages;
+  std::vector<digest> expected;
+  digester d;
+  size_t total = 0;
+  for(size_t i = 0; i < count; i++) {
+      messages.push_back(tns::dumps(make_record(rng)));
+      expected.emplace_back();
+      if(!d.parse(messages.back(), expected.back())) {
+          fprintf(stderr, "stream_harness: failed to parse message %zu\n", i);
+          return 1;
+      }
+      total += messages.back().size();
+  }
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+      perror("stream_harness: socketpair");
+      return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::thread writer([&]() {
+      std::mt19937_64 wrng(seed + 1);
+      for(const std::string &msg : messages) {
+          write_all(fds[0], msg, max_write, wrng);
+      }
+      close(fds[0]);
+  });
+
+  tns::stream<digester, digest> s(d);
+  std::vector<char> buf(read_size);
+  size_t received = 0;
+  size_t reads = 0;
+  bool ok = true;
+  for(;;) {
+      struct pollfd pfd = {fds[1], POLLIN, 0};
+      if(poll(&pfd, 1, -1) == -1) {
+          perror("stream_harness: poll");
+          return 1;
+      }
+      ssize_t n = read(fds[1], buf.data(), buf.size());
+      if(n < 0) {
+          perror("stream_harness: read");
+          return 1;
+      }
+      if(n == 0) {
+          break;
+      }
+      reads++;
+      std::string_view data(buf.data(), n);
+      while(ok && !data.empty()) {
+          switch(s.feed(data)) {
+            case tns::stream_status::ready:
+              if(received >= count || !(s.take() == expected[received])) {
+                  fprintf(stderr, "stream_harness: message %zu differs\n",
+                          received);
+                  ok = false;
+              }
+              received++;
+              break;
+            case tns::stream_status::error:
+              fprintf(stderr, "stream_harness: %s\n", s.error());
+              ok = false;
+              break;
+            case tns::stream_status::more:
+              break;
+          }
+      }
+  }
+  writer.join();
+  close(fds[1]);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  if(ok && received != count) {
+      fprintf(stderr, "stream_harness: got %zu of %zu messages\n",
+              received, count);
+      ok = false;
+  }
+
+  ok = check_error("a bad length prefix", "3:abc,x:") && ok;
+  ok = check_error("a padded length prefix", "01:a,") && ok;
+  ok = check_error("an empty length prefix", ":,") && ok;
+  ok = check_error("a bad type tag", "3:abc?") && ok;
+  ok = check_error("a bad boolean", "4:trux!") && ok;
+  ok = check_error("a float with leading whitespace", "4:\n1.5^") && ok;
+  ok = check_error("a broken list", "5:1:ab,]") && ok;
+  ok = check_error("an overlong length", "99999999999:") && ok;
+  ok = check_exception() && ok;
+
+  printf("%s\tmessages=%zu\tbytes=%zu\treads=%zu\tbuffered=%zu\t"
+         "mb_per_sec=%.1f\n", ok ? "ok" : "FAILED", received, total, reads,
+         s.buffered_bytes(), total / elapsed.count() / 1e6);
+  return ok ? 0 : 1;
+}